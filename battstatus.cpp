@@ -16,9 +16,11 @@ to see the usage information.
 
 To build using Visual Studio 2008 (with TR1 support) or later:
 cl /W4 /wd4127 /wd4530 battstatus.cpp user32.lib powrprof.lib setupapi.lib
+   ws2_32.lib
 
 To build using MinGW or MinGW-w64:
 g++ -Wall -std=gnu++11 -o battstatus battstatus.cpp -lpowrprof -lsetupapi -luuid
+    -lws2_32
 
 https://github.com/jay/battstatus
 *//*
@@ -45,6 +47,9 @@ GNU General Public License for more details.
 #endif
 
 #define WIN32_NO_STATUS
+/* winsock2 must be included before windows.h */
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #undef WIN32_NO_STATUS
 
@@ -67,13 +72,20 @@ GNU General Public License for more details.
 #include <setupapi.h>
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <time.h>
 
+#include <algorithm>
 #include <deque>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <new>
 #include <sstream>
 #include <string>
 #include <type_traits>
@@ -140,9 +152,54 @@ bool monitor = true;
 bool prevent_sleep;
 bool console_title;
 unsigned verbose;
+const char *mqtt_broker;  // --mqtt <host>[:<port>]
+const char *mqtt_topic;   // --mqtt-topic <prefix>
+bool eventlog;            // --eventlog
+bool dashboard;           // --tui
+char **measure_argv;      // --measure [--] <command> [<args>...]
+int measure_argc;
+DWORD measure_idle;       // --measure-idle <duration>, in seconds
+bool baseline;            // --baseline
+bool show_stats;          // --stats
+bool telemetry;           // --telemetry
+bool charge_profile;      // --charge-profile
+bool drain_profile;       // --drain-profile
+bool drain_report;        // --drain-report
+DWORD coalesce_seconds;   // --coalesce <time>
+DWORD coalesce_check;     // --coalesce-check <time>, in seconds
+DWORD critical_benchmark; // --critical-benchmark <time>, in seconds
+const char *log_cat;      // --log-cat <file>
+DWORD log_benchmark;      // --log-benchmark <time>, in seconds
+bool low_impact;          // --low-impact
+bool align_polls;         // --align-polls
+bool degrade;             // --degrade
+const char *trace_path;   // --record <file>
+const char *replay_trace; // --replay <file> or synthetic:<n>
+DWORD replay_threshold = 10;  // --replay-threshold <n>[%]
+bool replay_save;         // --replay-save
+DWORD trace_benchmark;    // --trace-benchmark <time>, in seconds
+DWORD soak;               // --soak <days>
+const char *plot_trace;   // --plot <file>
+DWORD plot_points = 1000; // --plot-points <n>
+bool plot_envelope;       // --plot-envelope
+DWORD plot_last;          // --plot-last <duration>, in seconds
+const char *ship_trace;   // --ship <file>
+const char *collector;    // --collector <host>[:<port>]
+const char *compare_path[2];  // --compare <A> <B>
+DWORD lease_interval_ms;  // --lease <rate>[,<duration>]
+DWORD lease_duration_ms;
+DWORD baseline_ci = 5;    // --baseline-ci <n>[%]
+bool baseline_ci_relative = true;
 
 RTL_OSVERSIONINFOW os;
 
+/* The maximum timer interval in 100ns units, from NtQueryTimerResolution. */
+ULONG MaximumTimerInterval;
+
+/* When the monitor window last received WM_POWERBROADCAST, if ever. */
+bool power_broadcast_seen;
+DWORD power_broadcast_tick;
+
 /* There are certain times when the battery charge state should be suppressed,
    such as when it continually changes in a short period of time and verbose
    mode is disabled. */
@@ -598,6 +655,7 @@ BOOL WINAPI EnumBattInterfaces(BATTINTENUMPROC EnumProc, void *cbdata)
           (PSP_DEVICE_INTERFACE_DETAIL_DATA_W)calloc(1, cbRequired);
 
         if(!pdidd) {
+          SetupDiDestroyDeviceInfoList(hdev);
           SetLastError(ERROR_NOT_ENOUGH_MEMORY);
           return FALSE;
         }
@@ -610,6 +668,7 @@ BOOL WINAPI EnumBattInterfaces(BATTINTENUMPROC EnumProc, void *cbdata)
 
           if(!device.path) {
             free(pdidd);
+            SetupDiDestroyDeviceInfoList(hdev);
             SetLastError(ERROR_NOT_ENOUGH_MEMORY);
             return FALSE;
           }
@@ -638,14 +697,26 @@ BOOL WINAPI EnumBattInterfaces(BATTINTENUMPROC EnumProc, void *cbdata)
       CloseHandle(device.handle);
 
     if(!rc) {
+      SetupDiDestroyDeviceInfoList(hdev);
       SetLastError(gle);
       return FALSE;
     }
   }
 
+  SetupDiDestroyDeviceInfoList(hdev);
   return TRUE;
 }
 
+/* Free the strings that EnumBattInterfacesProc allocated for each battery. */
+void FreeBatteries(vector<battery> *batteries)
+{
+  for(size_t i = 0; i < batteries->size(); ++i) {
+    free((*batteries)[i].path);
+    free((*batteries)[i].unique_id);
+  }
+  batteries->clear();
+}
+
 void ShowIndividualBatteryHealth()
 {
   const char *borderline = "========================================="
@@ -707,6 +778,8 @@ wss << borderline <<
 
   wss << "\n" << borderline;
   wcout << endl << wss.str() << endl;
+
+  FreeBatteries(&batteries);
 }
 
 string ACLineStatusStr(unsigned ACLineStatus)
@@ -833,6 +906,376 @@ void ShowPowerStatus(const SYSTEM_POWER_STATUS *status)
   cout << flush;
 }
 
+/* Output policy (options --hysteresis and --rate-limit).
+
+Hysteresis is the minimum amount a field has to move away from the value that
+was last shown before the change is shown. It applies to the full status shown
+in verbose mode and to the percent in the default one-liners. By default any
+change is shown. A change to or from an unknown value is always shown.
+
+The rate limit is a token bucket per class of output: status one-liners,
+verbose full status, warnings and errors. A limit of <count>/<period> allows a
+burst of up to <count> outputs and then on average <count> per <period>.
+Output over the limit is dropped, and how many were dropped is shown with the
+next output of that class. By default there is no limit.
+*/
+struct hysteresis_policy {
+  DWORD percent;        // BatteryLifePercent
+  DWORD lifetime;       // BatteryLifeTime, in seconds
+  DWORD full_lifetime;  // BatteryFullLifeTime, in seconds
+};
+
+struct hysteresis_policy hysteresis = { 1, 1, 1 };
+
+enum outclass {
+  OUTCLASS_STATUS,   // one-liners
+  OUTCLASS_VERBOSE,  // full status in verbose mode
+  OUTCLASS_WARNING,
+  OUTCLASS_ERROR,
+  OUTCLASS_COUNT
+};
+
+const char *outclass_names[OUTCLASS_COUNT] = {
+  "status", "verbose", "warning", "error"
+};
+
+struct token_bucket {
+  bool enabled;
+  double capacity;       // maximum tokens (burst size)
+  double tokens;
+  double tokens_per_ms;  // refill rate
+  DWORD tick;            // when tokens was last updated
+  DWORD dropped;         // outputs dropped since the last one allowed
+};
+
+struct token_bucket rate_limit[OUTCLASS_COUNT];
+
+/* Parse a non-negative integer. */
+bool ParseUnsigned(const char *str, DWORD *n)
+{
+  char *end;
+  if(!('0' <= *str && *str <= '9'))
+    return false;
+  errno = 0;
+  unsigned long value = strtoul(str, &end, 10);
+  if(*end || errno || value > 0xFFFFFFFF)
+    return false;
+  *n = (DWORD)value;
+  return true;
+}
+
+/* Parse a duration such as 90, 90s, 5m or 2h into seconds. */
+bool ParseDuration(const char *str, DWORD *seconds)
+{
+  string number = str;
+  DWORD multiplier = 1;
+
+  if(number.size()) {
+    switch(number[number.size() - 1]) {
+    case 's': multiplier = 1; break;
+    case 'm': multiplier = 60; break;
+    case 'h': multiplier = 60 * 60; break;
+    default: number += 's';
+    }
+    number.erase(number.size() - 1);
+  }
+
+  DWORD n;
+  if(!ParseUnsigned(number.c_str(), &n) || n > (0xFFFFFFFF / multiplier))
+    return false;
+  *seconds = n * multiplier;
+  return true;
+}
+
+/* Parse a duration such as 500ms, 90, 90s, 5m or 2h into milliseconds. */
+bool ParseDurationMs(const char *str, DWORD *ms)
+{
+  string number = str;
+  if(number.size() > 2 && !number.compare(number.size() - 2, 2, "ms"))
+    return ParseUnsigned(number.erase(number.size() - 2).c_str(), ms);
+
+  DWORD seconds;
+  if(!ParseDuration(str, &seconds) || seconds > (0xFFFFFFFF / 1000))
+    return false;
+  *ms = seconds * 1000;
+  return true;
+}
+
+/* Split "name=value,name=value" into pairs. Return false if malformed. */
+bool ParseNameValueList(const char *list, vector<pair<string, string> > *pairs)
+{
+  stringstream ss(list);
+  string item;
+  while(getline(ss, item, ',')) {
+    string::size_type eq = item.find('=');
+    if(!eq || eq == string::npos || eq + 1 == item.size())
+      return false;
+    pairs->push_back(make_pair(item.substr(0, eq), item.substr(eq + 1)));
+  }
+  return pairs->size() > 0;
+}
+
+/* --hysteresis percent=<n>,lifetime=<duration>,full_lifetime=<duration> */
+bool ParseHysteresis(const char *value)
+{
+  vector<pair<string, string> > pairs;
+  if(!ParseNameValueList(value, &pairs))
+    return false;
+
+  for(size_t i = 0; i < pairs.size(); ++i) {
+    const string &name = pairs[i].first;
+    const char *amount = pairs[i].second.c_str();
+    DWORD n;
+
+    if(name == "percent" ? !ParseUnsigned(amount, &n) :
+       (name == "lifetime" || name == "full_lifetime") ?
+       !ParseDuration(amount, &n) : true)
+      return false;
+
+    if(!n)
+      n = 1;  // a change of 0 is no change
+    if(name == "percent")
+      hysteresis.percent = n;
+    else if(name == "lifetime")
+      hysteresis.lifetime = n;
+    else
+      hysteresis.full_lifetime = n;
+  }
+  return true;
+}
+
+/* --rate-limit <class>=<count>/<period>,... */
+bool ParseRateLimit(const char *value)
+{
+  vector<pair<string, string> > pairs;
+  if(!ParseNameValueList(value, &pairs))
+    return false;
+
+  for(size_t i = 0; i < pairs.size(); ++i) {
+    int oc;
+    for(oc = 0; oc < OUTCLASS_COUNT; ++oc) {
+      if(pairs[i].first == outclass_names[oc])
+        break;
+    }
+    if(oc == OUTCLASS_COUNT)
+      return false;
+
+    string limit = pairs[i].second;
+    string::size_type slash = limit.find('/');
+    if(slash == string::npos)
+      return false;
+
+    // the period may be just a unit, eg 10/h is the same as 10/1h
+    string period = limit.substr(slash + 1);
+    if(period.size() && !('0' <= period[0] && period[0] <= '9'))
+      period = "1" + period;
+
+    DWORD count, seconds;
+    if(!ParseUnsigned(limit.substr(0, slash).c_str(), &count) || !count ||
+       !ParseDuration(period.c_str(), &seconds) || !seconds)
+      return false;
+
+    struct token_bucket *tb = &rate_limit[oc];
+    tb->enabled = true;
+    tb->capacity = tb->tokens = count;
+    tb->tokens_per_ms = (double)count / ((double)seconds * 1000);
+    tb->tick = GetTickCount();
+  }
+  return true;
+}
+
+/* Return true if output of class 'oc' is allowed by the rate limit. */
+bool RateLimitAllow(enum outclass oc)
+{
+  struct token_bucket *tb = &rate_limit[oc];
+  if(!tb->enabled)
+    return true;
+
+  DWORD now = GetTickCount();
+  tb->tokens += (now - tb->tick) * tb->tokens_per_ms;
+  if(tb->tokens > tb->capacity)
+    tb->tokens = tb->capacity;
+  tb->tick = now;
+
+  if(tb->tokens < 1) {
+    ++tb->dropped;
+    return false;
+  }
+  tb->tokens -= 1;
+
+  if(tb->dropped) {
+    cout << TIMESTAMPED_PREFIX << "(Rate limit: " << tb->dropped << " "
+         << outclass_names[oc] << " " << (tb->dropped == 1 ? "output was" :
+                                          "outputs were")
+         << " dropped.)" << endl;
+    tb->dropped = 0;
+  }
+  return true;
+}
+
+/* Critical alerts.
+
+When the battery becomes critical on battery power, or a battery that was
+detected no longer is, the alert must not wait behind the bulk output (status
+one-liners, verbose status, telemetry and so on), so it has its own lane to
+each sink:
+
+- console and log: it's not rate limited and it's written synchronously even
+  while the output is coalesced
+- event log: it's queued separately, is never dropped, and the worker reports
+  it before the next queued record, so it waits for at most one ReportEvent
+- MQTT: field "critical" is published ahead of the pending fields and isn't
+  held back by the in-flight window
+
+The latency of each sink is measured from when the alert was raised until the
+console write returned, ReportEvent returned or the broker acknowledged the
+publish, and the worst of each is shown by option --stats. A latency over
+CRITICAL_LATENCY_BOUND_MS is flagged there. --critical-benchmark measures it
+with the bulk lane saturated.
+*/
+#define CRITICAL_LATENCY_BOUND_MS 1000
+
+enum critsink {
+  CRITSINK_CONSOLE,
+  CRITSINK_EVENTLOG,
+  CRITSINK_MQTT,
+  CRITSINK_COUNT
+};
+
+const char *critsink_names[CRITSINK_COUNT] = {
+  "Console latency: ", "Event log latency: ", "MQTT latency: "
+};
+
+struct critical_lane {
+  bool initialized;
+  CRITICAL_SECTION lock;  // the event log worker updates the latencies too
+  LARGE_INTEGER freq;
+  unsigned long alerts;
+  unsigned long delivered[CRITSINK_COUNT];  // protected by lock
+  LONGLONG worst_us[CRITSINK_COUNT];        // protected by lock
+} crit;
+
+/* Return the start of a critical alert's latency measurement. */
+LONGLONG CriticalStart()
+{
+  if(!crit.initialized) {
+    InitializeCriticalSection(&crit.lock);
+    QueryPerformanceFrequency(&crit.freq);
+    crit.initialized = true;
+  }
+  ++crit.alerts;
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return now.QuadPart;
+}
+
+/* A critical alert raised at 'start' was delivered to 'sink'. */
+void CriticalDelivered(enum critsink sink, LONGLONG start)
+{
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  LONGLONG us = ((now.QuadPart - start) * 1000000) / crit.freq.QuadPart;
+
+  EnterCriticalSection(&crit.lock);
+  ++crit.delivered[sink];
+  if(us > crit.worst_us[sink])
+    crit.worst_us[sink] = us;
+  LeaveCriticalSection(&crit.lock);
+}
+
+void ShowCriticalStats()
+{
+  if(!crit.alerts)
+    return;
+
+  cout << "\nCritical alerts:\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Alerts: " << right
+       << crit.alerts << "\n";
+
+  EnterCriticalSection(&crit.lock);
+  for(int i = 0; i < CRITSINK_COUNT; ++i) {
+    if(!crit.delivered[i])
+      continue;
+    cout << left << setw(BATT_FIELD_WIDTH) << critsink_names[i] << right
+         << crit.worst_us[i] << " us worst, " << crit.delivered[i]
+         << " delivered";
+    if(crit.worst_us[i] > (LONGLONG)CRITICAL_LATENCY_BOUND_MS * 1000)
+      cout << " (over the " << CRITICAL_LATENCY_BOUND_MS << " ms bound)";
+    cout << "\n";
+  }
+  LeaveCriticalSection(&crit.lock);
+  cout << flush;
+}
+
+/* Return true if 'a' and 'b' differ by at least 'threshold', or if exactly
+   one of them is 'unknown'. */
+bool ExceedsHysteresis(DWORD a, DWORD b, DWORD threshold, DWORD unknown)
+{
+  if(a == b)
+    return false;
+  if(a == unknown || b == unknown)
+    return true;
+  return (a > b ? a - b : b - a) >= threshold;
+}
+
+/* Return true if the status changed enough to show the one-liner again.
+   'reported' is the status the one-liner was last shown for and 'prev' is the
+   status of the previous poll. The percent is compared with the reported
+   percent so that hysteresis applies to slow drifts too. Used by the main loop
+   and by --replay. */
+bool StatusLineChanged(const SYSTEM_POWER_STATUS *status,
+                       const SYSTEM_POWER_STATUS *reported,
+                       const SYSTEM_POWER_STATUS *prev,
+                       bool ignore_charging)
+{
+  return ExceedsHysteresis(status->BatteryLifePercent,
+                           reported->BatteryLifePercent,
+                           hysteresis.percent, PERCENT_UNKNOWN) ||
+         (!ignore_charging && CHARGING(*status) != CHARGING(*prev)) ||
+         NO_BATTERY(*status) != NO_BATTERY(*prev) ||
+         PLUGGED_IN(*status) != PLUGGED_IN(*prev);
+}
+
+/* Detect a battery revival.
+   If a battery is in a really bad state then it's possible that the battery,
+   the device or the charger will cycle the charger on and off in an attempt to
+   slowly revive the battery. A full revival may take a day.
+
+   In order to detect a revival charge, record the tick count each time the
+   charge state changes and then assume revival if 'max_changes' number of
+   changes occurred within 'span_minutes'. Used by the main loop and by
+   --replay. */
+struct revival_state {
+  deque<DWORD> ticks;  // used like a FIFO for each change's tick count
+  bool active;         // a revival is taking place
+};
+
+/* Record a poll at tick 'now', 'changed' if the charge state changed since
+   the previous one. Return true if a revival is taking place. */
+bool RevivalUpdate(struct revival_state *rv, bool changed, DWORD now)
+{
+  const unsigned max_changes = 20;
+  const unsigned span_minutes = 30;
+
+  /* Clear all the stored ticks if more than span_minutes has passed since the
+     last charge state change. */
+  if(rv->ticks.size() &&
+     (now - rv->ticks.back()) >= (span_minutes * 60 * 1000))
+    rv->ticks.clear();
+
+  if(changed) {
+    if(rv->ticks.size() == max_changes)
+      rv->ticks.pop_front();
+
+    rv->ticks.push_back(now);
+  }
+
+  rv->active = (rv->ticks.size() == max_changes &&
+                ((rv->ticks.back() - rv->ticks.front()) / 1000 / 60) <
+                span_minutes);
+  return rv->active;
+}
+
 enum cpstype { CPS_EQUAL, CPS_NOTEQUAL };
 enum cpstype ComparePowerStatus(const SYSTEM_POWER_STATUS *a,
                                 const SYSTEM_POWER_STATUS *b)
@@ -841,15 +1284,106 @@ enum cpstype ComparePowerStatus(const SYSTEM_POWER_STATUS *a,
   if(a->item != b->item) \
     return CPS_NOTEQUAL;
 
+#define COMPARE_STATUS_HYSTERESIS(item, threshold, unknown) \
+  if(ExceedsHysteresis(a->item, b->item, threshold, unknown)) \
+    return CPS_NOTEQUAL;
+
   COMPARE_STATUS(ACLineStatus);
   COMPARE_STATUS(BatteryFlag);
-  COMPARE_STATUS(BatteryLifePercent);
+  COMPARE_STATUS_HYSTERESIS(BatteryLifePercent, hysteresis.percent,
+                            PERCENT_UNKNOWN);
   COMPARE_STATUS(SystemStatusFlag);
-  COMPARE_STATUS(BatteryLifeTime);
-  COMPARE_STATUS(BatteryFullLifeTime);
+  COMPARE_STATUS_HYSTERESIS(BatteryLifeTime, hysteresis.lifetime,
+                            LIFETIME_UNKNOWN);
+  COMPARE_STATUS_HYSTERESIS(BatteryFullLifeTime, hysteresis.full_lifetime,
+                            LIFETIME_UNKNOWN);
   return CPS_EQUAL;
 }
 
+/* Calculate the average lifetime (option -a).
+   Store continuous lifetime values averaged approximately every minute for
+   the last 'lifetime_span_minutes', then compute the average of those
+   values. 'deck' holds the stored values between calls, 'tick' is when
+   'lifetime' was retrieved and 'reset' is true if the computer recently
+   resumed. Return LIFETIME_UNKNOWN if there's no average. */
+struct lifetime_data { DWORD lifetime /* in seconds */, tick /* in ms */; };
+
+DWORD AverageLifetime(deque<lifetime_data> *deck, DWORD lifetime, DWORD tick,
+                      bool reset)
+{
+  struct lifetime_data now = { lifetime, tick };
+
+  /* If the current lifetime is invalid then assume some major event has
+     occurred and invalidate the previously stored lifetimes. Else store
+     the lifetime and calculate the average lifetime.
+
+     Note it is documented behavior in Windows that lifetimes are reported
+     unknown (ie LIFETIME_UNKNOWN) when AC power is present, therefore it's
+     safe to assume a discharge after this block. */
+  if(reset || !now.lifetime || now.lifetime == LIFETIME_UNKNOWN) {
+    deck->clear();
+    return LIFETIME_UNKNOWN;
+  }
+
+  // Remove all entries older than lifetime_span_minutes
+  for(deque<lifetime_data>::reverse_iterator r = deck->rbegin();
+      r != deck->rend(); ++r) {
+    if((now.tick - r->tick) > (lifetime_span_minutes * 60 * 1000)) {
+      deck->erase(deck->begin(), ((r + 1).base() + 1));
+      break;
+    }
+  }
+
+  /* If a lifetime was already reported in the last minute then fold the
+     current lifetime into that one. This is somewhat imperfect however
+     the alternative is keeping all the lifetimes that occurred within
+     lifetime_span_minutes, which could be a very large amount.
+
+     Note the tick remains unchanged, because if it was updated to the
+     current tick then subsequent iterations would always hit this block
+     instead of the else block. The idea is to create an object about
+     once a minute. */
+  if(deck->size() && (now.tick - deck->back().tick) < (60 * 1000)) {
+    deck->back().lifetime = (DWORD)(((double)deck->back().lifetime / 2) +
+                                   ((double)now.lifetime / 2));
+    if(!deck->back().lifetime)
+      deck->back().lifetime = 1;
+    if(deck->back().lifetime == LIFETIME_UNKNOWN) // can't happen, for now
+      --deck->back().lifetime;
+  }
+  else {
+    /* Make sure there's at least an entry about every minute before
+       adding the current entry. Fill in a gap of 2+ minutes by creating
+       pseudo entries based on the last reported lifetime. The main loop
+       iterates so frequently that this should be highly unlikely. */
+    if(deck->size()) {
+      DWORD elapsed_minutes = (now.tick - deck->back().tick) / 1000 / 60;
+      for(DWORD i = 1; i < elapsed_minutes; ++i) {
+        struct lifetime_data d = deck->back();
+        d.tick += (60 * 1000);
+        d.lifetime = d.lifetime > 60 ? d.lifetime - 60 : 1;
+        deck->push_back(d);
+      }
+    }
+
+    deck->push_back(now);
+  }
+
+  /* Calculate an unweighted average.
+     Adjust each lifetime based on when it was reported. For example a
+     lifetime of 4400 seconds that was reported 100 seconds ago is
+     actually a lifetime of 4300 seconds. */
+  double avg = 0;
+  for(deque<lifetime_data>::iterator it = deck->begin();
+      it != deck->end(); ++it) {
+    DWORD excess_seconds = (now.tick - it->tick) / 1000;
+    DWORD adjusted = it->lifetime > excess_seconds ?
+                     it->lifetime - excess_seconds : 1;
+    avg += (double)adjusted / deck->size();
+  }
+  return (DWORD)avg;
+}
+
 #define FUNC_SHOW_BOOL(item) \
 string item##Str(BOOL item) \
 { \
@@ -906,8 +1440,8 @@ Ignore errors: Don't show them and return 0.
 */
 LONG GetBatteryPowerRate()
 {
-  /* Note SYSTEM_BATTERY_STATE seems to be updated by the OS at the same
-     frequency as SYSTEM_POWER_STATUS, which is not necessarily that often. */
+  /* Note how often SYSTEM_BATTERY_STATE is updated depends on the battery
+     and its driver. The monitor measures it, see the sensor profile. */
   SYSTEM_BATTERY_STATE sbs;
   if(CallNtPowerInformation(SystemBatteryState, NULL, 0, &sbs, sizeof sbs))
     return 0;
@@ -916,188 +1450,7606 @@ LONG GetBatteryPowerRate()
   return ((DWORD)sbs.Rate != 0x80000000) ? (LONG)sbs.Rate : 0;
 }
 
-LRESULT CALLBACK WindowProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
+/* Get SYSTEM_BATTERY_STATE, which is the combined state of all batteries. */
+bool GetSystemBatteryState(SYSTEM_BATTERY_STATE *sbs)
 {
-  if(verbose >= 3)
-  {
-    /* show all window messages */
-    cout << TIMESTAMPED_PREFIX
-         << hex << "WindowProc: msg 0x" << msg << ", wparam 0x" << wParam
-         << ", lparam 0x" << lParam << dec << endl;
-  }
-  switch(msg) {
-  /* WM_POWERBROADCAST:
-     "Notifies applications of a change in the power status of the computer,
-     such as a switch from battery power to A/C. The system also broadcasts
-     this event when remaining battery power slips below the threshold
-     specified by the user or if the battery power changes by a specified
-     percentage."
-     PBT_APMPOWERSTATUSCHANGE:
-     "This event can occur when battery life drops to less than 5 minutes, or
-     when the percentage of battery life drops below 10 percent, or if the
-     battery life changes by 3 percent."
-     Note this is a broadcast message and therefore not received by
-     message-only windows. */
-  case WM_POWERBROADCAST:
+  return CallNtPowerInformation(SystemBatteryState, NULL, 0,
+                                sbs, sizeof *sbs) == STATUS_SUCCESS;
+}
 
-    if(wParam == PBT_APMPOWERSTATUSCHANGE) {
-      static SYSTEM_POWER_STATUS status, prev_status;
-      prev_status = status;
+/* Get the interrupt time in 100ns units when the computer last woke up. */
+bool GetLastWakeTime(ULONGLONG *lastwake)
+{
+  return CallNtPowerInformation(LastWakeTime, NULL, 0,
+                                lastwake, sizeof *lastwake) == STATUS_SUCCESS;
+}
 
-      if(GetSystemPowerStatus(&status)) {
-#if 0
-        cout << "PBT_APMPOWERSTATUSCHANGE DEBUG: \n---\n(prev_status)\n";
-        ShowPowerStatus(&prev_status);
-        cout << "---\n(status)\n";
-        ShowPowerStatus(&status);
-        cout << "---" << endl;
-#endif
-        /* If the charge state is being suppressed but only it or members
-           affected by it have changed then don't show anything. */
-        if(suppress_charge_state &&
-           status.BatteryLifePercent == prev_status.BatteryLifePercent &&
-           ((status.BatteryFlag & ~SPSF_BATTERYCHARGING) ==
-            (prev_status.BatteryFlag & ~SPSF_BATTERYCHARGING)))
-          return TRUE;
-      }
-      else
-        status = prev_status;
-    }
+/* Convert lastwake to the GetTickCount tick when the computer woke up.
+   mt is a generous number of 100ns units of interrupt to remove from lastwake
+   before the conversion, without which GetTickCount could come before it:
+   GetTickCount: 76815265   <--- less granularity, it hasn't updated
+   Unadjusted lastwake in milliseconds: 76815269
+   For now put aside the issue of GetTickCount wraparound at 49d17h2m47s which
+   has to be handled some other way. */
+DWORD WakeTimeToTick(ULONGLONG lastwake)
+{
+  ULONGLONG mt = (MaximumTimerInterval * 2) + 10000;
+  return (DWORD)((lastwake > mt ? lastwake - mt : 0) / 10000);
+}
 
-#define CASE_PBT(item) \
-  case item: cout << #item; break;
-
-    cout << TIMESTAMPED_PREFIX << "WM_POWERBROADCAST: ";
-    switch(wParam) {
-    CASE_PBT(PBT_APMQUERYSUSPEND);        /* 0x0000 */  /* Win2k & XP only */
-    CASE_PBT(PBT_APMQUERYSTANDBY);        /* 0x0001 */  /* Win2k & XP only */
-    CASE_PBT(PBT_APMQUERYSUSPENDFAILED);  /* 0x0002 */  /* Win2k & XP only */
-    CASE_PBT(PBT_APMQUERYSTANDBYFAILED);  /* 0x0003 */  /* Win2k & XP only */
-    CASE_PBT(PBT_APMSUSPEND);             /* 0x0004 */
-    CASE_PBT(PBT_APMSTANDBY);             /* 0x0005 */
-    CASE_PBT(PBT_APMRESUMECRITICAL);      /* 0x0006 */  /* Win2k & XP only */
-    CASE_PBT(PBT_APMRESUMESUSPEND);       /* 0x0007 */
-    CASE_PBT(PBT_APMRESUMESTANDBY);       /* 0x0008 */
-    CASE_PBT(PBT_APMBATTERYLOW);          /* 0x0009 */  /* Win2k & XP only */
-    CASE_PBT(PBT_APMPOWERSTATUSCHANGE);   /* 0x000A */
-    CASE_PBT(PBT_APMOEMEVENT);            /* 0x000B */  /* Win2k & XP only */
-    CASE_PBT(PBT_APMRESUMEAUTOMATIC);     /* 0x0012 */
-    CASE_PBT(PBT_POWERSETTINGCHANGE);     /* 0x8013 */
-    default: cout << UndocumentedValueStr(wParam);
-    }
+/* For this long after the computer resumes the battery lifetime is inaccurate
+   and the drain isn't typical. */
+#define RESUME_SPAN_MINUTES 3
 
-    if(lParam == 0 &&
-       wParam != PBT_APMQUERYSUSPEND &&
-       wParam != PBT_APMQUERYSTANDBY) {
-      /* lParam in this case has no significance so skip showing it */
-      cout << endl;
-      return TRUE;
-    }
+/* Return true if the computer woke up at 'lastwake' (see GetLastWakeTime)
+   less than RESUME_SPAN_MINUTES before tick 'now'. */
+bool RecentlyResumed(ULONGLONG lastwake, DWORD now)
+{
+  return (now - WakeTimeToTick(lastwake)) < (RESUME_SPAN_MINUTES * 60 * 1000);
+}
 
-    cout << " (lParam: ";
-    if(wParam == PBT_APMQUERYSUSPEND ||
-       wParam == PBT_APMQUERYSTANDBY) {
-      LPARAM unknown = (LPARAM)(lParam & ~1);
-      if(lParam & 1) {
-        cout << "Bit 0 is on, User prompting/interaction is allowed.";
-        if(unknown)
-          cout << " | ";
-      }
-      else {
-        cout << "Bit 0 is off, User prompting/interaction is not allowed.";
-        if(unknown)
-          cout << " | ";
-      }
-      if(unknown)
-        cout << UndocumentedValueStr(lParam);
-    }
-#if 0 // this is unreachable now since lParam 0 is skipped earlier
-    else if(lParam == 0) {
-      cout << "0";
-    }
+/* Rotating log file (options --log, --log-rotate and --log-keep).
+
+With --log <file> the output is appended to <file> instead of shown. When the
+current segment reaches the size or age in --log-rotate it's renamed to
+<file>.<yyyymmdd-hhmmss>, in UTC, and a new segment is started, so <file> is
+always plain text that can be appended to and tailed. A segment rotated in the
+same second gets a suffix -<n>. Renaming is quick; compressing the rotated
+segment to <file>.<yyyymmdd-hhmmss>.lz is left to a worker thread that runs at
+idle (background mode on Vista+) priority, so rotation never blocks
+monitoring. The worker then deletes the oldest compressed segments over the
+--log-keep limit, ordered by stamp and suffix (see LogSegmentKey). Segments
+that weren't compressed before battstatus exited are compressed the next time.
+
+The codec is a small LZ77 in the LZ4 block style, see LzCompress. --log-cat
+shows a segment, compressed or not. --log-benchmark writes lines as fast as it
+can for a while and shows the sustained throughput and the slowest write, to
+show that rotation doesn't stall the writer.
+
+A segment is compressed in memory as a whole and the compressed format stores
+its size in 4 bytes, so the size limit can't be turned off: it's at most
+LOG_MAX_ROTATE_BYTES, which is also the limit with size=0. A segment larger
+than twice that (not rotated by this limit) is left uncompressed.
+
+Output can come from the console control thread too (Ctrl+Break, see
+StatsCtrlHandler), so LogBuf holds logw.write_lock while it buffers, writes or
+rotates.
+*/
+#define LOG_DEFAULT_ROTATE_BYTES (10 * 1024 * 1024)
+#define LOG_DEFAULT_KEEP 10
+#define LOG_ROTATE_RETRY_SECONDS 60
+#define LOG_MAX_ROTATE_BYTES (256 * 1024 * 1024)
+#define LZ_MAGIC "BLZ1"
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+
+#ifndef THREAD_MODE_BACKGROUND_BEGIN
+#define THREAD_MODE_BACKGROUND_BEGIN 0x00010000
 #endif
-    else if(wParam == PBT_APMRESUMECRITICAL ||
-            wParam == PBT_APMRESUMESUSPEND ||
-            wParam == PBT_APMRESUMESTANDBY ||
-            wParam == PBT_APMRESUMEAUTOMATIC) {
-      LPARAM unknown = (LPARAM)(lParam & ~PBTF_APMRESUMEFROMFAILURE);
-      if(lParam & PBTF_APMRESUMEFROMFAILURE) {
-        cout << "PBTF_APMRESUMEFROMFAILURE";
-        if(unknown)
-          cout << " | ";
-      }
-      if(unknown)
-        cout << UndocumentedValueStr(unknown);
-    }
-    else
-      cout << UndocumentedValueStr(lParam);
-    cout << ")" << endl;
-    return TRUE;
 
-  default:
-    break;
-  }
-
-  return DefWindowProc(hwnd, msg, wParam, lParam);
+void LzPutLength(string &out, size_t n)
+{
+  for(; n >= 255; n -= 255)
+    out += (char)255;
+  out += (char)n;
 }
 
-HWND InitMonitorWindow()
+bool LzGetLength(const string &in, size_t *i, size_t *n)
 {
-  const char * window_class_name =
-    "battstatus window {4A6A9339-FA17-4324-93FC-EC92656FF058}";
+  BYTE b;
+  do {
+    if(*i >= in.size())
+      return false;
+    b = (BYTE)in[(*i)++];
+    *n += b;
+  } while(b == 255);
+  return true;
+}
 
-  WNDCLASS wc;
-  wc.style         = CS_NOCLOSE;
-  wc.lpfnWndProc   = WindowProc;
-  wc.cbClsExtra    = 0;
-  wc.cbWndExtra    = 0;
-  wc.hInstance     = GetModuleHandle(NULL);
-  wc.hIcon         = NULL;
-  wc.hCursor       = NULL;
-  wc.hbrBackground = NULL;
-  wc.lpszMenuName  = NULL;
-  wc.lpszClassName = window_class_name;
+/* Compress 'in'. The format is LZ_MAGIC, the 4 byte little endian size of
+   'in' and then sequences of:
+   - token: literal count in the high 4 bits, match length - LZ_MIN_MATCH in
+     the low 4 bits. 15 means the count continues in the following bytes,
+     each added until one is less than 255.
+   - the literals
+   - 2 byte little endian offset back to the match (the last sequence has only
+     literals)
+   Matches are found with a hash table of the last position of each 4 bytes,
+   which is fast and compresses log text several times over. */
+string LzCompress(const string &in)
+{
+  string out = LZ_MAGIC;
+  size_t n = in.size();
+  for(int i = 0; i < 4; ++i)
+    out += (char)((n >> (i * 8)) & 0xFF);
+
+  vector<size_t> table(1 << LZ_HASH_BITS);  // position + 1, 0 if none
+  size_t anchor = 0, i = 0;
+
+  while(i + LZ_MIN_MATCH <= n) {
+    DWORD v;
+    memcpy(&v, &in[i], 4);
+    DWORD h = (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+    size_t candidate = table[h];
+    table[h] = i + 1;
+
+    if(!candidate || (i - (candidate - 1)) > LZ_MAX_OFFSET ||
+       memcmp(&in[candidate - 1], &in[i], LZ_MIN_MATCH)) {
+      ++i;
+      continue;
+    }
 
-  ATOM atomWindowClass = RegisterClass(&wc);
-  if(!atomWindowClass) {
-    DWORD gle = GetLastError();
-    cerr << "Error: RegisterClass() failed to make window class "
-         << "\"" << window_class_name << "\""
-         << " with error code " << gle << "." << endl;
-    return NULL;
+    size_t match = candidate - 1;
+    size_t len = LZ_MIN_MATCH;
+    while(i + len < n && in[match + len] == in[i + len])
+      ++len;
+
+    size_t lit = i - anchor, ml = len - LZ_MIN_MATCH, offset = i - match;
+    out += (char)(((lit < 15 ? lit : 15) << 4) | (ml < 15 ? ml : 15));
+    if(lit >= 15)
+      LzPutLength(out, lit - 15);
+    out.append(in, anchor, lit);
+    out += (char)(offset & 0xFF);
+    out += (char)(offset >> 8);
+    if(ml >= 15)
+      LzPutLength(out, ml - 15);
+
+    i += len;
+    anchor = i;
   }
 
-  HWND hwnd = CreateWindowEx(0, window_class_name, window_class_name,
-                             0, 0, 0, 0, 0, NULL, NULL, NULL, NULL);
-  if(!hwnd) {
-    DWORD gle = GetLastError();
-    cerr << "Error: CreateWindowEx() failed to make window "
-         << "\"" << window_class_name << "\""
-         << " with error code " << gle << "." << endl;
-    return NULL;
-  }
+  size_t lit = n - anchor;
+  out += (char)((lit < 15 ? lit : 15) << 4);
+  if(lit >= 15)
+    LzPutLength(out, lit - 15);
+  out.append(in, anchor, lit);
+  return out;
+}
 
-  if(verbose >= 3) {
-    cout << TIMESTAMPED_HEADER
-         << "Monitor window created.\n"
-         << "hwnd: " << hex << hwnd << dec << "\n"
-         << "name: " << window_class_name << "\n" << endl;
+bool LzDecompress(const string &in, string *out)
+{
+  if(in.size() < 8 || in.compare(0, 4, LZ_MAGIC))
+    return false;
+
+  size_t size = 0;
+  for(int k = 0; k < 4; ++k)
+    size |= (size_t)(BYTE)in[4 + k] << (k * 8);
+
+  /* An input byte expands to at most 255 output bytes (a length byte of a
+     match), so a larger size is corrupt and mustn't be reserved. */
+  if(size / 255 > in.size())
+    return false;
+
+  out->clear();
+  out->reserve(size);
+
+  for(size_t i = 8; i < in.size();) {
+    BYTE token = (BYTE)in[i++];
+
+    size_t lit = token >> 4;
+    if(lit == 15 && !LzGetLength(in, &i, &lit))
+      return false;
+    if(lit > in.size() - i)
+      return false;
+    out->append(in, i, lit);
+    i += lit;
+    if(i == in.size())
+      break;  // the last sequence has no match
+
+    if(in.size() - i < 2)
+      return false;
+    size_t offset = (BYTE)in[i] | ((size_t)(BYTE)in[i + 1] << 8);
+    i += 2;
+
+    size_t ml = token & 15;
+    if(ml == 15 && !LzGetLength(in, &i, &ml))
+      return false;
+    ml += LZ_MIN_MATCH;
+
+    if(!offset || offset > out->size() || ml > size - out->size())
+      return false;
+    // the match may overlap what it's copying so copy byte by byte
+    for(size_t from = out->size() - offset; ml; --ml, ++from)
+      *out += (*out)[from];
   }
-
-  return hwnd;
+  return out->size() == size;
 }
 
-void ShowUsage()
+/* Read a file of at most 'max' bytes, straight into 'data' so that a large
+   file isn't held twice. */
+bool ReadFileStr(const string &path, string *data, ULONGLONG max = (size_t)-1)
+{
+  ifstream in(path.c_str(), ios::binary);
+  if(!in)
+    return false;
+  in.seekg(0, ios::end);
+  streamoff size = in.tellg();
+  in.seekg(0, ios::beg);
+  if(size < 0 || (ULONGLONG)size > max || (ULONGLONG)size > (size_t)-1)
+    return false;
+  data->resize((size_t)size);
+  if(size)
+    in.read(&(*data)[0], (streamsize)size);
+  return !in.fail();
+}
+
+bool WriteFileStr(const string &path, const string &data)
+{
+  ofstream out(path.c_str(), ios::binary | ios::trunc);
+  out.write(data.data(), (streamsize)data.size());
+  return !!out.flush();
+}
+
+/* Parse a size such as 500000, 512K, 10M or 1G into bytes. */
+bool ParseByteSize(const char *str, ULONGLONG *bytes)
+{
+  string number = str;
+  ULONGLONG multiplier = 1;
+
+  if(number.size()) {
+    switch(toupper((unsigned char)number[number.size() - 1])) {
+    case 'K': multiplier = 1024; break;
+    case 'M': multiplier = 1024 * 1024; break;
+    case 'G': multiplier = 1024 * 1024 * 1024; break;
+    default: number += 'B';
+    }
+    number.erase(number.size() - 1);
+  }
+
+  DWORD n;
+  if(!ParseUnsigned(number.c_str(), &n))
+    return false;
+  *bytes = n * multiplier;
+  return true;
+}
+
+struct log_writer {
+  string path;
+  HANDLE file;
+  ULONGLONG size;          // of the current segment
+  time_t opened;           // when the current segment was started
+  ULONGLONG rotate_bytes;  // at most LOG_MAX_ROTATE_BYTES
+  DWORD rotate_seconds;    // 0: don't rotate by age
+  DWORD keep;              // compressed segments to keep
+  unsigned long rotations;
+  time_t rotate_retry;     // after a failed rotation, when to try again
+  CRITICAL_SECTION write_lock;  // LogBuf, the segment and the fields above
+  HANDLE wake;  // auto-reset event, signaled when segments are queued
+  CRITICAL_SECTION lock;
+  deque<string> queue;     // rotated segments to compress, protected by lock
+  ULONGLONG bytes_in;      // compressed so far, protected by lock
+  ULONGLONG bytes_out;     // protected by lock
+  unsigned long compressed;  // protected by lock
+};
+
+struct log_writer logw = { "", INVALID_HANDLE_VALUE, 0, 0,
+                           LOG_DEFAULT_ROTATE_BYTES, 0, LOG_DEFAULT_KEEP };
+
+/* --log-rotate size=<size>,time=<duration> */
+bool ParseLogRotate(const char *value)
+{
+  vector<pair<string, string> > pairs;
+  if(!ParseNameValueList(value, &pairs))
+    return false;
+
+  for(size_t i = 0; i < pairs.size(); ++i) {
+    const char *amount = pairs[i].second.c_str();
+    if(pairs[i].first == "size") {
+      if(!ParseByteSize(amount, &logw.rotate_bytes) ||
+         logw.rotate_bytes > LOG_MAX_ROTATE_BYTES)
+        return false;
+      if(!logw.rotate_bytes)
+        logw.rotate_bytes = LOG_MAX_ROTATE_BYTES;
+    }
+    else if(pairs[i].first == "time") {
+      if(!ParseDuration(amount, &logw.rotate_seconds))
+        return false;
+    }
+    else
+      return false;
+  }
+  return true;
+}
+
+/* If 'name' is a rotated segment of the log that isn't compressed yet,
+   <name of the log>.<yyyymmdd-hhmmss>[-<n>], return true and set 'key' to
+   its rotation order: the stamp and then n, 0 if there's none. Comparing the
+   names as strings isn't the rotation order since "-" sorts before "." and
+   "-10" before "-2". */
+bool LogSegmentKey(const string &name, pair<string, unsigned long> *key)
+{
+  string base = logw.path.substr(logw.path.find_last_of("\\/") + 1);
+  if(name.size() < base.size() + 16 ||
+     _strnicmp(name.c_str(), base.c_str(), base.size()) ||
+     name[base.size()] != '.')
+    return false;
+
+  const char *p = name.c_str() + base.size() + 1;
+  for(int i = 0; i < 15; ++i) {
+    if(i == 8 ? p[i] != '-' : !('0' <= p[i] && p[i] <= '9'))
+      return false;
+  }
+  key->first.assign(p, 15);
+  key->second = 0;
+  p += 15;
+  if(!*p)
+    return true;
+  if(*p++ != '-' || !*p || strlen(p) > 9)
+    return false;
+  for(; *p; ++p) {
+    if(!('0' <= *p && *p <= '9'))
+      return false;
+    key->second = (key->second * 10) + (*p - '0');
+  }
+  return true;
+}
+
+bool LogIsSegmentName(const string &name)
+{
+  pair<string, unsigned long> key;
+  return LogSegmentKey(name, &key);
+}
+
+/* Delete the oldest compressed segments over the limit, in rotation order. */
+void LogEnforceRetention()
+{
+  vector<pair<pair<string, unsigned long>, string> > segments;
+  string dir = logw.path.substr(0, logw.path.find_last_of("\\/") + 1);
+  WIN32_FIND_DATAA fd;
+  HANDLE find = FindFirstFileA((logw.path + ".*.lz").c_str(), &fd);
+  if(find == INVALID_HANDLE_VALUE)
+    return;
+  do {
+    string name = fd.cFileName;
+    pair<string, unsigned long> key;
+    if(LogSegmentKey(name.substr(0, name.size() - 3), &key))
+      segments.push_back(make_pair(key, dir + name));
+  } while(FindNextFileA(find, &fd));
+  FindClose(find);
+
+  sort(segments.begin(), segments.end());
+  for(size_t i = 0; i + logw.keep < segments.size(); ++i)
+    DeleteFileA(segments[i].second.c_str());
+}
+
+DWORD WINAPI LogCompressThread(LPVOID)
+{
+  if(!SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN))
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE);
+
+  for(;;) {
+    WaitForSingleObject(logw.wake, INFINITE);
+
+    for(;;) {
+      string segment;
+      EnterCriticalSection(&logw.lock);
+      if(logw.queue.size()) {
+        segment = logw.queue.front();
+        logw.queue.pop_front();
+      }
+      LeaveCriticalSection(&logw.lock);
+      if(segment.empty())
+        break;
+
+      // a segment too large to compress in memory is left as it is
+      string data, lz;
+      if(!ReadFileStr(segment, &data, LOG_MAX_ROTATE_BYTES * 2))
+        continue;
+      lz = LzCompress(data);
+
+      string tmp = segment + ".lz.tmp";
+      if(!WriteFileStr(tmp, lz) ||
+         !MoveFileExA(tmp.c_str(), (segment + ".lz").c_str(),
+                      MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFileA(tmp.c_str());
+        continue;
+      }
+      DeleteFileA(segment.c_str());
+
+      EnterCriticalSection(&logw.lock);
+      logw.bytes_in += data.size();
+      logw.bytes_out += lz.size();
+      ++logw.compressed;
+      LeaveCriticalSection(&logw.lock);
+
+      LogEnforceRetention();
+    }
+  }
+}
+
+void LogQueueSegment(const string &segment)
+{
+  EnterCriticalSection(&logw.lock);
+  logw.queue.push_back(segment);
+  LeaveCriticalSection(&logw.lock);
+  SetEvent(logw.wake);
+}
+
+bool LogOpenSegment()
+{
+  logw.file = CreateFileA(logw.path.c_str(), FILE_APPEND_DATA,
+                          FILE_SHARE_READ | FILE_SHARE_WRITE |
+                          FILE_SHARE_DELETE,
+                          NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(logw.file == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER size;
+  logw.size = GetFileSizeEx(logw.file, &size) ? (ULONGLONG)size.QuadPart : 0;
+  logw.opened = time(NULL);
+  return true;
+}
+
+/* Start a new segment and queue the current one to be compressed. */
+void LogRotate()
+{
+  // UTC, so that the stamps don't go back when daylight saving time ends
+  SYSTEMTIME st;
+  GetSystemTime(&st);
+  char stamp[32];
+  sprintf(stamp, ".%04u%02u%02u-%02u%02u%02u", st.wYear, st.wMonth, st.wDay,
+          st.wHour, st.wMinute, st.wSecond);
+
+  string segment = logw.path + stamp;
+  for(unsigned n = 1; GetFileAttributesA(segment.c_str()) !=
+                      INVALID_FILE_ATTRIBUTES ||
+                      GetFileAttributesA((segment + ".lz").c_str()) !=
+                      INVALID_FILE_ATTRIBUTES; ++n) {
+    stringstream ss;
+    ss << logw.path << stamp << "-" << n;
+    segment = ss.str();
+  }
+
+  CloseHandle(logw.file);
+  logw.file = INVALID_HANDLE_VALUE;
+
+  /* The log can't be renamed while another process has it open without
+     FILE_SHARE_DELETE (an editor, for example), so then it's copied and
+     truncated instead. If that fails too the segment carries on and rotation
+     is tried again after LOG_ROTATE_RETRY_SECONDS rather than on every
+     flush. */
+  bool rotated = !!MoveFileExA(logw.path.c_str(), segment.c_str(), 0);
+  DWORD gle = rotated ? 0 : GetLastError();
+  if(!rotated && CopyFileA(logw.path.c_str(), segment.c_str(), TRUE)) {
+    HANDLE file = CreateFileA(logw.path.c_str(), GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE |
+                              FILE_SHARE_DELETE, NULL, TRUNCATE_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    rotated = (file != INVALID_HANDLE_VALUE);
+    if(rotated)
+      CloseHandle(file);
+    else
+      DeleteFileA(segment.c_str());
+  }
+
+  time_t opened = logw.opened;
+  LogOpenSegment();
+
+  if(rotated) {
+    ++logw.rotations;
+    logw.rotate_retry = 0;
+    LogQueueSegment(segment);
+    return;
+  }
+  if(!logw.rotate_retry) {
+    cerr << "Warning: Failed to rotate log file " << logw.path << ", error "
+         << gle << ". Trying again every " << LOG_ROTATE_RETRY_SECONDS
+         << " seconds." << endl;
+  }
+  logw.rotate_retry = time(NULL) + LOG_ROTATE_RETRY_SECONDS;
+  logw.opened = opened;
+}
+
+/* Appends the output to the current segment of the log. */
+class LogBuf : public streambuf
+{
+protected:
+  int overflow(int c)
+  {
+    if(c == EOF)
+      return 0;
+    EnterCriticalSection(&logw.write_lock);
+    pending += (char)c;
+    LeaveCriticalSection(&logw.write_lock);
+    return c;
+  }
+
+  streamsize xsputn(const char *s, streamsize n)
+  {
+    EnterCriticalSection(&logw.write_lock);
+    pending.append(s, (size_t)n);
+    LeaveCriticalSection(&logw.write_lock);
+    return n;
+  }
+
+  int sync()
+  {
+    EnterCriticalSection(&logw.write_lock);
+    int ret = SyncLocked();
+    LeaveCriticalSection(&logw.write_lock);
+    return ret;
+  }
+
+private:
+  int SyncLocked()
+  {
+    if(pending.empty() || logw.file == INVALID_HANDLE_VALUE)
+      return 0;
+
+    DWORD written;
+    if(!WriteFile(logw.file, pending.data(), (DWORD)pending.size(), &written,
+                  NULL))
+      return -1;
+    logw.size += written;
+    pending.clear();
+
+    time_t now = time(NULL);
+    if(((logw.rotate_bytes && logw.size >= logw.rotate_bytes) ||
+        (logw.rotate_seconds &&
+         (DWORD)(now - logw.opened) >= logw.rotate_seconds)) &&
+       now >= logw.rotate_retry)
+      LogRotate();
+    return 0;
+  }
+
+  string pending;
+};
+
+LogBuf log_buf;
+streambuf *log_cout_buf;  // cout's buffer before the log
+
+void LogExit()
+{
+  cout << flush;
+  cout.rdbuf(log_cout_buf);
+}
+
+bool LogInit()
+{
+  if(!LogOpenSegment()) {
+    DWORD gle = GetLastError();
+    cerr << "Error: Failed to open log file " << logw.path << ", error " << gle
+         << "." << endl;
+    return false;
+  }
+
+  InitializeCriticalSection(&logw.lock);
+  InitializeCriticalSection(&logw.write_lock);
+  logw.wake = CreateEventA(NULL, FALSE, FALSE, NULL);
+  HANDLE thread = logw.wake ?
+                  CreateThread(NULL, 0, LogCompressThread, NULL, 0, NULL) :
+                  NULL;
+  if(!thread) {
+    DWORD gle = GetLastError();
+    cerr << "Error: Failed to start the log compression thread, error " << gle
+         << "." << endl;
+    return false;
+  }
+  CloseHandle(thread);
+
+  /* Compress any segments left over from the last time. The pattern also
+     matches the log itself (".*" matches no extension), which is skipped along
+     with anything else that isn't named like a segment. */
+  string dir = logw.path.substr(0, logw.path.find_last_of("\\/") + 1);
+  WIN32_FIND_DATAA fd;
+  HANDLE find = FindFirstFileA((logw.path + ".*").c_str(), &fd);
+  if(find != INVALID_HANDLE_VALUE) {
+    do {
+      if(LogIsSegmentName(fd.cFileName))
+        LogQueueSegment(dir + fd.cFileName);
+    } while(FindNextFileA(find, &fd));
+    FindClose(find);
+  }
+
+  cout << flush;
+  log_cout_buf = cout.rdbuf(&log_buf);
+  atexit(LogExit);
+  return true;
+}
+
+/* Show a log segment, decompressing it if it's compressed. */
+int LogCat(const char *path)
+{
+  string data, text;
+  if(!ReadFileStr(path, &data)) {
+    cerr << "Error: Failed to read " << path << "." << endl;
+    return 1;
+  }
+  if(data.compare(0, 4, LZ_MAGIC))
+    text.swap(data);
+  else if(!LzDecompress(data, &text)) {
+    cerr << "Error: " << path << " is corrupt." << endl;
+    return 1;
+  }
+  cout.write(text.data(), (streamsize)text.size());
+  cout << flush;
+  return 0;
+}
+
+/* Write lines to the log as fast as possible for 'seconds' and show the
+   throughput, including rotations, and the slowest write. */
+int LogBenchmark(DWORD seconds)
+{
+  LARGE_INTEGER freq, start, now, prev;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&start);
+  prev = start;
+
+  ULONGLONG bytes = 0;
+  unsigned long lines = 0;
+  LONGLONG slowest = 0;
+  string line = "[" + TimeToLocalTimeStr(time(NULL)) + "] 27 min (15%) "
+                "remaining, discharging at 11433 mW";
+
+  do {
+    cout << line << " #" << lines << endl;
+    bytes += line.size() + 12;
+    ++lines;
+    QueryPerformanceCounter(&now);
+    if((now.QuadPart - prev.QuadPart) > slowest)
+      slowest = now.QuadPart - prev.QuadPart;
+    prev = now;
+  } while((now.QuadPart - start.QuadPart) < (LONGLONG)seconds * freq.QuadPart);
+
+  double elapsed = (double)(now.QuadPart - start.QuadPart) / freq.QuadPart;
+
+  EnterCriticalSection(&logw.lock);
+  ULONGLONG bytes_in = logw.bytes_in, bytes_out = logw.bytes_out;
+  unsigned long compressed = logw.compressed;
+  LeaveCriticalSection(&logw.lock);
+  EnterCriticalSection(&logw.write_lock);
+  unsigned long rotations = logw.rotations;
+  LeaveCriticalSection(&logw.write_lock);
+
+  cerr << fixed << setprecision(1)
+       << left << setw(BATT_FIELD_WIDTH) << "Lines: " << right
+       << lines << " (" << (lines / elapsed) << " per second)\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Throughput: " << right
+       << ((bytes / elapsed) / (1024 * 1024)) << " MB/s\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Slowest write: " << right
+       << setprecision(3) << ((slowest * 1000.0) / freq.QuadPart) << " ms\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Rotations: " << right
+       << rotations << " (" << compressed << " compressed so far";
+  if(bytes_in)
+    cerr << setprecision(1) << ", " << ((double)bytes_in / bytes_out) << ":1";
+  cerr << ")" << endl;
+  return 0;
+}
+
+/* Low impact mode (option --low-impact).
+
+A battery monitor shouldn't be why the battery drains. With --low-impact:
+
+- The process runs at idle priority in background mode (Vista+), which also
+  lowers its I/O and memory priority.
+- It opts in to power throttling (EcoQoS, Windows 10 1709+) so the OS may run
+  it at the most efficient speed and ignore any timer resolution it asks for.
+- The wait for the next poll is on a waitable timer that may fire up to
+  LOW_IMPACT_TOLERABLE_DELAY_MS late (Windows 7+), so the OS can coalesce the
+  wakeup with others instead of waking just for it.
+- A hard minimum working set is set so that the few pages the monitor touches
+  aren't trimmed between polls and paged back in on the next one.
+
+Each of those is best effort: if the OS doesn't support it the monitor runs as
+usual. The monitor itself runs on one thread; only --eventlog and --log start
+a worker thread. --stats shows the wakeups and CPU time, for comparison.
+*/
+#define LOW_IMPACT_TOLERABLE_DELAY_MS 1000
+#define LOW_IMPACT_MIN_WORKING_SET (4 * 1024 * 1024)
+
+#ifndef PROCESS_MODE_BACKGROUND_BEGIN
+#define PROCESS_MODE_BACKGROUND_BEGIN 0x00100000
+#endif
+#ifndef QUOTA_LIMITS_HARDWS_MIN_ENABLE
+#define QUOTA_LIMITS_HARDWS_MIN_ENABLE 0x00000001
+#endif
+
+/* PROCESS_POWER_THROTTLING_STATE, for SDKs that don't have it */
+struct power_throttling_state {
+  ULONG Version;
+  ULONG ControlMask;
+  ULONG StateMask;
+};
+#define POWER_THROTTLING_CURRENT_VERSION 1
+#define POWER_THROTTLING_EXECUTION_SPEED 0x1
+#define POWER_THROTTLING_IGNORE_TIMER_RESOLUTION 0x4
+#define PROCESS_INFORMATION_CLASS_POWER_THROTTLING 4
+
+struct low_impact_state {
+  HANDLE timer;  // coalescable poll timer, or NULL to use a precise timeout
+  BOOL (WINAPI *SetWaitableTimerEx)(HANDLE, const LARGE_INTEGER *, LONG,
+                                    PTIMERAPCROUTINE, LPVOID, void *, ULONG);
+  unsigned long wakeups;  // returns from the main loop's wait
+} lowimp;
+
+void LowImpactInit()
+{
+  HMODULE kernel32 = GetModuleHandleW(L"kernel32");
+
+  if(!SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN))
+    SetPriorityClass(GetCurrentProcess(), IDLE_PRIORITY_CLASS);
+
+  BOOL (WINAPI *SetProcessInformation)(HANDLE, int, LPVOID, DWORD) =
+    (BOOL (WINAPI *)(HANDLE, int, LPVOID, DWORD))
+    GetProcAddress(kernel32, "SetProcessInformation");
+  if(SetProcessInformation) {
+    power_throttling_state pts = { POWER_THROTTLING_CURRENT_VERSION,
+                                   POWER_THROTTLING_EXECUTION_SPEED |
+                                   POWER_THROTTLING_IGNORE_TIMER_RESOLUTION,
+                                   POWER_THROTTLING_EXECUTION_SPEED |
+                                   POWER_THROTTLING_IGNORE_TIMER_RESOLUTION };
+    if(!SetProcessInformation(GetCurrentProcess(),
+                              PROCESS_INFORMATION_CLASS_POWER_THROTTLING,
+                              &pts, sizeof pts)) {
+      /* Windows 10 1709 doesn't know IGNORE_TIMER_RESOLUTION */
+      pts.ControlMask = pts.StateMask = POWER_THROTTLING_EXECUTION_SPEED;
+      SetProcessInformation(GetCurrentProcess(),
+                            PROCESS_INFORMATION_CLASS_POWER_THROTTLING,
+                            &pts, sizeof pts);
+    }
+  }
+
+  BOOL (WINAPI *SetProcessWorkingSetSizeEx)(HANDLE, SIZE_T, SIZE_T, DWORD) =
+    (BOOL (WINAPI *)(HANDLE, SIZE_T, SIZE_T, DWORD))
+    GetProcAddress(kernel32, "SetProcessWorkingSetSizeEx");
+  SIZE_T min_ws, max_ws;
+  if(SetProcessWorkingSetSizeEx &&
+     GetProcessWorkingSetSize(GetCurrentProcess(), &min_ws, &max_ws)) {
+    if(min_ws < LOW_IMPACT_MIN_WORKING_SET)
+      min_ws = LOW_IMPACT_MIN_WORKING_SET;
+    if(max_ws < min_ws)
+      max_ws = min_ws;
+    SetProcessWorkingSetSizeEx(GetCurrentProcess(), min_ws, max_ws,
+                               QUOTA_LIMITS_HARDWS_MIN_ENABLE);
+  }
+
+  lowimp.SetWaitableTimerEx =
+    (BOOL (WINAPI *)(HANDLE, const LARGE_INTEGER *, LONG, PTIMERAPCROUTINE,
+                     LPVOID, void *, ULONG))
+    GetProcAddress(kernel32, "SetWaitableTimerEx");
+  if(lowimp.SetWaitableTimerEx)
+    lowimp.timer = CreateWaitableTimerA(NULL, FALSE, NULL);
+}
+
+/* Sampling rate leases (option --lease).
+
+Most of the time the monitor's idle cadence (the learned refresh times, or the
+degraded poll) is plenty. A client that wants the power status sampled faster
+for a while requests a lease, for example 100 Hz for 60s, and the monitor polls
+at that rate until the lease expires. A lease lasts at most
+LEASE_MAX_DURATION_MS, so a client that needs more time renews it. The monitor
+grants each lease an id that's hard to guess, and only that id renews or
+releases (duration 0) the lease, since another process could claim any name or
+pid. Overlapping leases are merged into the fastest one that's live, and when
+they have all expired the monitor drops back to its idle cadence. While a lease
+faster than LOW_IMPACT_TOLERABLE_DELAY_MS is live the low impact poll timer
+isn't used, since it may fire that late.
+
+The dashboard (--tui) holds a lease for its refresh while it's shown, unless
+the monitor is degraded, and --measure holds one at its own sample rate on each
+running monitor while the command runs. --lease requests one from the command
+line, for example for a script that attaches a fast MQTT subscriber. Other
+processes send their lease to the monitor window in a WM_COPYDATA message and
+the result of the message is the lease id, or 0 if it wasn't granted.
+*/
+#define LEASE_COPYDATA_ID 0x4C534542  // "BESL"
+#define LEASE_MIN_INTERVAL_MS 10      // 100 Hz
+#define LEASE_MAX_DURATION_MS (5 * 60 * 1000)
+#define LEASE_MAX 16
+#define LEASE_CLIENT_MS (10 * 1000)   // renewed at half that
+#define LEASE_SEND_TIMEOUT_MS 1000
+
+#ifndef MSGFLT_ALLOW
+#define MSGFLT_ALLOW 1
+#endif
+
+#define MONITOR_WINDOW_CLASS \
+  "battstatus window {4A6A9339-FA17-4324-93FC-EC92656FF058}"
+
+/* The WM_COPYDATA payload */
+struct rate_lease_request {
+  DWORD id;           // the lease to renew or release, 0 for a new lease
+  DWORD interval_ms;
+  DWORD duration_ms;  // 0 to release the lease
+  char client[32];    // shown only
+};
+
+struct rate_lease {
+  DWORD id;
+  string client;
+  DWORD interval_ms;
+  DWORD expire_tick;
+};
+
+struct lease_table {
+  vector<rate_lease> leases;
+  DWORD interval_ms;  // the merged interval, or 0 if no lease is live
+  DWORD live_tick;    // when the merged lease went live
+  ULONGLONG live_ms;  // how long leases were live, up to live_tick
+  DWORD fastest_ms;   // the fastest interval granted, if any
+  unsigned long granted, renewed, released, expired, rejected;
+} lease;
+
+/* Return a new lease id, which is never 0. RtlGenRandom is XP+. */
+DWORD LeaseNewId()
+{
+  static BOOLEAN (WINAPI *RtlGenRandom)(PVOID, ULONG) =
+    (BOOLEAN (WINAPI *)(PVOID, ULONG))
+    GetProcAddress(LoadLibraryA("advapi32"), "SystemFunction036");
+
+  DWORD id = 0;
+  while(!id) {
+    if(!RtlGenRandom || !RtlGenRandom(&id, sizeof id)) {
+      LARGE_INTEGER qpc;
+      QueryPerformanceCounter(&qpc);
+      id = ((DWORD)qpc.QuadPart * 2654435761U) ^ (DWORD)(qpc.QuadPart >> 32);
+    }
+  }
+  return id;
+}
+
+/* Drop the leases expired at tick 'now' and merge the rest into
+   lease.interval_ms. */
+void LeaseMerge(DWORD now)
+{
+  DWORD interval_ms = 0;
+
+  for(size_t i = 0; i < lease.leases.size();) {
+    const struct rate_lease *l = &lease.leases[i];
+    if((LONG)(now - l->expire_tick) >= 0) {
+      ++lease.expired;
+      lease.leases.erase(lease.leases.begin() + i);
+      continue;
+    }
+    if(!interval_ms || l->interval_ms < interval_ms)
+      interval_ms = l->interval_ms;
+    ++i;
+  }
+
+  if(interval_ms == lease.interval_ms)
+    return;
+
+  if(!lease.interval_ms)
+    lease.live_tick = now;
+  else if(!interval_ms)
+    lease.live_ms += now - lease.live_tick;
+  lease.interval_ms = interval_ms;
+
+  if(verbose) {
+    if(interval_ms) {
+      cout << TIMESTAMPED_PREFIX << "Sampling every " << interval_ms
+           << " ms for a rate lease." << endl;
+    }
+    else {
+      cout << TIMESTAMPED_PREFIX << "Rate leases expired, sampling at the "
+           << "idle cadence." << endl;
+    }
+  }
+}
+
+/* Grant (id 0), renew or release (duration_ms 0) a lease at tick 'now'. A
+   lease that's no longer held is granted again. Return the lease id, or 0 if
+   it was released or the table is full. */
+DWORD LeaseRequest(DWORD id, const char *client, DWORD interval_ms,
+                   DWORD duration_ms, DWORD now)
+{
+  if(interval_ms < LEASE_MIN_INTERVAL_MS)
+    interval_ms = LEASE_MIN_INTERVAL_MS;
+  if(duration_ms > LEASE_MAX_DURATION_MS)
+    duration_ms = LEASE_MAX_DURATION_MS;
+
+  size_t i = lease.leases.size();
+  if(id) {
+    for(i = 0; i < lease.leases.size(); ++i) {
+      if(lease.leases[i].id == id)
+        break;
+    }
+  }
+
+  if(!duration_ms) {
+    if(i < lease.leases.size()) {
+      ++lease.released;
+      lease.leases.erase(lease.leases.begin() + i);
+      LeaseMerge(now);
+    }
+    return 0;
+  }
+
+  if(i < lease.leases.size())
+    ++lease.renewed;
+  else if(lease.leases.size() >= LEASE_MAX) {
+    ++lease.rejected;
+    return 0;
+  }
+  else {
+    ++lease.granted;
+    struct rate_lease l = { LeaseNewId(), client, };
+    lease.leases.push_back(l);
+    if(verbose >= 2) {
+      cout << TIMESTAMPED_PREFIX << "Rate lease granted to " << client
+           << ": every " << interval_ms << " ms for " << duration_ms
+           << " ms." << endl;
+    }
+  }
+
+  lease.leases[i].interval_ms = interval_ms;
+  lease.leases[i].expire_tick = now + duration_ms;
+  if(!lease.fastest_ms || interval_ms < lease.fastest_ms)
+    lease.fastest_ms = interval_ms;
+  id = lease.leases[i].id;
+  LeaseMerge(now);
+  return id;
+}
+
+/* Handle a lease that another process sent to the monitor window.
+   Return the lease id, or 0. */
+LRESULT LeaseReceive(const COPYDATASTRUCT *cds)
+{
+  if(cds->dwData != LEASE_COPYDATA_ID ||
+     cds->cbData != sizeof(struct rate_lease_request))
+    return 0;
+
+  struct rate_lease_request req;
+  memcpy(&req, cds->lpData, sizeof req);
+  req.client[sizeof req.client - 1] = '\0';
+  if(!req.interval_ms)
+    return 0;
+  return LeaseRequest(req.id, req.client, req.interval_ms, req.duration_ms,
+                      GetTickCount());
+}
+
+/* Return the wait after tick 'now' before the next poll: 'idle_delay', or the
+   interval of the merged lease if that's sooner. */
+DWORD LeasePollDelay(DWORD idle_delay, DWORD now)
+{
+  LeaseMerge(now);
+  if(lease.interval_ms && lease.interval_ms < idle_delay)
+    return lease.interval_ms;
+  return idle_delay;
+}
+
+/* A client's leases, one on each running monitor. */
+struct lease_client {
+  const char *name;
+  vector<pair<HWND, DWORD> > ids;  // monitor window, lease id
+};
+
+/* Request, renew or release (duration_ms 0) the client's lease on each running
+   monitor. Return how many monitors hold it. */
+unsigned LeaseSend(struct lease_client *c, DWORD interval_ms,
+                   DWORD duration_ms)
+{
+  struct rate_lease_request req;
+  memset(&req, 0, sizeof req);
+  req.interval_ms = interval_ms;
+  req.duration_ms = duration_ms;
+  strncpy(req.client, c->name, sizeof req.client - 1);
+
+  COPYDATASTRUCT cds;
+  cds.dwData = LEASE_COPYDATA_ID;
+  cds.cbData = sizeof req;
+  cds.lpData = &req;
+
+  vector<pair<HWND, DWORD> > ids;
+  HWND hwnd = NULL;
+  while((hwnd = FindWindowExA(NULL, hwnd, MONITOR_WINDOW_CLASS, NULL))) {
+    req.id = 0;
+    for(size_t i = 0; i < c->ids.size(); ++i) {
+      if(c->ids[i].first == hwnd)
+        req.id = c->ids[i].second;
+    }
+    DWORD_PTR result = 0;
+    if(SendMessageTimeoutA(hwnd, WM_COPYDATA, 0, (LPARAM)&cds,
+                           SMTO_ABORTIFHUNG | SMTO_BLOCK,
+                           LEASE_SEND_TIMEOUT_MS, &result) && result)
+      ids.push_back(make_pair(hwnd, (DWORD)result));
+  }
+  c->ids.swap(ids);
+  return (unsigned)c->ids.size();
+}
+
+/* --lease <rate>[,<duration>], where the rate is in Hz (eg 100hz) or is the
+   interval (eg 10ms). The default duration is 60s, and at most
+   LEASE_MAX_DURATION_MS. */
+bool ParseLease(const char *value, DWORD *interval_ms, DWORD *duration_ms)
+{
+  string rate = value, duration = "60s";
+  string::size_type comma = rate.find(',');
+  if(comma != string::npos) {
+    duration = rate.substr(comma + 1);
+    rate.erase(comma);
+  }
+
+  if(rate.size() > 2 && (!rate.compare(rate.size() - 2, 2, "hz") ||
+                         !rate.compare(rate.size() - 2, 2, "Hz"))) {
+    DWORD hz;
+    if(!ParseUnsigned(rate.erase(rate.size() - 2).c_str(), &hz) || !hz ||
+       hz > (1000 / LEASE_MIN_INTERVAL_MS))
+      return false;
+    *interval_ms = 1000 / hz;
+  }
+  else if(!ParseDurationMs(rate.c_str(), interval_ms) ||
+          *interval_ms < LEASE_MIN_INTERVAL_MS)
+    return false;
+
+  return ParseDurationMs(duration.c_str(), duration_ms) && *duration_ms &&
+         *duration_ms <= LEASE_MAX_DURATION_MS;
+}
+
+/* Request the lease from each running monitor. Return 0 if one granted it. */
+int Lease(DWORD interval_ms, DWORD duration_ms)
+{
+  struct lease_client c = { "--lease", };
+  unsigned granted = LeaseSend(&c, interval_ms, duration_ms);
+  if(!granted) {
+    cerr << "Error: No running monitor granted the lease." << endl;
+    return 1;
+  }
+  cout << "Sampling every " << interval_ms << " ms for " << duration_ms
+       << " ms, granted by " << granted << " monitor"
+       << (granted == 1 ? "" : "s") << "." << endl;
+  return 0;
+}
+
+void ShowLeaseStats()
+{
+  if(!lease.granted)
+    return;
+  ULONGLONG live_ms = lease.live_ms;
+  if(lease.interval_ms)
+    live_ms += GetTickCount() - lease.live_tick;
+  cout << "\nRate leases:\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Granted: " << right
+       << lease.granted << " (" << lease.renewed << " renewed, "
+       << lease.released << " released, " << lease.expired << " expired, "
+       << lease.rejected << " rejected)\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Fastest: " << right
+       << lease.fastest_ms << " ms\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Live: " << right
+       << (live_ms / 1000) << " s\n" << flush;
+}
+
+/* Event reactor.
+
+The monitor runs on one thread, so nothing it does may block. A source of I/O
+such as the MQTT socket registers an event and a callback with the reactor (for
+a socket the event is from WSAEventSelect). While the main loop waits for the
+next poll it waits on those events too, and calls a source's callback as soon
+as its event is signaled instead of at the next poll. A callback does its I/O
+without blocking and returns, and is called again the next time the event is
+signaled, so any number of sources share the one thread without one of them
+holding up the others or the polls.
+
+The callback must reset its event. WSAEnumNetworkEvents does that for a
+socket. The sources are waited on in turns so that one that's always signaled
+can't starve the others. A window message ends the wait so that it's handled
+right away.
+*/
+#define REACTOR_MAX_SOURCES (MAXIMUM_WAIT_OBJECTS - 2)  // + timer + messages
+#define REACTOR_DISPATCHED ((DWORD)-2)
+
+struct reactor_source {
+  const char *name;
+  HANDLE event;
+  void (*ready)(void *data);
+  void *data;
+  unsigned long dispatches;
+};
+
+struct reactor_state {
+  vector<reactor_source> sources;
+  size_t next;  // the source to check first, in turns
+} reactor;
+
+bool ReactorAdd(const char *name, HANDLE event, void (*ready)(void *data),
+                void *data)
+{
+  if(reactor.sources.size() >= REACTOR_MAX_SOURCES)
+    return false;
+  struct reactor_source src = { name, event, ready, data, 0 };
+  reactor.sources.push_back(src);
+  return true;
+}
+
+void ReactorRemove(HANDLE event)
+{
+  for(size_t i = 0; i < reactor.sources.size(); ++i) {
+    if(reactor.sources[i].event == event) {
+      reactor.sources.erase(reactor.sources.begin() + i);
+      return;
+    }
+  }
+}
+
+/* Wait up to 'ms' for a window message or a source's event. In low impact mode
+   the timeout may be up to LOW_IMPACT_TOLERABLE_DELAY_MS late, unless a rate
+   lease faster than that is live. If a source's event is signaled its callback
+   is called.
+   Return WAIT_TIMEOUT, WAIT_OBJECT_0 for a message, REACTOR_DISPATCHED if a
+   callback was called, or WAIT_FAILED. */
+DWORD ReactorWait(DWORD ms)
+{
+  HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+  DWORD sources = (DWORD)reactor.sources.size(), count = 0;
+
+  // rotate the order so that the first signaled source isn't always the same
+  for(DWORD i = 0; i < sources; ++i)
+    handles[count++] = reactor.sources[(reactor.next + i) % sources].event;
+
+  bool timer = false;
+  bool precise = (lease.interval_ms &&
+                  lease.interval_ms < LOW_IMPACT_TOLERABLE_DELAY_MS);
+  LARGE_INTEGER due;
+  due.QuadPart = -(LONGLONG)ms * 10000;  // relative, in 100ns units
+  if(ms && lowimp.timer && !precise &&
+     lowimp.SetWaitableTimerEx(lowimp.timer, &due, 0, NULL, NULL, NULL,
+                               LOW_IMPACT_TOLERABLE_DELAY_MS)) {
+    handles[count++] = lowimp.timer;
+    timer = true;
+  }
+
+  DWORD rc = MsgWaitForMultipleObjects(count, handles, FALSE,
+                                       timer ? INFINITE : ms, QS_ALLINPUT);
+  if(rc == WAIT_FAILED)
+    return rc;
+  ++lowimp.wakeups;
+
+  if(timer && rc != (WAIT_OBJECT_0 + count - 1))
+    CancelWaitableTimer(lowimp.timer);
+
+  if(rc == (WAIT_OBJECT_0 + count))
+    return WAIT_OBJECT_0;
+
+  if(rc >= WAIT_OBJECT_0 && rc < (WAIT_OBJECT_0 + sources)) {
+    size_t i = (reactor.next + (rc - WAIT_OBJECT_0)) % sources;
+    reactor.next = i + 1;
+    struct reactor_source *src = &reactor.sources[i];
+    ++src->dispatches;
+    // the callback may add or remove sources, so src isn't used after this
+    src->ready(src->data);
+    return REACTOR_DISPATCHED;
+  }
+
+  return WAIT_TIMEOUT;
+}
+
+/* Get the CPU time (user + kernel) used by the process so far, and when the
+   process was created as a FILETIME in 100ns units. */
+bool GetProcessCpuTime(ULONGLONG *cpu_ms, ULONGLONG *creation_time = NULL)
+{
+  FILETIME creation, exited, kernel, user;
+  if(!GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel, &user))
+    return false;
+
+  ULARGE_INTEGER k, u, c;
+  k.LowPart = kernel.dwLowDateTime;
+  k.HighPart = kernel.dwHighDateTime;
+  u.LowPart = user.dwLowDateTime;
+  u.HighPart = user.dwHighDateTime;
+  c.LowPart = creation.dwLowDateTime;
+  c.HighPart = creation.dwHighDateTime;
+  *cpu_ms = (k.QuadPart + u.QuadPart) / 10000;
+  if(creation_time)
+    *creation_time = c.QuadPart;
+  return true;
+}
+
+/* Resource tracking (option --stats).
+
+A leak of one handle or a few bytes per poll doesn't show in a short run, but
+the monitor is meant to run for weeks. With --stats it samples its handle
+count and private bytes every RESOURCE_SAMPLE_MINUTES, and warns if either
+grew in each of the last RESOURCE_TREND_SAMPLES samples, which over that many
+hours is a leak and not noise. The first, peak and current values are shown
+with the other statistics.
+*/
+#define RESOURCE_SAMPLE_MINUTES 60
+#define RESOURCE_TREND_SAMPLES 12
+
+/* PROCESS_MEMORY_COUNTERS, so that psapi.h and psapi.lib aren't needed */
+struct process_memory_counters {
+  DWORD cb;
+  DWORD PageFaultCount;
+  SIZE_T PeakWorkingSetSize;
+  SIZE_T WorkingSetSize;
+  SIZE_T QuotaPeakPagedPoolUsage;
+  SIZE_T QuotaPagedPoolUsage;
+  SIZE_T QuotaPeakNonPagedPoolUsage;
+  SIZE_T QuotaNonPagedPoolUsage;
+  SIZE_T PagefileUsage;
+  SIZE_T PeakPagefileUsage;
+};
+
+struct resource_sample {
+  DWORD handles;
+  SIZE_T private_bytes;
+  SIZE_T working_set;
+};
+
+struct resource_state {
+  BOOL (WINAPI *GetProcessMemoryInfo)(HANDLE, process_memory_counters *,
+                                      DWORD);
+  DWORD sample_tick;
+  unsigned long samples;
+  struct resource_sample first, peak, last;
+  unsigned handles_grew, bytes_grew;  // consecutive samples that grew
+} res;
+
+bool ResourceSample(struct resource_sample *s)
+{
+  if(!res.GetProcessMemoryInfo) {
+    /* K32GetProcessMemoryInfo is in kernel32 since Windows 7 */
+    res.GetProcessMemoryInfo =
+      (BOOL (WINAPI *)(HANDLE, process_memory_counters *, DWORD))
+      GetProcAddress(GetModuleHandleW(L"kernel32"),
+                     "K32GetProcessMemoryInfo");
+    if(!res.GetProcessMemoryInfo) {
+      HMODULE psapi = LoadLibraryA("psapi.dll");
+      if(!psapi)
+        return false;
+      res.GetProcessMemoryInfo =
+        (BOOL (WINAPI *)(HANDLE, process_memory_counters *, DWORD))
+        GetProcAddress(psapi, "GetProcessMemoryInfo");
+      if(!res.GetProcessMemoryInfo)
+        return false;
+    }
+  }
+
+  process_memory_counters pmc = { sizeof pmc, };
+  if(!GetProcessHandleCount(GetCurrentProcess(), &s->handles) ||
+     !res.GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof pmc))
+    return false;
+  s->private_bytes = pmc.PagefileUsage;
+  s->working_set = pmc.WorkingSetSize;
+  return true;
+}
+
+/* Sample the resources if it's time and warn of a growth trend. This is
+   called every poll. */
+void ResourceUpdate()
+{
+  DWORD now = GetTickCount();
+  if(res.samples &&
+     (now - res.sample_tick) < (RESOURCE_SAMPLE_MINUTES * 60 * 1000))
+    return;
+  res.sample_tick = now;
+
+  struct resource_sample s;
+  if(!ResourceSample(&s))
+    return;
+
+  if(!res.samples++)
+    res.first = res.peak = res.last = s;
+
+  res.handles_grew = (s.handles > res.last.handles) ? res.handles_grew + 1 : 0;
+  res.bytes_grew = (s.private_bytes > res.last.private_bytes) ?
+                   res.bytes_grew + 1 : 0;
+  res.last = s;
+
+  if(s.handles > res.peak.handles)
+    res.peak.handles = s.handles;
+  if(s.private_bytes > res.peak.private_bytes)
+    res.peak.private_bytes = s.private_bytes;
+  if(s.working_set > res.peak.working_set)
+    res.peak.working_set = s.working_set;
+
+  if((res.handles_grew == RESOURCE_TREND_SAMPLES ||
+      res.bytes_grew == RESOURCE_TREND_SAMPLES) &&
+     RateLimitAllow(OUTCLASS_WARNING)) {
+    cout << TIMESTAMPED_PREFIX << "Warning: The "
+         << (res.handles_grew == RESOURCE_TREND_SAMPLES ? "handle count" :
+                                                         "private bytes")
+         << " of battstatus grew in each of the last "
+         << RESOURCE_TREND_SAMPLES * RESOURCE_SAMPLE_MINUTES / 60
+         << " hours, possible leak." << endl;
+  }
+}
+
+void ShowProcessStats()
+{
+  ULONGLONG cpu_ms, creation_time;
+  if(!GetProcessCpuTime(&cpu_ms, &creation_time))
+    return;
+
+  ULARGE_INTEGER now;
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  now.LowPart = ft.dwLowDateTime;
+  now.HighPart = ft.dwHighDateTime;
+
+  double hours = (now.QuadPart > creation_time) ?
+                 (double)(now.QuadPart - creation_time) / 36000000000.0 : 0;
+
+  cout << "\nProcess:\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Low impact: " << right
+       << (low_impact ? "yes" : "no") << "\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Wakeups: " << right
+       << lowimp.wakeups;
+  if(hours > 0)
+    cout << " (" << (unsigned long)(lowimp.wakeups / hours + 0.5)
+         << " per hour)";
+  cout << "\n"
+       << left << setw(BATT_FIELD_WIDTH) << "CPU time: " << right
+       << cpu_ms << " ms";
+  if(hours > 0)
+    cout << " (" << (unsigned long)(cpu_ms / hours + 0.5) << " ms per hour)";
+  cout << "\n";
+  if(reactor.sources.size()) {
+    cout << left << setw(BATT_FIELD_WIDTH) << "Dispatches: " << right;
+    for(size_t i = 0; i < reactor.sources.size(); ++i) {
+      cout << (i ? ", " : "") << reactor.sources[i].name << " "
+           << reactor.sources[i].dispatches;
+    }
+    cout << "\n";
+  }
+
+  struct resource_sample s;
+  if(ResourceSample(&s)) {
+    if(!res.samples)
+      res.first = res.peak = s;
+    cout << left << setw(BATT_FIELD_WIDTH) << "Handles: " << right
+         << s.handles << " (first " << res.first.handles << ", peak "
+         << max(res.peak.handles, s.handles) << ")\n"
+         << left << setw(BATT_FIELD_WIDTH) << "Private bytes: " << right
+         << s.private_bytes / 1024 << " KB (first "
+         << res.first.private_bytes / 1024 << " KB, peak "
+         << max(res.peak.private_bytes, s.private_bytes) / 1024 << " KB)\n"
+         << left << setw(BATT_FIELD_WIDTH) << "Working set: " << right
+         << s.working_set / 1024 << " KB (peak "
+         << max(res.peak.working_set, s.working_set) / 1024 << " KB)\n";
+  }
+  cout << flush;
+}
+
+/* Degraded mode (option --degrade).
+
+While battery saver is on, or while on battery power at or below the percent
+set by --degrade-policy, the monitor degrades itself to use less power:
+
+- The power status is polled every <poll> (default 60s) instead of at the
+  learned refresh times. Changes that Windows broadcasts (AC power, battery
+  flag and percent) still wake the monitor right away.
+- The sensor profile isn't updated, because the long polls would skew it.
+- Telemetry isn't read, verbose mode doesn't show the full status, and the
+  power status isn't published to MQTT, though the connection is kept alive.
+- The dashboard is redrawn only on each poll.
+
+The one-liners, warnings and errors are shown as usual. Everything is
+restored when neither condition holds. Each transition is shown, and on
+leaving degraded mode so are the wakeups and CPU time it used, for comparison
+with the rates in --stats.
+*/
+#define DEGRADE_DEFAULT_POLL_MS (60 * 1000)
+
+struct degrade_state {
+  BYTE percent;   // degrade on battery at or below this percent, 0 for never
+  DWORD poll_ms;
+  bool active;
+  DWORD start_tick;
+  unsigned long start_wakeups;
+  ULONGLONG start_cpu_ms;
+} degr = { 0, DEGRADE_DEFAULT_POLL_MS };
+
+bool ParseDegradePolicy(const char *value)
+{
+  vector<pair<string, string> > pairs;
+  if(!ParseNameValueList(value, &pairs))
+    return false;
+
+  for(size_t i = 0; i < pairs.size(); ++i) {
+    const char *amount = pairs[i].second.c_str();
+    DWORD n;
+    if(pairs[i].first == "percent") {
+      if(!ParseUnsigned(amount, &n) || n > 100)
+        return false;
+      degr.percent = (BYTE)n;
+    }
+    else if(pairs[i].first == "poll") {
+      if(!ParseDurationMs(amount, &n) || n < 1000)
+        return false;
+      degr.poll_ms = n;
+    }
+    else
+      return false;
+  }
+  return true;
+}
+
+/* Enter or leave degraded mode depending on the power status. This is called
+   every poll. */
+void DegradeUpdate(const SYSTEM_POWER_STATUS *status)
+{
+  bool saver = (os.dwMajorVersion >= 10 && BATTSAVER(*status));
+  bool low = (degr.percent && !PLUGGED_IN(*status) &&
+              status->BatteryLifePercent <= degr.percent);
+
+  if((saver || low) == degr.active)
+    return;
+  degr.active = !degr.active;
+
+  DWORD now = GetTickCount();
+  ULONGLONG cpu_ms = 0;
+  GetProcessCpuTime(&cpu_ms);
+
+  cout << TIMESTAMPED_PREFIX;
+  if(degr.active) {
+    degr.start_tick = now;
+    degr.start_wakeups = lowimp.wakeups;
+    degr.start_cpu_ms = cpu_ms;
+    cout << "Degraded mode on: ";
+    if(saver)
+      cout << "Battery saver is on.";
+    else
+      cout << "Battery at " << (unsigned)status->BatteryLifePercent << "%.";
+  }
+  else {
+    cout << "Degraded mode off after "
+         << BatteryLifeTimeStr((now - degr.start_tick) / 1000) << ": "
+         << (lowimp.wakeups - degr.start_wakeups) << " wakeups, "
+         << (cpu_ms - degr.start_cpu_ms) << " ms CPU time.";
+  }
+  cout << endl;
+}
+
+/* Coalesced output (option --coalesce).
+
+Every endl flushes cout, and when the output is redirected to a file each
+flush is a write that wakes the storage device. With --coalesce <time> the
+output is held in memory while on battery power and written in one go once the
+oldest held output is <time> old. It's written immediately instead:
+
+- on AC power, and held output as soon as AC is plugged in
+- while the battery is critical, and when it becomes low
+- for warnings and errors such as a battery revival or a failed poll, all of
+  the output of that poll
+- before the computer suspends, and on exit, Ctrl+C, logoff and shutdown
+- when more than COALESCE_MAX_BYTES is held
+
+So the loss window is bounded: if battstatus is killed or the computer loses
+power then at most the last <time> of output (and no more than
+COALESCE_MAX_BYTES) is lost. The held output may be <time> old between polls,
+which can be 10s apart or the degraded poll apart, so the main loop also wakes
+when it's due (CoalesceDelay). With --low-impact that wakeup may be up to
+LOW_IMPACT_TOLERABLE_DELAY_MS late. CoalescePolicy applies the policy from the
+power status on each poll. --coalesce-check checks the bound.
+*/
+#define COALESCE_MAX_BYTES (64 * 1024)
+
+#define BATTERY_FLAG_LOW 2
+#define BATTERY_FLAG_CRITICAL 4
+#define BATTERY_FLAG_UNKNOWN 255
+
+class CoalesceBuf : public streambuf
+{
+public:
+  streambuf *dest;
+  DWORD window_ms;
+  bool hold;      // on battery: hold the output
+  bool urgent;    // write at each flush even if holding, until the poll ends
+  unsigned long flushes;
+  unsigned long writes;
+
+  CoalesceBuf()
+    : dest(NULL), window_ms(0), hold(false), urgent(false), flushes(0),
+      writes(0), first_tick(0)
+  {
+    InitializeCriticalSection(&lock);
+  }
+
+  /* Write the held output. If 'expired' then only if it's old enough. */
+  void Write(bool expired = false)
+  {
+    EnterCriticalSection(&lock);
+    if(!expired || (pending.size() &&
+                    (GetTickCount() - first_tick) >= window_ms))
+      WriteLocked();
+    LeaveCriticalSection(&lock);
+  }
+
+  /* Return how many milliseconds until the held output is old enough to be
+     written, or INFINITE if none is held. */
+  DWORD Delay()
+  {
+    DWORD delay = INFINITE;
+    EnterCriticalSection(&lock);
+    if(pending.size()) {
+      DWORD age = GetTickCount() - first_tick;
+      delay = (age < window_ms) ? window_ms - age : 0;
+    }
+    LeaveCriticalSection(&lock);
+    return delay;
+  }
+
+protected:
+  int overflow(int c)
+  {
+    if(c == EOF)
+      return 0;
+    char ch = (char)c;
+    xsputn(&ch, 1);
+    return c;
+  }
+
+  streamsize xsputn(const char *s, streamsize n)
+  {
+    EnterCriticalSection(&lock);
+    if(pending.empty())
+      first_tick = GetTickCount();
+    pending.append(s, (size_t)n);
+    LeaveCriticalSection(&lock);
+    return n;
+  }
+
+  int sync()
+  {
+    EnterCriticalSection(&lock);
+    ++flushes;
+    if(!hold || urgent || pending.size() >= COALESCE_MAX_BYTES ||
+       (GetTickCount() - first_tick) >= window_ms)
+      WriteLocked();
+    LeaveCriticalSection(&lock);
+    return 0;
+  }
+
+private:
+  void WriteLocked()
+  {
+    if(pending.empty())
+      return;
+    dest->sputn(pending.data(), (streamsize)pending.size());
+    dest->pubsync();
+    pending.clear();
+    ++writes;
+  }
+
+  CRITICAL_SECTION lock;
+  string pending;
+  DWORD first_tick;  // when the oldest held output was written
+};
+
+CoalesceBuf coalesce_buf;
+
+/* Write the output that's held, if any. */
+void CoalesceWrite()
+{
+  if(coalesce_buf.dest)
+    coalesce_buf.Write();
+}
+
+/* Mark the output that follows as urgent, so it's written at each flush (eg
+   endl) even on battery power until the end of the poll. So each line of a
+   multi-line warning is written right away. */
+void CoalesceUrgent()
+{
+  if(coalesce_buf.dest)
+    coalesce_buf.urgent = true;
+}
+
+/* End the poll: write what's held if it was urgent, then hold again. */
+void CoalescePollEnd()
+{
+  if(coalesce_buf.dest && coalesce_buf.urgent) {
+    coalesce_buf.Write();
+    coalesce_buf.urgent = false;
+  }
+}
+
+/* Return how many milliseconds until the held output is due. */
+DWORD CoalesceDelay()
+{
+  return coalesce_buf.dest ? coalesce_buf.Delay() : INFINITE;
+}
+
+/* Write the held output if it's due. */
+void CoalesceService()
+{
+  if(coalesce_buf.dest)
+    coalesce_buf.Write(true);
+}
+
+void CoalesceExit()
+{
+  CoalesceWrite();
+  // cout outlives coalesce_buf so stop using it
+  cout.rdbuf(coalesce_buf.dest);
+}
+
+BOOL WINAPI CoalesceCtrlHandler(DWORD)
+{
+  // write what's held and anything shown from now on
+  coalesce_buf.hold = false;
+  CoalesceWrite();
+  return FALSE;  // continue on to the other handlers, then exit
+}
+
+void CoalesceInit()
+{
+  cout << flush;
+  coalesce_buf.window_ms = coalesce_seconds * 1000;
+  coalesce_buf.dest = cout.rdbuf(&coalesce_buf);
+  atexit(CoalesceExit);
+  SetConsoleCtrlHandler(CoalesceCtrlHandler, TRUE);
+}
+
+/* Hold the output or write it depending on the power status. This is called
+   for every power status poll. */
+void CoalescePolicy(const SYSTEM_POWER_STATUS *status)
+{
+  static BYTE prev_flag = BATTERY_FLAG_UNKNOWN;
+  BYTE flag = status->BatteryFlag;
+  bool known = (flag != BATTERY_FLAG_UNKNOWN);
+  bool became_low = known && (flag & BATTERY_FLAG_LOW) &&
+                    (prev_flag == BATTERY_FLAG_UNKNOWN ||
+                     !(prev_flag & BATTERY_FLAG_LOW));
+  prev_flag = flag;
+
+  coalesce_buf.hold = !PLUGGED_IN(*status) &&
+                      !(known && (flag & BATTERY_FLAG_CRITICAL));
+  coalesce_buf.Write(coalesce_buf.hold && !became_low);
+}
+
+void ShowCoalesceStats()
+{
+  cout << "\nCoalesced output:\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Writes: " << right
+       << coalesce_buf.writes << " (for " << coalesce_buf.flushes
+       << " flushes)\n" << flush;
+}
+
+/* Check the loss window (option --coalesce-check).
+
+Run the coalesced output as on battery power for <time>, with polls at random
+intervals from COALESCE_CHECK_POLL_MIN_MS to COALESCE_CHECK_POLL_MAX_MS (the
+longest adaptive poll). A poll may show a status line and now and then a
+multi-line warning, each stamped with the tick it was shown. Between the polls
+the wait is the same as the main loop's. The output goes to a buffer that
+records how long each line was held, instead of the console. It's an error if
+a status line was held longer than <coalesce time> or a warning line at all,
+give or take COALESCE_CHECK_SLACK_MS for the timers.
+*/
+#define COALESCE_CHECK_POLL_MIN_MS 100
+#define COALESCE_CHECK_POLL_MAX_MS 10000
+#define COALESCE_CHECK_SLACK_MS 250
+
+/* Receives lines "<S|W> <tick>" and records how long they were held. */
+class CoalesceCheckBuf : public streambuf
+{
+public:
+  DWORD status_max_ms;   // the longest a status line was held
+  DWORD warning_max_ms;  // the longest a warning line was held
+  unsigned long status_lines;
+  unsigned long warning_lines;
+  unsigned long writes;
+
+  CoalesceCheckBuf()
+    : status_max_ms(0), warning_max_ms(0), status_lines(0), warning_lines(0),
+      writes(0)
+  {
+  }
+
+protected:
+  int overflow(int c)
+  {
+    if(c == EOF)
+      return 0;
+    char ch = (char)c;
+    xsputn(&ch, 1);
+    return c;
+  }
+
+  streamsize xsputn(const char *s, streamsize n)
+  {
+    DWORD now = GetTickCount();
+    partial.append(s, (size_t)n);
+    for(string::size_type eol; (eol = partial.find('\n')) != string::npos;
+        partial.erase(0, eol + 1)) {
+      istringstream line(partial.substr(0, eol));
+      char kind;
+      DWORD tick;
+      if(!(line >> kind >> tick))
+        continue;
+      DWORD held = now - tick;
+      if(kind == 'W') {
+        ++warning_lines;
+        warning_max_ms = max(warning_max_ms, held);
+      }
+      else {
+        ++status_lines;
+        status_max_ms = max(status_max_ms, held);
+      }
+    }
+    return n;
+  }
+
+  int sync()
+  {
+    ++writes;
+    return 0;
+  }
+
+private:
+  string partial;
+};
+
+/* Return 0 if the loss window held for 'seconds'. */
+int CoalesceCheck(DWORD seconds)
+{
+  CoalesceCheckBuf check;
+
+  cout << "Checking the loss window of --coalesce " << coalesce_seconds
+       << "s for " << seconds << " seconds..." << endl;
+
+  streambuf *console = cout.rdbuf(&coalesce_buf);
+  coalesce_buf.window_ms = coalesce_seconds * 1000;
+  coalesce_buf.dest = &check;
+  coalesce_buf.hold = true;
+
+  DWORD start = GetTickCount(), seed = 1;
+  DWORD poll_tick = start;
+  while((GetTickCount() - start) < (seconds * 1000)) {
+    DWORD now = GetTickCount();
+    if((LONG)(now - poll_tick) >= 0) {
+      seed = (seed * 1103515245) + 12345;
+      DWORD random = (seed >> 16) & 0x7FFF;
+      if(!(random % 10)) {
+        CoalesceUrgent();
+        for(int i = 0; i < 3; ++i)
+          cout << "W " << GetTickCount() << endl;
+      }
+      if(random % 2)
+        cout << "S " << GetTickCount() << endl;
+      CoalescePollEnd();
+
+      seed = (seed * 1103515245) + 12345;
+      poll_tick = now + COALESCE_CHECK_POLL_MIN_MS +
+                  (((seed >> 16) & 0x7FFF) %
+                   (COALESCE_CHECK_POLL_MAX_MS - COALESCE_CHECK_POLL_MIN_MS));
+    }
+
+    DWORD wait = ((LONG)(poll_tick - now) > 0) ? poll_tick - now : 0;
+    if(CoalesceDelay() < wait)
+      wait = CoalesceDelay();
+    Sleep(wait);
+    CoalesceService();
+  }
+
+  coalesce_buf.Write();
+  coalesce_buf.dest = NULL;
+  cout.rdbuf(console);
+
+  bool ok = (check.status_max_ms <=
+             (coalesce_buf.window_ms + COALESCE_CHECK_SLACK_MS) &&
+             check.warning_max_ms <= COALESCE_CHECK_SLACK_MS);
+
+#define SHOW_CHECK(name) \
+  cout << left << setw(BATT_FIELD_WIDTH) << name ": " << right
+
+  cout << "\n";
+  SHOW_CHECK("Status lines") << check.status_lines << " (held at most "
+                             << check.status_max_ms << " ms)\n";
+  SHOW_CHECK("Warning lines") << check.warning_lines << " (held at most "
+                              << check.warning_max_ms << " ms)\n";
+  SHOW_CHECK("Writes") << check.writes << "\n";
+  SHOW_CHECK("Result") << (ok ? "OK" : "FAILED, the loss window was exceeded")
+                       << "\n" << flush;
+
+#undef SHOW_CHECK
+  return ok ? 0 : 1;
+}
+
+/* Sensor profile.
+
+How often the OS refreshes the battery information, and in what steps the
+values change, depends on the battery and its driver and isn't reported
+anywhere. So the monitor learns it: for each field it counts the changes,
+estimates the refresh period from the intervals between them and the quantum
+from the greatest common divisor of the steps, and tracks the phase of the
+refreshes as a window (lower, upper] that the last refresh happened in.
+
+The monitor polls once a second by default. With option --align-polls the
+polls are instead scheduled just after the next expected refresh of the polled
+fields. While the phase window is wide a probe at its middle halves it, so the
+staleness of the data converges on SENSOR_MARGIN_MS. The window is widened a
+little on each refresh to follow drift. Changes in the fields marked announced
+are broadcast by the OS as WM_POWERBROADCAST, which wakes the monitor anyway,
+so they don't need polls. Until the period of a polled field is known, or if
+one is shorter than SENSOR_MIN_ALIGN_MS, polls stay once a second. A field
+that rarely changes, such as SystemStatusFlag (battery saver), has no known
+period and is seen at the next poll, at most SENSOR_MAX_WAIT_MS later.
+
+The profile is shown on exit by option --stats, see ShowStats.
+*/
+#define SENSOR_HISTORY 16             // change intervals kept per field
+#define SENSOR_MIN_CHANGES 4          // before the period is used
+#define SENSOR_MARGIN_MS 50           // poll this long after a refresh
+#define SENSOR_PHASE_MS 200           // phase window narrow enough
+#define SENSOR_DRIFT_MS 20            // phase window widening per refresh
+#define SENSOR_MIN_ALIGN_MS 2000
+#define SENSOR_MAX_WAIT_MS 10000
+#define SENSOR_DEFAULT_WAIT_MS 1000
+
+enum sensor_id {
+  SENSOR_ACLineStatus,
+  SENSOR_BatteryFlag,
+  SENSOR_BatteryLifePercent,
+  SENSOR_BatteryLifeTime,
+  SENSOR_SystemStatusFlag,
+  SENSOR_RemainingCapacity,
+  SENSOR_Rate,
+  SENSOR_EstimatedTime,
+  SENSOR_COUNT
+};
+
+struct sensor_field {
+  const char *name;
+  bool announced;         // changes are broadcast by WM_POWERBROADCAST
+  bool valid;             // value has been read
+  long long value;
+  unsigned long changes;
+  DWORD change_tick;      // upper bound of the last refresh
+  DWORD phase_ms;         // width of the window the last refresh was in
+  deque<DWORD> intervals; // between changes, most recent last
+  DWORD period_ms;        // 0 if unknown
+  long long quantum;      // 0 if unknown
+};
+
+struct sensor_profile {
+  struct sensor_field field[SENSOR_COUNT];
+  DWORD start_tick;
+  DWORD poll_tick;        // last poll
+  unsigned long polls;
+  unsigned long idle_polls;     // polls that returned nothing new
+  unsigned long aligned_polls;  // polls scheduled by the profile
+  bool aligned;                 // the next poll is scheduled by the profile
+} sensors;
+
+long long Gcd(long long a, long long b)
+{
+  while(b) {
+    long long t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/* Estimate the refresh period from the change intervals. A value doesn't
+   necessarily change on every refresh so each interval is some multiple of
+   the period: divide each by its multiple of the shortest interval and take
+   the median. */
+DWORD SensorPeriod(const deque<DWORD> &intervals)
+{
+  if(intervals.size() < (SENSOR_MIN_CHANGES - 1))
+    return 0;
+
+  DWORD shortest = *min_element(intervals.begin(), intervals.end());
+  if(!shortest)
+    return 0;
+
+  vector<DWORD> periods;
+  for(size_t i = 0; i < intervals.size(); ++i) {
+    DWORD n = (intervals[i] + (shortest / 2)) / shortest;
+    periods.push_back(intervals[i] / (n ? n : 1));
+  }
+  nth_element(periods.begin(), periods.begin() + (periods.size() / 2),
+              periods.end());
+  return periods[periods.size() / 2];
+}
+
+void SensorUpdate(struct sensor_field *f, long long value, DWORD now,
+                  bool *changed)
+{
+  if(!f->valid) {
+    f->valid = true;
+    f->value = value;
+    return;
+  }
+  if(value == f->value)
+    return;
+
+  long long step = value > f->value ? value - f->value : f->value - value;
+  f->quantum = Gcd(f->quantum, step);
+  f->value = value;
+  *changed = true;
+
+  /* The refresh happened after the previous poll. If the period is known it
+     also happened in the expected window, so narrow the window to where the
+     two overlap. */
+  DWORD lower = sensors.poll_tick;
+  DWORD upper = now;
+  if(f->changes && f->period_ms) {
+    DWORD since = now - f->change_tick;
+    DWORD k = (since + (f->period_ms / 2)) / f->period_ms;
+    DWORD expected_upper = f->change_tick + (k * f->period_ms);
+    DWORD expected_lower = expected_upper - f->phase_ms;
+    if((LONG)(expected_lower - lower) > 0)
+      lower = expected_lower;
+    if((LONG)(expected_upper - upper) < 0)
+      upper = expected_upper;
+    if((LONG)(upper - lower) < 0) {
+      // not where expected, maybe the period has changed
+      lower = sensors.poll_tick;
+      upper = now;
+    }
+  }
+
+  if(f->changes) {
+    f->intervals.push_back(upper - f->change_tick);
+    if(f->intervals.size() > SENSOR_HISTORY)
+      f->intervals.pop_front();
+    f->period_ms = SensorPeriod(f->intervals);
+  }
+
+  ++f->changes;
+  f->change_tick = upper;
+  f->phase_ms = upper - lower;
+}
+
+/* Record a poll of the battery information at tick 'now'. 'sbs' is the
+   battery state from the same poll, or NULL if it isn't available. */
+void SensorSample(const SYSTEM_POWER_STATUS *status, DWORD now,
+                  const SYSTEM_BATTERY_STATE *sbs)
+{
+  bool changed = false;
+  struct sensor_field *f = sensors.field;
+
+  if(!sensors.polls++) {
+    sensors.start_tick = now;
+    sensors.poll_tick = now;
+    f[SENSOR_ACLineStatus].announced = true;
+    f[SENSOR_BatteryFlag].announced = true;
+    f[SENSOR_BatteryLifePercent].announced = true;
+#define SENSOR_NAME(field) f[SENSOR_##field].name = #field
+    SENSOR_NAME(ACLineStatus);
+    SENSOR_NAME(BatteryFlag);
+    SENSOR_NAME(BatteryLifePercent);
+    SENSOR_NAME(BatteryLifeTime);
+    SENSOR_NAME(SystemStatusFlag);
+    SENSOR_NAME(RemainingCapacity);
+    SENSOR_NAME(Rate);
+    SENSOR_NAME(EstimatedTime);
+#undef SENSOR_NAME
+  }
+
+  if(sensors.aligned)
+    ++sensors.aligned_polls;
+
+  SensorUpdate(&f[SENSOR_ACLineStatus], status->ACLineStatus, now, &changed);
+  SensorUpdate(&f[SENSOR_BatteryFlag], status->BatteryFlag, now, &changed);
+  SensorUpdate(&f[SENSOR_BatteryLifePercent], status->BatteryLifePercent,
+               now, &changed);
+  SensorUpdate(&f[SENSOR_BatteryLifeTime], status->BatteryLifeTime, now,
+               &changed);
+  SensorUpdate(&f[SENSOR_SystemStatusFlag], status->SystemStatusFlag, now,
+               &changed);
+
+  if(sbs) {
+    SensorUpdate(&f[SENSOR_RemainingCapacity], sbs->RemainingCapacity, now,
+                 &changed);
+    SensorUpdate(&f[SENSOR_Rate], (LONG)sbs->Rate, now, &changed);
+    SensorUpdate(&f[SENSOR_EstimatedTime], sbs->EstimatedTime, now, &changed);
+  }
+
+  if(!changed)
+    ++sensors.idle_polls;
+  sensors.poll_tick = now;
+}
+
+/* Return how many milliseconds to wait after tick 'now' before the next
+   poll. */
+DWORD SensorPollDelay(DWORD now)
+{
+  if(!align_polls) {
+    sensors.aligned = false;
+    return SENSOR_DEFAULT_WAIT_MS;
+  }
+
+  DWORD delay = SENSOR_MAX_WAIT_MS;
+  bool aligned = false;
+
+  for(int i = 0; i < SENSOR_COUNT; ++i) {
+    struct sensor_field *f = &sensors.field[i];
+    if(f->announced || !f->changes || !f->period_ms)
+      continue;
+    if(f->period_ms < SENSOR_MIN_ALIGN_MS) {
+      aligned = false;
+      break;
+    }
+    aligned = true;
+
+    /* Refresh k after the last change is expected in the window
+       (change_tick + k*period - phase_ms, change_tick + k*period]. Find the
+       first whose poll is still to come. Widen the window for drift. */
+    DWORD since = now - f->change_tick;
+    DWORD k = (since >= SENSOR_MARGIN_MS) ?
+              ((since - SENSOR_MARGIN_MS) / f->period_ms) + 1 : 1;
+    DWORD upper = (k * f->period_ms);
+    DWORD phase = f->phase_ms + (k * SENSOR_DRIFT_MS);
+    DWORD target = upper + SENSOR_MARGIN_MS;
+    if(phase > SENSOR_PHASE_MS && phase < f->period_ms &&
+       since < (upper - (phase / 2)))
+      target = upper - (phase / 2);
+
+    if((target - since) < delay)
+      delay = target - since;
+  }
+
+  sensors.aligned = aligned;
+  return aligned ? delay : SENSOR_DEFAULT_WAIT_MS;
+}
+
+void ShowSensorProfile()
+{
+  if(!sensors.polls)
+    return;
+
+  DWORD elapsed = GetTickCount() - sensors.start_tick;
+
+  cout << "\nSensor profile:\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Polls: " << right
+       << sensors.polls << " in " << BatteryLifeTimeStr(elapsed / 1000)
+       << " (" << sensors.idle_polls << " returned nothing new, "
+       << sensors.aligned_polls << " aligned to refreshes, "
+       << (elapsed / 1000) + 1 << " at once a second)\n\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Field" << right
+       << setw(8) << "Changes" << setw(10) << "Period" << setw(10) << "Phase"
+       << setw(10) << "Quantum" << "\n";
+
+  for(int i = 0; i < SENSOR_COUNT; ++i) {
+    const struct sensor_field *f = &sensors.field[i];
+    stringstream period, phase, quantum;
+    if(f->period_ms)
+      period << fixed << setprecision(1) << (f->period_ms / 1000.0) << "s";
+    else
+      period << "?";
+    if(f->changes)
+      phase << "+/-" << (f->phase_ms / 2) << "ms";
+    else
+      phase << "?";
+    if(f->quantum)
+      quantum << f->quantum;
+    else
+      quantum << "?";
+    cout << left << setw(BATT_FIELD_WIDTH)
+         << (string(f->name) + (f->announced ? " *" : "")) << right
+         << setw(8) << f->changes << setw(10) << period.str()
+         << setw(10) << phase.str() << setw(10) << quantum.str() << "\n";
+  }
+  cout << "\n* Changes are broadcast by the OS and don't need polling." << endl;
+}
+
+/* Running mean and variance, using Welford's method. */
+struct running_stats {
+  unsigned long n;
+  double mean;
+  double m2;  // sum of the squares of the differences from the mean
+};
+
+void StatsAdd(struct running_stats *rs, double x)
+{
+  ++rs->n;
+  double delta = x - rs->mean;
+  rs->mean += delta / rs->n;
+  rs->m2 += delta * (x - rs->mean);
+}
+
+double StatsStdDev(const struct running_stats *rs)
+{
+  return rs->n > 1 ? sqrt(rs->m2 / (rs->n - 1)) : 0;
+}
+
+/* Return the half width of the 95% confidence interval of the mean. */
+double StatsConfidence95(const struct running_stats *rs)
+{
+  // two-sided 95% Student's t for 1 to 30 degrees of freedom
+  static const double t[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+  };
+  if(rs->n < 2)
+    return HUGE_VAL;
+  unsigned long df = rs->n - 1;
+  return (df <= 30 ? t[df - 1] : 1.960) * StatsStdDev(rs) / sqrt((double)rs->n);
+}
+
+string Utf8Str(const wchar_t *wstr)
+{
+  if(!wstr)
+    return "";
+  int len = WideCharToMultiByte(CP_UTF8, 0, wstr, -1, NULL, 0, NULL, NULL);
+  if(len <= 1)
+    return "";
+  vector<char> buf(len);
+  WideCharToMultiByte(CP_UTF8, 0, wstr, -1, &buf[0], len, NULL, NULL);
+  return &buf[0];
+}
+
+string ComputerNameStr()
+{
+  char computer[MAX_COMPUTERNAME_LENGTH + 1];
+  DWORD size = sizeof computer;
+  if(!GetComputerNameA(computer, &size))
+    return "unknown";
+  return computer;
+}
+
+/* Get the unique ids of the batteries that are present. */
+vector<string> GetBatteryUniqueIds()
+{
+  vector<battery> batteries;
+  vector<string> ids;
+
+  EnumBattInterfaces(EnumBattInterfacesProc, &batteries);
+  for(size_t i = 0; i < batteries.size(); ++i) {
+    if(batteries[i].unique_id)
+      ids.push_back(Utf8Str(batteries[i].unique_id));
+  }
+  FreeBatteries(&batteries);
+  return ids;
+}
+
+/* State files.
+
+battstatus keeps what it learns about this computer's batteries in the state
+directory %LOCALAPPDATA%\battstatus. Each state file there is text with one
+record per line: <key><tab><value>. A record is replaced by writing a new
+file and renaming it over the old one, so a reader never sees a partial
+file. */
+
+/* Return the state directory, creating it if necessary, or an empty string
+   if there's no such directory. */
+string StateDirectory()
+{
+  char buf[MAX_PATH];
+  DWORD len = GetEnvironmentVariableA("LOCALAPPDATA", buf, sizeof buf);
+  if(!len || len >= sizeof buf) {
+    // Windows XP doesn't have LOCALAPPDATA
+    len = GetEnvironmentVariableA("APPDATA", buf, sizeof buf);
+    if(!len || len >= sizeof buf)
+      return "";
+  }
+
+  string dir = string(buf) + "\\battstatus";
+  if(!CreateDirectoryA(dir.c_str(), NULL) &&
+     GetLastError() != ERROR_ALREADY_EXISTS)
+    return "";
+  return dir;
+}
+
+/* Make 'key' safe to use as a state record key. */
+string StateKeyStr(string key)
+{
+  for(size_t i = 0; i < key.size(); ++i) {
+    if(key[i] == '\t' || key[i] == '\r' || key[i] == '\n')
+      key[i] = ' ';
+  }
+  return key;
+}
+
+/* The key for this computer and its set of batteries. */
+string BatterySetKey()
+{
+  vector<string> ids = GetBatteryUniqueIds();
+  string key = ComputerNameStr() + "/";
+  for(size_t i = 0; i < ids.size(); ++i)
+    key += (i ? "+" : "") + ids[i];
+  return StateKeyStr(key);
+}
+
+bool LoadStateRecord(const char *name, const string &key, string *value)
+{
+  string dir = StateDirectory();
+  if(dir.empty())
+    return false;
+
+  ifstream in((dir + "\\" + name).c_str());
+  string line;
+  while(getline(in, line)) {
+    string::size_type tab = line.find('\t');
+    if(tab != string::npos && line.compare(0, tab, key) == 0) {
+      *value = line.substr(tab + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool SaveStateRecord(const char *name, const string &key, const string &value)
+{
+  string dir = StateDirectory();
+  if(dir.empty())
+    return false;
+
+  string path = dir + "\\" + name;
+  string tmp = path + ".tmp";
+  vector<string> lines;
+  bool replaced = false;
+  {
+    ifstream in(path.c_str());
+    string line;
+    while(getline(in, line)) {
+      string::size_type tab = line.find('\t');
+      if(tab != string::npos && line.compare(0, tab, key) == 0) {
+        line = key + "\t" + value;
+        replaced = true;
+      }
+      lines.push_back(line);
+    }
+  }
+  if(!replaced)
+    lines.push_back(key + "\t" + value);
+
+  {
+    ofstream out(tmp.c_str(), ios::trunc);
+    for(size_t i = 0; i < lines.size(); ++i)
+      out << lines[i] << "\n";
+    if(!out.flush())
+      return false;
+  }
+  return !!MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+}
+
+/* Idle power baseline (option --baseline).
+
+Measure the idle drain until the 95% confidence interval of the mean is
+narrower than the target (--baseline-ci) instead of for a fixed time. Each
+new rate that the battery reports is one sample, since polling faster than
+the battery updates would just count the same report many times.
+
+Samples are discarded while on AC power and for RESUME_SPAN_MINUTES after the
+computer resumes (RecentlyResumed, the same test the monitor uses) or the
+monitor window receives WM_POWERBROADCAST, since the drain is not idle then.
+
+Consecutive samples aren't independent: the battery reports a rate averaged
+over some time and the idle load comes in bursts that span several reports.
+The confidence interval of the samples would be too narrow, so it's of batch
+means instead: the samples are grouped into batches of BASELINE_BATCH_SECONDS,
+and the mean of each batch, which is close to independent of the next, is one
+observation. The baseline is the mean of the batch means and needs at least
+BASELINE_MIN_BATCHES of them.
+
+The result is saved in state file baseline.txt per computer and set of
+batteries, and --measure uses it when --measure-idle isn't given.
+*/
+#define BASELINE_STATE_FILE "baseline.txt"
+#define BASELINE_INTERVAL_MS 1000
+#define BASELINE_BATCH_SECONDS 60
+#define BASELINE_MIN_BATCHES 10
+#define BASELINE_MAX_HOURS 4
+
+struct idle_baseline {
+  double mean_mw;        // idle drain
+  double confidence_mw;  // half width of the 95% confidence interval
+  unsigned long samples;
+  time_t when;
+};
+
+bool LoadBaseline(struct idle_baseline *b)
+{
+  string value;
+  if(!LoadStateRecord(BASELINE_STATE_FILE, BatterySetKey(), &value))
+    return false;
+
+  stringstream ss(value);
+  long long when;
+  if(!(ss >> b->mean_mw >> b->confidence_mw >> b->samples >> when))
+    return false;
+  b->when = (time_t)when;
+  return true;
+}
+
+bool SaveBaseline(const struct idle_baseline *b)
+{
+  stringstream ss;
+  ss << std::fixed << setprecision(1) << b->mean_mw << " "
+     << b->confidence_mw << " " << b->samples << " " << (long long)b->when;
+  return SaveStateRecord(BASELINE_STATE_FILE, BatterySetKey(), ss.str());
+}
+
+/* --baseline-ci <n>[%] */
+bool ParseBaselineCI(const char *value)
+{
+  string n = value;
+  baseline_ci_relative = (n.size() && n[n.size() - 1] == '%');
+  if(baseline_ci_relative)
+    n.erase(n.size() - 1);
+  return ParseUnsigned(n.c_str(), &baseline_ci) && baseline_ci;
+}
+
+/* Energy measurement (option --measure).
+
+Run a command and measure the battery energy it used, like perf stat for the
+battery. The battery rate and remaining capacity are sampled every
+MEASURE_INTERVAL_MS for the whole run. Since the battery only reports a new
+rate every so often, each reported rate is held until the next one and the
+energy is the integral of those rates over time.
+
+If the command finishes before the battery reports even one new rate then
+nothing was learned about it during the run, so the meter keeps sampling
+until the battery does report (for up to MEASURE_SETTLE_MAX_SECONDS) and uses
+that rate for the duration of the run, and the result is marked approximate.
+
+The optional idle baseline (--measure-idle) is measured the same way before
+the command is started, so the cost of battstatus's own sampling cancels out.
+Otherwise the baseline saved by --baseline is used, if any.
+*/
+#define MEASURE_INTERVAL_MS 100
+#define MEASURE_SETTLE_MAX_SECONDS 60
+
+struct energy_meter {
+  LARGE_INTEGER freq;
+  LARGE_INTEGER start;     // when metering started
+  LARGE_INTEGER last;      // when the last sample was taken
+  LONG rate;               // the last reported rate in mW, 0 if unknown
+  DWORD capacity;          // the last reported remaining capacity
+  DWORD start_capacity;
+  double energy_mwh;       // discharge energy
+  double peak_mw;          // highest discharge power that was reported
+  unsigned samples;
+  unsigned updates;        // how many times the battery reported new values
+  bool charging;           // a charge rate was reported at some point
+};
+
+double MeterSeconds(const struct energy_meter *m)
+{
+  return (double)(m->last.QuadPart - m->start.QuadPart) /
+         (double)m->freq.QuadPart;
+}
+
+void MeterRead(struct energy_meter *m)
+{
+  SYSTEM_BATTERY_STATE sbs;
+  if(!GetSystemBatteryState(&sbs))
+    return;
+
+  // As described in RateStr(), 0x80000000 is an invalid rate
+  LONG rate = ((DWORD)sbs.Rate != 0x80000000) ? (LONG)sbs.Rate : 0;
+  if(m->samples && (rate != m->rate || sbs.RemainingCapacity != m->capacity))
+    ++m->updates;
+
+  m->rate = rate;
+  m->capacity = sbs.RemainingCapacity;
+  ++m->samples;
+
+  if(rate < 0 && (double)-rate > m->peak_mw)
+    m->peak_mw = -rate;
+  else if(rate > 0)
+    m->charging = true;
+}
+
+void MeterStart(struct energy_meter *m)
+{
+  memset(m, 0, sizeof *m);
+  QueryPerformanceFrequency(&m->freq);
+  QueryPerformanceCounter(&m->start);
+  m->last = m->start;
+  MeterRead(m);
+  m->start_capacity = m->capacity;
+}
+
+/* Add the energy used since the last sample, at the rate that was reported
+   then, and take a new sample. */
+void MeterSample(struct energy_meter *m)
+{
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  double hours = (double)(now.QuadPart - m->last.QuadPart) /
+                 (double)m->freq.QuadPart / 3600;
+  if(m->rate < 0)
+    m->energy_mwh += -m->rate * hours;
+  m->last = now;
+  MeterRead(m);
+}
+
+/* Quote an argument so that CommandLineToArgvW and the CRT parse it back to
+   the same argument. */
+string QuoteCommandLineArg(const string &arg)
+{
+  if(arg.size() && arg.find_first_of(" \t\n\v\"") == string::npos)
+    return arg;
+
+  string quoted = "\"";
+  for(size_t i = 0; ; ++i) {
+    size_t backslashes = 0;
+    for(; i < arg.size() && arg[i] == '\\'; ++i)
+      ++backslashes;
+
+    if(i == arg.size()) {
+      quoted.append(backslashes * 2, '\\');
+      break;
+    }
+    else if(arg[i] == '"') {
+      quoted.append(backslashes * 2 + 1, '\\');
+      quoted += '"';
+    }
+    else {
+      quoted.append(backslashes, '\\');
+      quoted += arg[i];
+    }
+  }
+  quoted += '"';
+  return quoted;
+}
+
+/* Measure the idle drain in mW by sampling for 'seconds'.
+   Return -1 if it couldn't be measured. */
+double MeasureIdlePower(DWORD seconds)
+{
+  struct energy_meter m;
+  MeterStart(&m);
+  while(MeterSeconds(&m) < seconds) {
+    Sleep(MEASURE_INTERVAL_MS);
+    MeterSample(&m);
+  }
+  if(m.charging || !m.energy_mwh)
+    return -1;
+  return m.energy_mwh / (MeterSeconds(&m) / 3600);
+}
+
+/* Run the command and show how much battery energy was used.
+   Return the command's exit code. */
+int Measure(int argc, char *argv[])
+{
+  string cmdline;
+  for(int i = 0; i < argc; ++i)
+    cmdline += (i ? " " : "") + QuoteCommandLineArg(argv[i]);
+
+  double idle_mw = -1;
+  string idle_source;
+  if(measure_idle) {
+    cerr << "battstatus: Measuring idle power for " << measure_idle
+         << " seconds..." << endl;
+    idle_mw = MeasureIdlePower(measure_idle);
+  }
+  else {
+    struct idle_baseline b;
+    if(LoadBaseline(&b)) {
+      idle_mw = b.mean_mw;
+      idle_source = " (--baseline " + TimeToLocalTimeStr(b.when) + ")";
+    }
+  }
+
+  STARTUPINFOA si = { sizeof si, };
+  PROCESS_INFORMATION pi;
+  vector<char> cmdbuf(cmdline.begin(), cmdline.end());
+  cmdbuf.push_back('\0');
+
+  struct energy_meter m;
+  MeterStart(&m);
+
+  if(!CreateProcessA(NULL, &cmdbuf[0], NULL, NULL, TRUE, 0, NULL, NULL,
+                     &si, &pi)) {
+    DWORD gle = GetLastError();
+    cerr << "Error: CreateProcess failed to run \"" << cmdline << "\", "
+         << "error " << gle << "." << endl;
+    return 1;
+  }
+  CloseHandle(pi.hThread);
+
+  // have any running monitor sample at the same rate while the command runs
+  struct lease_client lc = { "--measure", };
+  LeaseSend(&lc, MEASURE_INTERVAL_MS, LEASE_CLIENT_MS);
+  DWORD lease_tick = GetTickCount();
+
+  while(WaitForSingleObject(pi.hProcess, MEASURE_INTERVAL_MS) ==
+        WAIT_TIMEOUT) {
+    MeterSample(&m);
+    if((GetTickCount() - lease_tick) >= (LEASE_CLIENT_MS / 2)) {
+      LeaseSend(&lc, MEASURE_INTERVAL_MS, LEASE_CLIENT_MS);
+      lease_tick = GetTickCount();
+    }
+  }
+  MeterSample(&m);
+  LeaseSend(&lc, MEASURE_INTERVAL_MS, 0);
+
+  DWORD exit_code = 1;
+  GetExitCodeProcess(pi.hProcess, &exit_code);
+  CloseHandle(pi.hProcess);
+
+  double seconds = MeterSeconds(&m);
+  double energy_mwh = m.energy_mwh;
+  bool approximate = false;
+
+  /* The command finished before the battery reported a new rate. Wait for
+     the next report and assume that rate for the whole run. */
+  if(!m.updates) {
+    struct energy_meter settle = m;
+    while(!settle.updates &&
+          MeterSeconds(&settle) < (seconds + MEASURE_SETTLE_MAX_SECONDS)) {
+      Sleep(MEASURE_INTERVAL_MS);
+      MeterSample(&settle);
+    }
+    if(settle.updates && settle.rate < 0) {
+      energy_mwh = -settle.rate * (seconds / 3600);
+      if(-settle.rate > m.peak_mw)
+        m.peak_mw = -settle.rate;
+    }
+    approximate = true;
+  }
+
+  double mean_mw = seconds > 0 ? energy_mwh / (seconds / 3600) : 0;
+
+#define SHOW_MEASURE(name) \
+  cerr << left << setw(BATT_FIELD_WIDTH) << name ": " << right
+
+  cerr << "\nbattstatus --measure: " << cmdline << "\n\n" << std::fixed;
+  SHOW_MEASURE("Exit code") << exit_code << "\n";
+  SHOW_MEASURE("Duration") << setprecision(3) << seconds << " s\n";
+  SHOW_MEASURE("Samples") << m.samples << " (" << m.updates
+                          << " battery updates)\n";
+  SHOW_MEASURE("Energy") << setprecision(2) << energy_mwh << " mWh"
+                         << (approximate ? " (approximate)" : "") << "\n";
+  SHOW_MEASURE("Mean power") << setprecision(0) << mean_mw << " mW\n";
+  SHOW_MEASURE("Peak power") << setprecision(0) << m.peak_mw << " mW\n";
+  if(idle_mw >= 0) {
+    double over_mw = mean_mw - idle_mw;
+    SHOW_MEASURE("Idle baseline") << setprecision(0) << idle_mw << " mW"
+                                  << idle_source << "\n";
+    SHOW_MEASURE("Over baseline") << showpos << setprecision(0) << over_mw
+                                  << " mW (" << setprecision(2)
+                                  << over_mw * (seconds / 3600) << " mWh)"
+                                  << noshowpos << "\n";
+  }
+  if(m.start_capacity != BATTERY_UNKNOWN_CAPACITY &&
+     m.capacity != BATTERY_UNKNOWN_CAPACITY) {
+    SHOW_MEASURE("Capacity change") << showpos
+                                    << ((LONG)m.capacity -
+                                        (LONG)m.start_capacity)
+                                    << noshowpos << " mWh\n";
+  }
+
+  if(m.charging) {
+    cerr << "\nWarning: The battery was charging during the measurement, so "
+            "the energy used can't be measured. Unplug AC power and try "
+            "again.\n";
+  }
+  else if(approximate) {
+    cerr << "\nNote: The command finished before the battery reported a new "
+            "rate, so the first rate reported after it finished was used.\n";
+  }
+  cerr << endl;
+
+  return (int)exit_code;
+}
+
+/* Line format templates (options --line-format and --title-format).
+
+A template is text with placeholders, for example "{percent} {ac} {rate}".
+It's compiled once at startup into a list of instructions, each either a
+literal run of the template text or a placeholder, and each line is rendered
+by running the instructions into a fixed size buffer. There's no parsing and
+no memory allocation per line. Use {{ and }} for literal braces.
+
+{state} is the one-liner in the same format that the battery systray uses
+and is the default template, for example "27 min (15%) remaining".
+*/
+#define LINE_FORMAT_MAX 256
+
+enum lfop {
+  LFOP_LITERAL,
+  LFOP_PERCENT,       // {percent}       15%
+  LFOP_LIFETIME,      // {lifetime}      27 min
+  LFOP_AVG_LIFETIME,  // {avg_lifetime}  31 min
+  LFOP_RATE,          // {rate}          -11433mW
+  LFOP_AC,            // {ac}            Offline
+  LFOP_STATE          // {state}         27 min (15%) remaining
+};
+
+const char *lfop_names[] = {
+  NULL, "percent", "lifetime", "avg_lifetime", "rate", "ac", "state"
+};
+
+struct lfinsn {
+  enum lfop op;
+  size_t offset, len;  // LFOP_LITERAL: the literal text in 'literals'
+};
+
+struct line_format {
+  vector<lfinsn> insns;
+  string literals;
+  string text;  // the template
+};
+
+struct line_format line_format, title_format;
+
+/* The one-liner states, in the order they're checked. */
+enum linestate {
+  LINESTATE_NO_BATTERY,       // No battery is detected
+  LINESTATE_PERCENT,          // 100% remaining
+  LINESTATE_FULLY_CHARGED,    // Fully charged (100%)
+  LINESTATE_PLUGGED_IN,       // 99% available (plugged in, not charging)
+  LINESTATE_LIFETIME          // 27 min (15%) remaining
+};
+
+/* The values that a line is rendered from. */
+struct line_values {
+  const SYSTEM_POWER_STATUS *status;
+  DWORD average_lifetime;  // LIFETIME_UNKNOWN if not averaging
+  LONG rate;               // GetBatteryPowerRate
+  enum linestate state;
+};
+
+/* Compile a template. Return false if it has an unknown placeholder or an
+   unmatched brace. */
+bool CompileLineFormat(const char *text, struct line_format *lf)
+{
+  lf->insns.clear();
+  lf->literals.clear();
+  lf->text = text;
+
+  for(const char *p = text; *p; ) {
+    if((*p == '{' && p[1] == '{') || (*p == '}' && p[1] == '}') ||
+       (*p != '{' && *p != '}')) {
+      // extend the previous literal if it ends where this one starts
+      if(lf->insns.empty() || lf->insns.back().op != LFOP_LITERAL) {
+        lfinsn insn = { LFOP_LITERAL, lf->literals.size(), 0 };
+        lf->insns.push_back(insn);
+      }
+      lf->literals += *p;
+      ++lf->insns.back().len;
+      p += (*p == '{' || *p == '}') ? 2 : 1;
+      continue;
+    }
+
+    const char *end = strchr(p, '}');
+    if(*p == '}' || !end)
+      return false;
+
+    string name(p + 1, end - (p + 1));
+    size_t op;
+    for(op = LFOP_PERCENT; op <= LFOP_STATE; ++op) {
+      if(name == lfop_names[op])
+        break;
+    }
+    if(op > LFOP_STATE)
+      return false;
+
+    lfinsn insn = { (enum lfop)op, 0, 0 };
+    lf->insns.push_back(insn);
+    p = end + 1;
+  }
+  return true;
+}
+
+/* A fixed size output buffer. Output that doesn't fit is truncated. */
+struct fixed_buf {
+  char *p;
+  size_t len, size;
+};
+
+void FbAppend(struct fixed_buf *fb, const char *s, size_t n)
+{
+  if(n > (fb->size - 1 - fb->len))
+    n = fb->size - 1 - fb->len;
+  memcpy(fb->p + fb->len, s, n);
+  fb->len += n;
+  fb->p[fb->len] = '\0';
+}
+
+void FbAppendStr(struct fixed_buf *fb, const char *s)
+{
+  FbAppend(fb, s, strlen(s));
+}
+
+/* Append an unsigned number, zero padded to at least 'width' digits. */
+void FbAppendUnsigned(struct fixed_buf *fb, DWORD n, int width = 1)
+{
+  char digits[16];
+  int i = sizeof digits;
+  do {
+    digits[--i] = (char)('0' + (n % 10));
+    n /= 10;
+  } while(n || (int)(sizeof digits - i) < width);
+  FbAppend(fb, digits + i, sizeof digits - i);
+}
+
+/* Same format as BatteryLifePercentStr */
+void FbAppendPercent(struct fixed_buf *fb, DWORD percent)
+{
+  if(percent <= 100) {
+    FbAppendUnsigned(fb, percent);
+    FbAppendStr(fb, "%");
+  }
+  else if(percent == PERCENT_UNKNOWN)
+    FbAppendStr(fb, "Unknown status");
+  else
+    FbAppendStr(fb, BatteryLifePercentStr(percent).c_str());
+}
+
+/* Same format as BatteryLifeTimeStr */
+void FbAppendLifetime(struct fixed_buf *fb, DWORD seconds)
+{
+  if(seconds == LIFETIME_UNKNOWN) {
+    FbAppendStr(fb, "Unknown");
+    return;
+  }
+
+  DWORD hours = seconds / 3600;
+  DWORD minutes = (seconds % 3600) / 60;
+
+  if(hours) {
+    FbAppendUnsigned(fb, hours);
+    FbAppendStr(fb, " hr ");
+  }
+  FbAppendUnsigned(fb, minutes, hours ? 2 : 1);
+  FbAppendStr(fb, " min");
+}
+
+/* Like RateStr, for a rate in mW from GetBatteryPowerRate */
+void FbAppendRate(struct fixed_buf *fb, LONG rate)
+{
+  if(!rate) {
+    FbAppendStr(fb, "Unknown");
+    return;
+  }
+  FbAppendStr(fb, rate < 0 ? "-" : "+");
+  FbAppendUnsigned(fb, rate < 0 ? (DWORD)0 - (DWORD)rate : (DWORD)rate);
+  FbAppendStr(fb, "mW");
+}
+
+/* Determine which one-liner to show, in the same formats that the battery
+   systray uses. */
+enum linestate LineState(const SYSTEM_POWER_STATUS *status, LONG rate)
+{
+  if(NO_BATTERY(*status))
+    return LINESTATE_NO_BATTERY;
+  else if(suppress_charge_state)
+    return LINESTATE_PERCENT;
+  else if(status->BatteryLifePercent == 100 &&
+          (suppress_lifetime ||
+           status->BatteryLifeTime == LIFETIME_UNKNOWN) &&
+          PLUGGED_IN(*status) &&
+          !CHARGING(*status) &&
+          !rate)
+    return LINESTATE_FULLY_CHARGED;
+  else if(CHARGING(*status) || PLUGGED_IN(*status))
+    return LINESTATE_PLUGGED_IN;
+  else if(!suppress_lifetime &&
+          status->BatteryLifeTime != LIFETIME_UNKNOWN)
+    return LINESTATE_LIFETIME;
+  return LINESTATE_PERCENT;
+}
+
+void FbAppendState(struct fixed_buf *fb, const struct line_values *lv)
+{
+  const SYSTEM_POWER_STATUS *status = lv->status;
+
+  switch(lv->state) {
+  case LINESTATE_NO_BATTERY:
+    // eg: No battery is detected
+    FbAppendStr(fb, "No battery is detected");
+    break;
+  case LINESTATE_FULLY_CHARGED:
+    // eg: Fully charged (100%)
+    FbAppendStr(fb, "Fully charged (");
+    FbAppendPercent(fb, 100);
+    FbAppendStr(fb, ")");
+    break;
+  case LINESTATE_PLUGGED_IN:
+    // eg: 100% available (plugged in, charging)
+    // eg: 99% available (plugged in, not charging)
+    FbAppendPercent(fb, status->BatteryLifePercent);
+    FbAppendStr(fb, lv->rate < 0 ? " remaining (" : " available (");
+    FbAppendStr(fb, PLUGGED_IN(*status) ? "" : "not ");
+    FbAppendStr(fb, "plugged in, ");
+    FbAppendStr(fb, CHARGING(*status) ? "" : "not ");
+    FbAppendStr(fb, "charging)");
+    break;
+  case LINESTATE_LIFETIME:
+    // eg: 27 min (15%) remaining
+    FbAppendLifetime(fb, lv->average_lifetime != LIFETIME_UNKNOWN ?
+                         lv->average_lifetime : status->BatteryLifeTime);
+    FbAppendStr(fb, " (");
+    FbAppendPercent(fb, status->BatteryLifePercent);
+    FbAppendStr(fb, ") remaining");
+    break;
+  case LINESTATE_PERCENT:
+  default:
+    // eg: 100% remaining
+    FbAppendPercent(fb, status->BatteryLifePercent);
+    FbAppendStr(fb, " remaining");
+    break;
+  }
+}
+
+/* Render a compiled template into 'buf' and return buf. */
+const char *RenderLineFormat(const struct line_format *lf,
+                             const struct line_values *lv,
+                             char *buf, size_t size)
+{
+  struct fixed_buf fb = { buf, 0, size };
+  buf[0] = '\0';
+
+  for(size_t i = 0; i < lf->insns.size(); ++i) {
+    const lfinsn &insn = lf->insns[i];
+    switch(insn.op) {
+    case LFOP_LITERAL:
+      FbAppend(&fb, lf->literals.data() + insn.offset, insn.len);
+      break;
+    case LFOP_PERCENT:
+      FbAppendPercent(&fb, lv->status->BatteryLifePercent);
+      break;
+    case LFOP_LIFETIME:
+      FbAppendLifetime(&fb, lv->status->BatteryLifeTime);
+      break;
+    case LFOP_AVG_LIFETIME:
+      FbAppendLifetime(&fb, lv->average_lifetime);
+      break;
+    case LFOP_RATE:
+      FbAppendRate(&fb, lv->rate);
+      break;
+    case LFOP_AC:
+      FbAppendStr(&fb, lv->status->ACLineStatus == 0 ? "Offline" :
+                       lv->status->ACLineStatus == 1 ? "Online" :
+                       "Unknown status");
+      break;
+    case LFOP_STATE:
+      FbAppendState(&fb, lv);
+      break;
+    }
+  }
+  return buf;
+}
+
+/* MQTT publisher (option --mqtt).
+
+The publisher keeps one persistent MQTT 3.1.1 connection to a broker and
+publishes the current state of each power status field as a retained message
+at topic <prefix>/<field>. A field is queued for publishing only when its value
+differs from the last value queued for it, and a field that changes again
+before it could be sent just replaces the queued value, so a slow or absent
+broker never causes a backlog. Publishes are QoS 1 and are pipelined up to
+MQTT_INFLIGHT_MAX unacknowledged messages. A critical alert is queued in the
+urgent lane instead, which is published first and isn't limited by the window.
+
+All socket I/O is non-blocking and is done by MqttService, which the reactor
+calls as soon as the socket is ready and the main loop calls once per poll.
+The broker address is resolved once at startup so that a reconnect never waits
+on name resolution. When the connection is lost the publisher waits an
+increasing amount of time before reconnecting, and once connected again it
+republishes every field since the session is clean.
+
+http://docs.oasis-open.org/mqtt/mqtt/v3.1.1/mqtt-v3.1.1.html
+*/
+#define MQTT_DEFAULT_PORT "1883"
+#define MQTT_KEEPALIVE_SECONDS 60
+#define MQTT_INFLIGHT_MAX 16
+#define MQTT_ACK_TIMEOUT_SECONDS 30
+#define MQTT_RETRY_MAX_SECONDS 60
+
+enum mqttstate {
+  MQTT_DISCONNECTED,
+  MQTT_CONNECTING,    // waiting for the TCP connection to complete
+  MQTT_CONNACK_WAIT,  // CONNECT was sent, waiting for CONNACK
+  MQTT_CONNECTED
+};
+
+struct mqtt_inflight {
+  unsigned short packet_id;
+  DWORD tick;  // when the PUBLISH was queued for sending
+  string field;
+  LONGLONG critical_start;  // 0 if not a critical alert
+};
+
+struct mqtt_client {
+  enum mqttstate state;
+  SOCKET sock;
+  WSAEVENT event;  // the socket's network events, for the reactor
+  struct sockaddr_storage addr;
+  int addrlen;
+  string client_id;
+  string topic_prefix;
+  string inbuf;   // received bytes that are not yet a complete packet
+  string outbuf;  // packets that are not yet completely sent
+  unsigned short next_packet_id;
+  DWORD retry_tick;     // when to try connecting again
+  DWORD retry_seconds;  // how long to wait after the next failure
+  DWORD send_tick;      // when something was last sent, for keep alive
+  DWORD recv_tick;      // when something was last received
+  deque<mqtt_inflight> inflight;  // QoS 1 publishes waiting for PUBACK
+  map<string, string> current;    // field -> latest value
+  map<string, string> pending;    // field -> value waiting to be published
+  map<string, string> urgent;     // critical alerts, published first
+  LONGLONG urgent_start;          // when the urgent fields were queued
+};
+
+struct mqtt_client mqtt;
+
+void MqttAppendString(string &buf, const string &s)
+{
+  buf += (char)((s.size() >> 8) & 0xFF);
+  buf += (char)(s.size() & 0xFF);
+  buf += s;
+}
+
+/* Append a packet with fixed header byte 'type' and variable header plus
+   payload 'body' to the output buffer. */
+void MqttQueuePacket(BYTE type, const string &body)
+{
+  size_t len = body.size();
+
+  mqtt.outbuf += (char)type;
+  do {
+    BYTE digit = (BYTE)(len % 128);
+    len /= 128;
+    if(len)
+      digit |= 0x80;
+    mqtt.outbuf += (char)digit;
+  } while(len);
+  mqtt.outbuf += body;
+}
+
+void MqttDisconnect(const char *reason)
+{
+  if(mqtt.sock != INVALID_SOCKET) {
+    closesocket(mqtt.sock);
+    mqtt.sock = INVALID_SOCKET;
+  }
+
+  if(mqtt.state == MQTT_CONNECTED || verbose) {
+    cout << TIMESTAMPED_PREFIX << "MQTT: " << reason << ", reconnecting in "
+         << mqtt.retry_seconds << " seconds." << endl;
+  }
+
+  mqtt.state = MQTT_DISCONNECTED;
+  mqtt.inbuf.clear();
+  mqtt.outbuf.clear();
+  mqtt.inflight.clear();
+  mqtt.retry_tick = GetTickCount() + (mqtt.retry_seconds * 1000);
+  mqtt.retry_seconds *= 2;
+  if(mqtt.retry_seconds > MQTT_RETRY_MAX_SECONDS)
+    mqtt.retry_seconds = MQTT_RETRY_MAX_SECONDS;
+}
+
+/* Set the latest value of a field. It's published only if it changed. If
+   'critical_start' is not 0 then it's a critical alert raised then and it's
+   published in the urgent lane. */
+void MqttUpdateField(const char *field, const string &value,
+                     LONGLONG critical_start = 0)
+{
+  map<string, string>::iterator it = mqtt.current.find(field);
+  if(it != mqtt.current.end() && it->second == value)
+    return;
+  mqtt.current[field] = value;
+  if(critical_start) {
+    mqtt.urgent[field] = value;
+    mqtt.urgent_start = critical_start;
+    mqtt.pending.erase(field);
+  }
+  else if(!mqtt.urgent.count(field))
+    mqtt.pending[field] = value;
+  else
+    mqtt.urgent[field] = value;
+}
+
+void MqttUpdatePowerStatus(const SYSTEM_POWER_STATUS *status)
+{
+  stringstream ss;
+
+  MqttUpdateField("ac", status->ACLineStatus == 0 ? "offline" :
+                        status->ACLineStatus == 1 ? "online" : "unknown");
+  MqttUpdateField("charging", CHARGING(*status) ? "true" : "false");
+  MqttUpdateField("no_battery", NO_BATTERY(*status) ? "true" : "false");
+
+  if(status->BatteryLifePercent <= 100)
+    ss << (unsigned)status->BatteryLifePercent;
+  else
+    ss << "unknown";
+  MqttUpdateField("percent", ss.str());
+
+#define MQTT_SECONDS_FIELD(field, seconds) \
+  ss.str(""); \
+  if((seconds) == LIFETIME_UNKNOWN) \
+    ss << "unknown"; \
+  else \
+    ss << (seconds); \
+  MqttUpdateField(field, ss.str());
+
+  MQTT_SECONDS_FIELD("lifetime", status->BatteryLifeTime);
+  MQTT_SECONDS_FIELD("full_lifetime", status->BatteryFullLifeTime);
+
+  ss.str("");
+  ss << GetBatteryPowerRate();
+  MqttUpdateField("rate_mw", ss.str());
+
+  if(os.dwMajorVersion >= 10)
+    MqttUpdateField("battery_saver", BATTSAVER(*status) ? "true" : "false");
+}
+
+/* Process a complete packet received from the broker. */
+void MqttProcessPacket(BYTE type, const string &body)
+{
+  switch(type >> 4) {
+  case 2: // CONNACK
+    if(mqtt.state != MQTT_CONNACK_WAIT || body.size() < 2) {
+      MqttDisconnect("Unexpected CONNACK");
+      return;
+    }
+    if(body[1]) {
+      stringstream ss;
+      ss << "Broker refused connection, return code "
+         << (unsigned)(BYTE)body[1];
+      MqttDisconnect(ss.str().c_str());
+      return;
+    }
+    mqtt.state = MQTT_CONNECTED;
+    mqtt.retry_seconds = 1;
+    mqtt.pending = mqtt.current;
+    for(map<string, string>::iterator it = mqtt.urgent.begin();
+        it != mqtt.urgent.end(); ++it)
+      mqtt.pending.erase(it->first);
+    if(verbose) {
+      cout << TIMESTAMPED_PREFIX << "MQTT: Connected, publishing to "
+           << mqtt.topic_prefix << "/#" << endl;
+    }
+    break;
+  case 4: // PUBACK
+    if(body.size() >= 2) {
+      unsigned short id = (unsigned short)(((BYTE)body[0] << 8) |
+                                           (BYTE)body[1]);
+      for(deque<mqtt_inflight>::iterator it = mqtt.inflight.begin();
+          it != mqtt.inflight.end(); ++it) {
+        if(it->packet_id == id) {
+          if(it->critical_start)
+            CriticalDelivered(CRITSINK_MQTT, it->critical_start);
+          mqtt.inflight.erase(it);
+          break;
+        }
+      }
+    }
+    break;
+  case 13: // PINGRESP
+  default:
+    break;
+  }
+}
+
+/* Do all pending MQTT work without blocking. */
+void MqttService()
+{
+  DWORD now = GetTickCount();
+
+  if(mqtt.state == MQTT_DISCONNECTED) {
+    if((LONG)(now - mqtt.retry_tick) < 0)
+      return;
+
+    mqtt.sock = socket(mqtt.addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if(mqtt.sock == INVALID_SOCKET) {
+      MqttDisconnect("socket() failed");
+      return;
+    }
+
+    u_long nonblocking = 1;
+    int nodelay = 1;
+    ioctlsocket(mqtt.sock, FIONBIO, &nonblocking);
+    setsockopt(mqtt.sock, IPPROTO_TCP, TCP_NODELAY,
+               (const char *)&nodelay, sizeof nodelay);
+    WSAEventSelect(mqtt.sock, mqtt.event,
+                   FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE);
+
+    if(connect(mqtt.sock, (struct sockaddr *)&mqtt.addr, mqtt.addrlen) &&
+       WSAGetLastError() != WSAEWOULDBLOCK) {
+      MqttDisconnect("connect() failed");
+      return;
+    }
+    mqtt.state = MQTT_CONNECTING;
+    mqtt.send_tick = mqtt.recv_tick = now;
+  }
+
+  if(mqtt.state == MQTT_CONNECTING) {
+    fd_set wfds, efds;
+    struct timeval tv = { 0, 0 };
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    FD_SET(mqtt.sock, &wfds);
+    FD_SET(mqtt.sock, &efds);
+    if(select(0, NULL, &wfds, &efds, &tv) == SOCKET_ERROR ||
+       FD_ISSET(mqtt.sock, &efds)) {
+      MqttDisconnect("Failed to connect to broker");
+      return;
+    }
+    if(!FD_ISSET(mqtt.sock, &wfds)) {
+      if((now - mqtt.recv_tick) >= (MQTT_ACK_TIMEOUT_SECONDS * 1000))
+        MqttDisconnect("Timed out connecting to broker");
+      return;
+    }
+
+    string body;
+    MqttAppendString(body, "MQTT");
+    body += (char)4;     // protocol level 3.1.1
+    body += (char)0x2E;  // clean session, will flag, will QoS 1, will retain
+    body += (char)(MQTT_KEEPALIVE_SECONDS >> 8);
+    body += (char)(MQTT_KEEPALIVE_SECONDS & 0xFF);
+    MqttAppendString(body, mqtt.client_id);
+    MqttAppendString(body, mqtt.topic_prefix + "/online");
+    MqttAppendString(body, "false");
+    MqttQueuePacket(0x10, body);
+    mqtt.state = MQTT_CONNACK_WAIT;
+  }
+
+  // receive
+  for(;;) {
+    char buf[512];
+    int n = recv(mqtt.sock, buf, sizeof buf, 0);
+    if(n == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+      break;
+    if(n <= 0) {
+      MqttDisconnect("Connection closed by broker");
+      return;
+    }
+    mqtt.inbuf.append(buf, n);
+    mqtt.recv_tick = now;
+  }
+
+  // parse received packets
+  while(mqtt.inbuf.size() >= 2) {
+    size_t len = 0, pos = 1;
+    unsigned multiplier = 1;
+    for(;; ++pos, multiplier *= 128) {
+      if(pos >= mqtt.inbuf.size() || pos > 4)
+        break;
+      len += ((BYTE)mqtt.inbuf[pos] & 0x7F) * multiplier;
+      if(!((BYTE)mqtt.inbuf[pos] & 0x80))
+        break;
+    }
+    if(pos > 4) {
+      MqttDisconnect("Malformed packet from broker");
+      return;
+    }
+    if(pos >= mqtt.inbuf.size() || mqtt.inbuf.size() < pos + 1 + len)
+      break;  // incomplete
+
+    BYTE type = (BYTE)mqtt.inbuf[0];
+    string body = mqtt.inbuf.substr(pos + 1, len);
+    mqtt.inbuf.erase(0, pos + 1 + len);
+    MqttProcessPacket(type, body);
+    if(mqtt.state == MQTT_DISCONNECTED)
+      return;
+  }
+
+  if(mqtt.state == MQTT_CONNACK_WAIT &&
+     (now - mqtt.send_tick) >= (MQTT_ACK_TIMEOUT_SECONDS * 1000)) {
+    MqttDisconnect("Timed out waiting for CONNACK");
+    return;
+  }
+
+  if(mqtt.state == MQTT_CONNECTED) {
+    if(mqtt.inflight.size() &&
+       (now - mqtt.inflight.front().tick) >=
+       (MQTT_ACK_TIMEOUT_SECONDS * 1000)) {
+      MqttDisconnect("Timed out waiting for PUBACK");
+      return;
+    }
+
+    if((now - mqtt.recv_tick) >= (MQTT_KEEPALIVE_SECONDS * 1500)) {
+      MqttDisconnect("Broker is not responding");
+      return;
+    }
+
+    /* publish the urgent fields, then fill the in-flight window with the
+       pending publishes */
+    while(mqtt.urgent.size() ||
+          (mqtt.pending.size() && mqtt.inflight.size() < MQTT_INFLIGHT_MAX)) {
+      bool urgent = !mqtt.urgent.empty();
+      map<string, string> &lane = urgent ? mqtt.urgent : mqtt.pending;
+      map<string, string>::iterator it = lane.begin();
+      mqtt_inflight pub;
+      pub.packet_id = mqtt.next_packet_id++;
+      if(!mqtt.next_packet_id)
+        mqtt.next_packet_id = 1;  // packet id 0 is not allowed
+      pub.tick = now;
+      pub.field = it->first;
+      pub.critical_start = urgent ? mqtt.urgent_start : 0;
+
+      string body;
+      MqttAppendString(body, mqtt.topic_prefix + "/" + it->first);
+      body += (char)(pub.packet_id >> 8);
+      body += (char)(pub.packet_id & 0xFF);
+      body += it->second;
+      MqttQueuePacket(0x33, body);  // PUBLISH, QoS 1, retain
+
+      mqtt.inflight.push_back(pub);
+      lane.erase(it);
+    }
+
+    if(mqtt.outbuf.empty() &&
+       (now - mqtt.send_tick) >= (MQTT_KEEPALIVE_SECONDS * 500))
+      MqttQueuePacket(0xC0, "");  // PINGREQ
+  }
+
+  // send
+  if(mqtt.outbuf.size()) {
+    int n = send(mqtt.sock, mqtt.outbuf.data(), (int)mqtt.outbuf.size(), 0);
+    if(n == SOCKET_ERROR) {
+      if(WSAGetLastError() != WSAEWOULDBLOCK)
+        MqttDisconnect("Failed to send to broker");
+      return;
+    }
+    mqtt.outbuf.erase(0, n);
+    mqtt.send_tick = now;
+  }
+}
+
+/* Reactor callback for the socket's network events. */
+void MqttReady(void *)
+{
+  WSANETWORKEVENTS ne;
+  if(mqtt.sock == INVALID_SOCKET ||
+     WSAEnumNetworkEvents(mqtt.sock, mqtt.event, &ne))
+    WSAResetEvent(mqtt.event);
+  MqttService();
+}
+
+/* Parse <host>[:<port>] and resolve it, starting Winsock if necessary.
+   'what' is what the host is, for the error message. Return false and show
+   an error if that fails. */
+bool ResolveHostPort(const char *spec, const char *default_port,
+                     const char *what, struct sockaddr_storage *addr,
+                     int *addrlen)
+{
+  string host = spec, port = default_port;
+  string::size_type colon = host.rfind(':');
+
+  // brackets are needed for an IPv6 address with a port: [::1]:1883
+  if(colon != string::npos &&
+     (host.find(':') == colon || host[colon - 1] == ']')) {
+    port = host.substr(colon + 1);
+    host.erase(colon);
+  }
+  if(host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']')
+    host = host.substr(1, host.size() - 2);
+
+  WSADATA wsadata;
+  int rc = WSAStartup(MAKEWORD(2, 2), &wsadata);
+  if(rc) {
+    cerr << "Error: WSAStartup failed, error " << rc << "." << endl;
+    return false;
+  }
+
+  struct addrinfo hints = { 0, }, *res = NULL;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+  if(rc || !res || res->ai_addrlen > sizeof *addr) {
+    cerr << "Error: Failed to resolve " << what << " \"" << spec << "\", "
+         << "error " << rc << "." << endl;
+    if(res)
+      freeaddrinfo(res);
+    return false;
+  }
+  memcpy(addr, res->ai_addr, res->ai_addrlen);
+  *addrlen = (int)res->ai_addrlen;
+  freeaddrinfo(res);
+  return true;
+}
+
+/* Parse --mqtt <host>[:<port>] and resolve the broker address.
+   Return false and show an error if that fails. */
+bool MqttInit(const char *broker)
+{
+  if(!ResolveHostPort(broker, MQTT_DEFAULT_PORT, "MQTT broker", &mqtt.addr,
+                      &mqtt.addrlen))
+    return false;
+
+  char computer[MAX_COMPUTERNAME_LENGTH + 1];
+  DWORD size = sizeof computer;
+  if(!GetComputerNameA(computer, &size))
+    strcpy(computer, "unknown");
+
+  stringstream ss;
+  ss << "battstatus-" << computer << "-" << GetCurrentProcessId();
+  mqtt.client_id = ss.str();
+  mqtt.topic_prefix = mqtt_topic ? mqtt_topic :
+                      string("battstatus/") + computer;
+  mqtt.event = WSACreateEvent();
+  if(mqtt.event == WSA_INVALID_EVENT ||
+     !ReactorAdd("mqtt", mqtt.event, MqttReady, NULL)) {
+    cerr << "Error: Failed to create the MQTT socket event." << endl;
+    return false;
+  }
+  mqtt.sock = INVALID_SOCKET;
+  mqtt.state = MQTT_DISCONNECTED;
+  mqtt.retry_tick = GetTickCount();
+  mqtt.retry_seconds = 1;
+  mqtt.next_packet_id = 1;
+
+  /* "online" is true while connected. The broker sets it false (the will
+     message) if the connection is lost without a DISCONNECT. */
+  mqtt.current["online"] = "true";
+  return true;
+}
+
+/* Telemetry channels (option --telemetry).
+
+Per battery readings that the combined power status doesn't have. Each
+channel has its own sampling period (--telemetry-period) so that slow ones
+like the cycle count cost next to nothing while current can be sampled every
+second or faster:
+
+voltage       BATTERY_STATUS Voltage, in mV
+current       BATTERY_STATUS Rate / Voltage, in mA (negative: discharging)
+temperature   BatteryTemperature, in degrees Celsius
+cycle_count   BATTERY_INFORMATION CycleCount
+health        full charged capacity vs design capacity, in percent
+
+The channels due on a tick are read together in one batch. The battery
+interfaces are enumerated once and kept open, and a batch makes one
+IOCTL_BATTERY_QUERY_STATUS per battery for both voltage and current, and one
+IOCTL_BATTERY_QUERY_INFORMATION per battery per information level. If a
+battery's tag changes or it goes away then the interfaces are enumerated
+again, at most every TELEMETRY_ENUM_RETRY_MS.
+
+In verbose mode -vv the readings are shown as they change, and with --mqtt
+they're published as <prefix>/battery<slot>/<field>.
+*/
+#define TELEMETRY_ENUM_RETRY_MS 10000
+
+enum telemetry_id {
+  TELEMETRY_VOLTAGE,
+  TELEMETRY_CURRENT,
+  TELEMETRY_TEMPERATURE,
+  TELEMETRY_CYCLE_COUNT,
+  TELEMETRY_HEALTH,
+  TELEMETRY_COUNT
+};
+
+const char *telemetry_names[TELEMETRY_COUNT] = {
+  "voltage", "current", "temperature", "cycle_count", "health"
+};
+
+// the MQTT fields and the units shown
+const char *telemetry_fields[TELEMETRY_COUNT] = {
+  "voltage_mv", "current_ma", "temperature_c", "cycle_count", "health_percent"
+};
+const char *telemetry_units[TELEMETRY_COUNT] = {
+  " mV", " mA", " C", "", "%"
+};
+
+struct telemetry_channel {
+  DWORD period_ms;  // 0: disabled
+  DWORD due_tick;
+  unsigned long reads;  // completed, of at least one battery
+};
+
+struct telemetry_battery {
+  unsigned slot;
+  HANDLE handle;
+  ULONG tag;
+  string unique_id;
+  DWORD status_tick;   // when voltage and current were read
+  ULONG voltage_mv;    // BATTERY_UNKNOWN_VOLTAGE if unknown
+  LONG rate_mw;        // BATTERY_UNKNOWN_RATE if unknown
+  ULONG temperature;   // in tenths of a degree Kelvin, 0 if unknown
+  ULONG cycle_count;   // 0 if unknown
+  double health;       // 0 if unknown
+  string shown[TELEMETRY_COUNT];  // the readings that were last shown
+  // internal resistance, see ResistanceUpdate
+  deque<double> resistance_mohm;  // the most recent estimates
+  unsigned long resistance_steps; // load steps seen, including earlier runs
+  double resistance_median;       // 0 if unknown
+  bool resistance_dirty;          // not saved yet
+  DWORD resistance_save_tick;
+};
+
+struct telemetry_state {
+  struct telemetry_channel channel[TELEMETRY_COUNT];
+  vector<telemetry_battery> batteries;
+  bool stale;           // enumerate the battery interfaces again
+  DWORD enum_tick;
+  unsigned long batches;
+  unsigned long calls;  // DeviceIoControl calls
+  unsigned long load_steps;
+} telem = {
+  { { 1000, }, { 1000, }, { 30 * 1000, }, { 60 * 60 * 1000, },
+    { 60 * 60 * 1000, } },
+};
+
+/* --telemetry-period <channel>=<period>,... */
+bool ParseTelemetryPeriod(const char *value)
+{
+  vector<pair<string, string> > pairs;
+  if(!ParseNameValueList(value, &pairs))
+    return false;
+
+  for(size_t i = 0; i < pairs.size(); ++i) {
+    int id;
+    for(id = 0; id < TELEMETRY_COUNT; ++id) {
+      if(pairs[i].first == telemetry_names[id])
+        break;
+    }
+    if(id == TELEMETRY_COUNT ||
+       !ParseDurationMs(pairs[i].second.c_str(), &telem.channel[id].period_ms))
+      return false;
+  }
+  return true;
+}
+
+/* Return the current in mA, or false if it's unknown. */
+bool TelemetryCurrent(const struct telemetry_battery *b, LONG *current_ma)
+{
+  if(!b->voltage_mv || b->voltage_mv == BATTERY_UNKNOWN_VOLTAGE ||
+     (DWORD)b->rate_mw == BATTERY_UNKNOWN_RATE)
+    return false;
+  *current_ma = (LONG)(((LONGLONG)b->rate_mw * 1000) / (LONG)b->voltage_mv);
+  return true;
+}
+
+/* Internal resistance estimation.
+
+Health as full charged capacity vs design capacity misses packs that still
+hold plenty of charge but sag under load and shut down. That shows up as
+internal resistance: when the load steps the voltage moves with the current
+by R = dV / dI. Consecutive voltage and current samples are compared and a
+step in current of at least RESISTANCE_MIN_STEP_MA within
+RESISTANCE_MAX_STEP_MS (short enough that the open circuit voltage hasn't
+moved) gives one estimate. Only discharge is used since while charging the
+charger regulates the voltage.
+
+Single estimates are noisy so the median of the last RESISTANCE_HISTORY
+estimates is used, which ignores the odd outlier from a step that coincided
+with something else. The estimates are saved per battery unique id in state
+file resistance.txt every RESISTANCE_SAVE_MINUTES and on exit, and loaded
+again when the battery is seen, so the median keeps improving across runs.
+
+The cost is a few comparisons per sample, and a median of at most
+RESISTANCE_HISTORY values per load step.
+*/
+#define RESISTANCE_STATE_FILE "resistance.txt"
+#define RESISTANCE_HISTORY 64
+#define RESISTANCE_MIN_STEP_MA 200
+#define RESISTANCE_MAX_STEP_MS 3000
+#define RESISTANCE_MAX_MOHM 2000
+#define RESISTANCE_SAVE_MINUTES 10
+
+double ResistanceMedian(const deque<double> &estimates)
+{
+  if(estimates.empty())
+    return 0;
+  vector<double> v(estimates.begin(), estimates.end());
+  nth_element(v.begin(), v.begin() + (v.size() / 2), v.end());
+  return v[v.size() / 2];
+}
+
+/* The state record is: <steps> <estimate> <estimate> ... */
+void LoadResistance(struct telemetry_battery *b)
+{
+  string value;
+  if(b->unique_id.empty() ||
+     !LoadStateRecord(RESISTANCE_STATE_FILE, StateKeyStr(b->unique_id),
+                      &value))
+    return;
+
+  stringstream ss(value);
+  double mohm;
+  ss >> b->resistance_steps;
+  while(ss >> mohm && b->resistance_mohm.size() < RESISTANCE_HISTORY)
+    b->resistance_mohm.push_back(mohm);
+  b->resistance_median = ResistanceMedian(b->resistance_mohm);
+}
+
+void SaveResistance(struct telemetry_battery *b)
+{
+  if(!b->resistance_dirty || b->unique_id.empty())
+    return;
+
+  stringstream ss;
+  ss << b->resistance_steps << fixed << setprecision(1);
+  for(size_t i = 0; i < b->resistance_mohm.size(); ++i)
+    ss << " " << b->resistance_mohm[i];
+  if(SaveStateRecord(RESISTANCE_STATE_FILE, StateKeyStr(b->unique_id),
+                     ss.str()))
+    b->resistance_dirty = false;
+  b->resistance_save_tick = GetTickCount();
+}
+
+/* Compare a new voltage and current sample with the previous one. */
+void ResistanceUpdate(struct telemetry_battery *b, ULONG prev_voltage_mv,
+                      LONG prev_current_ma, DWORD prev_tick)
+{
+  LONG current_ma;
+  if(prev_voltage_mv == BATTERY_UNKNOWN_VOLTAGE || !prev_voltage_mv ||
+     !TelemetryCurrent(b, &current_ma) ||
+     (b->status_tick - prev_tick) > RESISTANCE_MAX_STEP_MS ||
+     current_ma >= 0 || prev_current_ma >= 0)
+    return;
+
+  LONG di = current_ma - prev_current_ma;
+  if(di > -RESISTANCE_MIN_STEP_MA && di < RESISTANCE_MIN_STEP_MA)
+    return;
+
+  // mV / mA is ohms
+  double mohm = 1000 * (((double)b->voltage_mv - (double)prev_voltage_mv) /
+                        di);
+  if(mohm <= 0 || mohm > RESISTANCE_MAX_MOHM)
+    return;
+
+  ++telem.load_steps;
+  ++b->resistance_steps;
+  b->resistance_mohm.push_back(mohm);
+  if(b->resistance_mohm.size() > RESISTANCE_HISTORY)
+    b->resistance_mohm.pop_front();
+  b->resistance_dirty = true;
+
+  double median = ResistanceMedian(b->resistance_mohm);
+  bool changed = ((LONG)(median + 0.5) != (LONG)(b->resistance_median + 0.5));
+  b->resistance_median = median;
+
+  if(changed && verbose >= 2) {
+    cout << TIMESTAMPED_PREFIX << "Battery #" << b->slot << " internal "
+         << "resistance: " << fixed << setprecision(0) << median << " mOhm ("
+         << b->resistance_mohm.size() << " of " << b->resistance_steps
+         << " load steps)" << endl;
+  }
+
+  if(changed && mqtt_broker) {
+    stringstream field, value;
+    field << "battery" << b->slot << "/resistance_mohm";
+    value << fixed << setprecision(0) << median;
+    MqttUpdateField(field.str().c_str(), value.str());
+  }
+
+  if((GetTickCount() - b->resistance_save_tick) >=
+     (RESISTANCE_SAVE_MINUTES * 60 * 1000))
+    SaveResistance(b);
+}
+
+/* Keep an open handle to each battery that's present.
+   Pass a pointer to an _empty_ vector<telemetry_battery> as cbdata. */
+BOOL CALLBACK TelemetryEnumProc(const struct device *device, void *cbdata)
+{
+  DWORD bytes_written;
+  ULONG wait = 0, tag;
+
+  if(!device->path || device->handle == INVALID_HANDLE_VALUE)
+    return TRUE;
+
+  if(!DeviceIoControl(device->handle, IOCTL_BATTERY_QUERY_TAG,
+                      &wait, sizeof(wait), &tag, sizeof(tag),
+                      &bytes_written, NULL) || tag == BATTERY_TAG_INVALID)
+    return TRUE;
+
+  // the device handle is closed after this returns so open another
+  HANDLE handle = CreateFileW(device->path,
+                              GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE,
+                              NULL,
+                              OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL,
+                              NULL);
+  if(handle == INVALID_HANDLE_VALUE)
+    return TRUE;
+
+  struct telemetry_battery b = telemetry_battery();
+  b.slot = device->slot;
+  b.handle = handle;
+  b.tag = tag;
+  b.voltage_mv = BATTERY_UNKNOWN_VOLTAGE;
+  b.rate_mw = (LONG)BATTERY_UNKNOWN_RATE;
+
+  BATTERY_QUERY_INFORMATION bqi = { tag };
+  bqi.InformationLevel = BatteryUniqueID;
+
+  wchar_t buffer[1024];
+  if(DeviceIoControl(handle, IOCTL_BATTERY_QUERY_INFORMATION,
+                     &bqi, sizeof(bqi), buffer, sizeof(buffer),
+                     &bytes_written, NULL))
+    b.unique_id = Utf8Str(buffer);
+
+  b.resistance_save_tick = GetTickCount();
+  LoadResistance(&b);
+
+  ((vector<telemetry_battery> *)cbdata)->push_back(b);
+  return TRUE;
+}
+
+void TelemetryClose()
+{
+  for(size_t i = 0; i < telem.batteries.size(); ++i) {
+    SaveResistance(&telem.batteries[i]);
+    CloseHandle(telem.batteries[i].handle);
+  }
+  telem.batteries.clear();
+}
+
+bool TelemetryInit()
+{
+  DWORD now = GetTickCount();
+  bool any = false;
+
+  for(int id = 0; id < TELEMETRY_COUNT; ++id) {
+    telem.channel[id].due_tick = now;
+    if(telem.channel[id].period_ms)
+      any = true;
+  }
+
+  if(!any) {
+    cerr << "Error: All telemetry channels are disabled." << endl;
+    return false;
+  }
+
+  telem.stale = true;
+  telem.enum_tick = now - TELEMETRY_ENUM_RETRY_MS;
+  atexit(TelemetryClose);
+  return true;
+}
+
+/* Query an information level of the battery. Set *gone if the battery's tag
+   is no longer valid. Other failures mean the level isn't supported. */
+bool TelemetryQueryInformation(const struct telemetry_battery *b,
+                               BATTERY_QUERY_INFORMATION_LEVEL level,
+                               void *buf, DWORD size, bool *gone)
+{
+  DWORD bytes_written;
+  BATTERY_QUERY_INFORMATION bqi = { b->tag };
+  bqi.InformationLevel = level;
+
+  ++telem.calls;
+  if(DeviceIoControl(b->handle, IOCTL_BATTERY_QUERY_INFORMATION,
+                     &bqi, sizeof(bqi), buf, size, &bytes_written, NULL))
+    return true;
+
+  DWORD gle = GetLastError();
+  if(gle == ERROR_FILE_NOT_FOUND || gle == ERROR_NO_SUCH_DEVICE ||
+     gle == ERROR_DEVICE_NOT_CONNECTED)
+    *gone = true;
+  return false;
+}
+
+/* Read the due channels of a battery. Return false if it has gone away. */
+bool TelemetryReadBattery(struct telemetry_battery *b, const bool *due)
+{
+  bool gone = false;
+
+  if(due[TELEMETRY_VOLTAGE] || due[TELEMETRY_CURRENT]) {
+    DWORD bytes_written;
+    BATTERY_WAIT_STATUS bws = { b->tag, };
+    BATTERY_STATUS bs;
+
+    ++telem.calls;
+    if(!DeviceIoControl(b->handle, IOCTL_BATTERY_QUERY_STATUS,
+                        &bws, sizeof(bws), &bs, sizeof(bs),
+                        &bytes_written, NULL))
+      return false;
+
+    b->voltage_mv = bs.Voltage;
+    b->rate_mw = bs.Rate;
+    b->status_tick = GetTickCount();
+  }
+
+  if(due[TELEMETRY_TEMPERATURE] &&
+     !TelemetryQueryInformation(b, BatteryTemperature, &b->temperature,
+                                sizeof(b->temperature), &gone))
+    b->temperature = 0;
+
+  if(due[TELEMETRY_CYCLE_COUNT] || due[TELEMETRY_HEALTH]) {
+    BATTERY_INFORMATION bi;
+    if(TelemetryQueryInformation(b, BatteryInformation, &bi, sizeof(bi),
+                                 &gone)) {
+      b->cycle_count = bi.CycleCount;
+      if(!bi.FullChargedCapacity || bi.FullChargedCapacity == (ULONG)-1 ||
+         !bi.DesignedCapacity || bi.DesignedCapacity == (ULONG)-1)
+        b->health = 0;
+      else
+        b->health = 100 * ((double)bi.FullChargedCapacity /
+                           bi.DesignedCapacity);
+    }
+  }
+
+  return !gone;
+}
+
+string TelemetryValueStr(const struct telemetry_battery *b,
+                         enum telemetry_id id)
+{
+  stringstream ss;
+  LONG current_ma;
+
+  switch(id) {
+  case TELEMETRY_VOLTAGE:
+    if(b->voltage_mv != BATTERY_UNKNOWN_VOLTAGE)
+      ss << b->voltage_mv;
+    break;
+  case TELEMETRY_CURRENT:
+    if(TelemetryCurrent(b, &current_ma))
+      ss << current_ma;
+    break;
+  case TELEMETRY_TEMPERATURE:
+    if(b->temperature)
+      ss << fixed << setprecision(1) << ((b->temperature / 10.0) - 273.15);
+    break;
+  case TELEMETRY_CYCLE_COUNT:
+    if(b->cycle_count)
+      ss << b->cycle_count;
+    break;
+  case TELEMETRY_HEALTH:
+    if(b->health)
+      ss << fixed << setprecision(2) << b->health;
+    break;
+  default:
+    break;
+  }
+  return ss.str().empty() ? "unknown" : ss.str();
+}
+
+/* Show and publish the readings of the channels just read that changed. */
+void TelemetryReport(struct telemetry_battery *b, const bool *due)
+{
+  for(int id = 0; id < TELEMETRY_COUNT; ++id) {
+    if(!due[id])
+      continue;
+
+    string value = TelemetryValueStr(b, (enum telemetry_id)id);
+    if(value == b->shown[id])
+      continue;
+    b->shown[id] = value;
+
+    if(verbose >= 2) {
+      cout << TIMESTAMPED_PREFIX << "Battery #" << b->slot << " "
+           << telemetry_names[id] << ": " << value
+           << (value != "unknown" ? telemetry_units[id] : "") << endl;
+    }
+
+    if(mqtt_broker) {
+      stringstream field;
+      field << "battery" << b->slot << "/" << telemetry_fields[id];
+      MqttUpdateField(field.str().c_str(), value);
+    }
+  }
+}
+
+/* Return how many milliseconds until the next channel is due. */
+DWORD TelemetryDelay()
+{
+  DWORD now = GetTickCount();
+  DWORD delay = INFINITE;
+
+  for(int id = 0; id < TELEMETRY_COUNT; ++id) {
+    const struct telemetry_channel *ch = &telem.channel[id];
+    if(!ch->period_ms)
+      continue;
+    if((LONG)(ch->due_tick - now) <= 0)
+      return 0;
+    if((ch->due_tick - now) < delay)
+      delay = ch->due_tick - now;
+  }
+  return delay;
+}
+
+/* Read the channels that are due, in one batch. */
+void TelemetryService()
+{
+  DWORD now = GetTickCount();
+  bool due[TELEMETRY_COUNT], any = false;
+
+  for(int id = 0; id < TELEMETRY_COUNT; ++id) {
+    struct telemetry_channel *ch = &telem.channel[id];
+    due[id] = (ch->period_ms && (LONG)(now - ch->due_tick) >= 0);
+    if(!due[id])
+      continue;
+    any = true;
+    // stay on the channel's own schedule unless it has fallen behind
+    ch->due_tick += ch->period_ms;
+    if((LONG)(now - ch->due_tick) >= 0)
+      ch->due_tick = now + ch->period_ms;
+  }
+  if(!any)
+    return;
+
+  if(telem.stale) {
+    if((now - telem.enum_tick) < TELEMETRY_ENUM_RETRY_MS)
+      return;
+    TelemetryClose();
+    EnumBattInterfaces(TelemetryEnumProc, &telem.batteries);
+    telem.enum_tick = now;
+    telem.stale = telem.batteries.empty();
+  }
+
+  ++telem.batches;
+  bool read = false;
+  for(size_t i = 0; i < telem.batteries.size(); ++i) {
+    struct telemetry_battery *b = &telem.batteries[i];
+    ULONG prev_voltage_mv = b->voltage_mv;
+    LONG prev_current_ma = 0;
+    DWORD prev_tick = b->status_tick;
+    bool prev_current = TelemetryCurrent(b, &prev_current_ma);
+
+    if(!TelemetryReadBattery(b, due)) {
+      telem.stale = true;
+      continue;
+    }
+    read = true;
+    TelemetryReport(b, due);
+
+    if(prev_current && b->status_tick != prev_tick)
+      ResistanceUpdate(b, prev_voltage_mv, prev_current_ma, prev_tick);
+  }
+
+  // a read is counted once it's done, not when it's skipped or fails
+  for(int id = 0; id < TELEMETRY_COUNT && read; ++id) {
+    if(due[id])
+      ++telem.channel[id].reads;
+  }
+}
+
+void ShowTelemetryStats()
+{
+  cout << "\nTelemetry:\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Batches: " << right
+       << telem.batches << " (" << telem.calls << " DeviceIoControl calls, "
+       << telem.batteries.size() << " "
+       << (telem.batteries.size() == 1 ? "battery" : "batteries") << ")\n\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Channel" << right
+       << setw(10) << "Period" << setw(10) << "Reads" << "\n";
+
+  for(int id = 0; id < TELEMETRY_COUNT; ++id) {
+    const struct telemetry_channel *ch = &telem.channel[id];
+    stringstream period;
+    if(ch->period_ms)
+      period << fixed << setprecision(1) << (ch->period_ms / 1000.0) << "s";
+    else
+      period << "off";
+    cout << left << setw(BATT_FIELD_WIDTH) << telemetry_names[id] << right
+         << setw(10) << period.str() << setw(10) << ch->reads << "\n";
+  }
+
+  cout << "\n" << left << setw(BATT_FIELD_WIDTH) << "Load steps: " << right
+       << telem.load_steps << "\n";
+  for(size_t i = 0; i < telem.batteries.size(); ++i) {
+    const struct telemetry_battery *b = &telem.batteries[i];
+    stringstream name;
+    name << "Battery #" << b->slot << " R: ";
+    cout << left << setw(BATT_FIELD_WIDTH) << name.str() << right;
+    if(b->resistance_median) {
+      cout << fixed << setprecision(0) << b->resistance_median << " mOhm ("
+           << b->resistance_steps << " load steps)\n";
+    }
+    else
+      cout << "unknown\n";
+  }
+  cout << flush;
+}
+
+/* Show the statistics on exit (option --stats). */
+void ShowStats()
+{
+  static LONG shown;
+  if(InterlockedExchange(&shown, 1))
+    return;
+  ShowSensorProfile();
+  ShowProcessStats();
+  if(telemetry)
+    ShowTelemetryStats();
+  if(coalesce_seconds)
+    ShowCoalesceStats();
+  ShowCriticalStats();
+  ShowLeaseStats();
+}
+
+BOOL WINAPI StatsCtrlHandler(DWORD)
+{
+  ShowStats();
+  return FALSE;  // continue on to the default handler, which exits
+}
+
+/* Windows Event Log output (option --eventlog).
+
+Each event is reported to the Application event log under source "battstatus"
+as a list of structured NAME=value insert strings, for example:
+BATT_EVENT=revival
+BATT_PERCENT=17
+BATT_RATE_MW=-11433
+MESSAGE=Possible battery revival or bad battery.
+
+ReportEvent is a synchronous call to the event log service, so the main loop
+only queues records and a worker thread reports them. The worker drains the
+whole queue each time it wakes, so a burst of events costs a single wakeup.
+If the event log service stops accepting records then the records not yet
+reported stay queued and are tried again every EVENTLOG_RETRY_MS. The queue is
+bounded; while it's full the oldest queued records are dropped and the number
+dropped is reported once the service recovers. Critical alerts are queued
+separately and are never dropped; the worker reports them before the next
+queued record, see "Critical alerts". On exit the worker is given up to
+EVENTLOG_EXIT_WAIT_MS to report what's queued.
+
+No message file is registered for the source (it would have to be compiled
+into the executable and registered by an administrator), so Event Viewer says
+the description for the event ID can't be found and then shows the insert
+strings. Tools that read the insert strings, such as Get-WinEvent, see the
+fields as usual.
+*/
+#define EVENTLOG_SOURCE_NAME "battstatus"
+#define EVENTLOG_QUEUE_MAX 1000
+#define EVENTLOG_RETRY_MS 5000
+#define EVENTLOG_EXIT_WAIT_MS 2000
+
+enum eventlog_id {
+  EVENTLOG_ID_STATUS = 1,
+  EVENTLOG_ID_POWERBROADCAST,
+  EVENTLOG_ID_BATTSAVER,
+  EVENTLOG_ID_REVIVAL,
+  EVENTLOG_ID_RESUME,
+  EVENTLOG_ID_ERROR,
+  EVENTLOG_ID_CHARGER,
+  EVENTLOG_ID_CRITICAL
+};
+
+struct eventlog_record {
+  WORD type;  // EVENTLOG_INFORMATION_TYPE, EVENTLOG_WARNING_TYPE, etc
+  enum eventlog_id id;
+  vector<string> fields;
+  LONGLONG critical_start;  // 0 if not a critical alert
+};
+
+struct eventlog_writer {
+  HANDLE source;
+  HANDLE wake;  // auto-reset event, signaled when records are queued
+  CRITICAL_SECTION lock;
+  deque<eventlog_record> queue;     // protected by lock
+  deque<eventlog_record> critical;  // protected by lock
+  DWORD dropped;                    // protected by lock
+  bool busy;  // the worker holds a batch from the queue, protected by lock
+  DWORD simulate_ms;  // if not 0 then each record takes this long instead of
+                      // being reported (option --critical-benchmark)
+};
+
+struct eventlog_writer evlog;
+
+string EventLogIdStr(enum eventlog_id id)
+{
+  switch(id)
+  {
+  case EVENTLOG_ID_STATUS: return "status";
+  case EVENTLOG_ID_POWERBROADCAST: return "power_broadcast";
+  case EVENTLOG_ID_BATTSAVER: return "battery_saver";
+  case EVENTLOG_ID_REVIVAL: return "revival";
+  case EVENTLOG_ID_RESUME: return "resume";
+  case EVENTLOG_ID_ERROR: return "error";
+  case EVENTLOG_ID_CHARGER: return "charger";
+  case EVENTLOG_ID_CRITICAL: return "critical";
+  }
+  return UndocumentedValueStr((unsigned)id);
+}
+
+DWORD WINAPI EventLogThread(LPVOID)
+{
+  bool retry = false;
+
+  for(;;) {
+    // after a failure the records left are tried again even if none are new
+    WaitForSingleObject(evlog.wake, retry ? EVENTLOG_RETRY_MS : INFINITE);
+    retry = false;
+
+    deque<eventlog_record> batch;
+    DWORD dropped;
+
+    EnterCriticalSection(&evlog.lock);
+    batch.swap(evlog.queue);
+    dropped = evlog.dropped;
+    evlog.dropped = 0;
+    evlog.busy = true;
+    LeaveCriticalSection(&evlog.lock);
+
+    if(dropped) {
+      eventlog_record r;
+      stringstream ss;
+      ss << "MESSAGE=" << dropped << " records were dropped because the "
+         << "event log was not accepting records.";
+      r.type = EVENTLOG_WARNING_TYPE;
+      r.id = EVENTLOG_ID_ERROR;
+      r.fields.push_back("BATT_EVENT=" + EventLogIdStr(r.id));
+      r.fields.push_back(ss.str());
+      r.critical_start = 0;
+      batch.push_front(r);
+    }
+
+    for(;;) {
+      eventlog_record r;
+      bool critical = false;
+
+      // a critical alert goes ahead of the rest of the batch
+      EnterCriticalSection(&evlog.lock);
+      if(evlog.critical.size()) {
+        r = evlog.critical.front();
+        evlog.critical.pop_front();
+        critical = true;
+      }
+      LeaveCriticalSection(&evlog.lock);
+
+      if(!critical) {
+        if(batch.empty())
+          break;
+        r = batch.front();
+        batch.pop_front();
+      }
+
+      vector<LPCSTR> strings;
+      for(size_t i = 0; i < r.fields.size(); ++i)
+        strings.push_back(r.fields[i].c_str());
+      if(evlog.simulate_ms)
+        Sleep(evlog.simulate_ms);
+      else if(!ReportEventA(evlog.source, r.type, 0, (DWORD)r.id, NULL,
+                            (WORD)strings.size(), 0,
+                            strings.size() ? &strings[0] : NULL, NULL)) {
+        /* Put the record and the rest of the batch back ahead of the
+           records queued since, to be retried. */
+        EnterCriticalSection(&evlog.lock);
+        if(critical)
+          evlog.critical.push_front(r);
+        else
+          batch.push_front(r);
+        evlog.queue.insert(evlog.queue.begin(), batch.begin(), batch.end());
+        while(evlog.queue.size() > EVENTLOG_QUEUE_MAX) {
+          evlog.queue.pop_front();
+          ++evlog.dropped;
+        }
+        LeaveCriticalSection(&evlog.lock);
+        retry = true;
+        break;
+      }
+
+      if(critical)
+        CriticalDelivered(CRITSINK_EVENTLOG, r.critical_start);
+    }
+
+    EnterCriticalSection(&evlog.lock);
+    evlog.busy = false;
+    LeaveCriticalSection(&evlog.lock);
+  }
+}
+
+/* Wait up to EVENTLOG_EXIT_WAIT_MS for the worker to report what's queued. */
+void EventLogExit()
+{
+  DWORD start = GetTickCount();
+  SetEvent(evlog.wake);
+  for(;;) {
+    EnterCriticalSection(&evlog.lock);
+    bool done = (evlog.queue.empty() && evlog.critical.empty() &&
+                 !evlog.dropped && !evlog.busy);
+    LeaveCriticalSection(&evlog.lock);
+    if(done || (GetTickCount() - start) >= EVENTLOG_EXIT_WAIT_MS)
+      return;
+    Sleep(10);
+  }
+}
+
+BOOL WINAPI EventLogCtrlHandler(DWORD)
+{
+  EventLogExit();
+  return FALSE;  // continue on to the next handler
+}
+
+/* Start the worker. */
+bool EventLogStart()
+{
+  InitializeCriticalSection(&evlog.lock);
+  evlog.wake = CreateEventA(NULL, FALSE, FALSE, NULL);
+  HANDLE thread = evlog.wake ?
+                  CreateThread(NULL, 0, EventLogThread, NULL, 0, NULL) : NULL;
+  if(!thread) {
+    DWORD gle = GetLastError();
+    cerr << "Error: Failed to start the event log thread, error " << gle
+         << "." << endl;
+    return false;
+  }
+  CloseHandle(thread);
+  return true;
+}
+
+bool EventLogInit()
+{
+  evlog.source = RegisterEventSourceA(NULL, EVENTLOG_SOURCE_NAME);
+  if(!evlog.source) {
+    DWORD gle = GetLastError();
+    cerr << "Error: RegisterEventSource failed, error " << gle << "." << endl;
+    return false;
+  }
+
+  if(!EventLogStart())
+    return false;
+
+  atexit(EventLogExit);
+  SetConsoleCtrlHandler(EventLogCtrlHandler, TRUE);
+  return true;
+}
+
+/* Queue an event log record. 'status' is optional and if it's not NULL then
+   the power status fields are included in the record. If 'critical_start' is
+   not 0 then the record is a critical alert raised then, see CriticalStart.
+   This never blocks. */
+void EventLogPost(WORD type, enum eventlog_id id,
+                  const SYSTEM_POWER_STATUS *status, const string &message,
+                  LONGLONG critical_start = 0)
+{
+  eventlog_record r;
+  r.type = type;
+  r.id = id;
+  r.critical_start = critical_start;
+  r.fields.push_back("BATT_EVENT=" + EventLogIdStr(id));
+  r.fields.push_back("MESSAGE=" + message);
+
+  if(status) {
+    stringstream ss;
+    ss << "BATT_AC=" << (status->ACLineStatus == 0 ? "offline" :
+                         status->ACLineStatus == 1 ? "online" : "unknown");
+    r.fields.push_back(ss.str());
+    r.fields.push_back(string("BATT_CHARGING=") +
+                       (CHARGING(*status) ? "1" : "0"));
+    if(status->BatteryLifePercent <= 100) {
+      ss.str("");
+      ss << "BATT_PERCENT=" << (unsigned)status->BatteryLifePercent;
+      r.fields.push_back(ss.str());
+    }
+    if(status->BatteryLifeTime != LIFETIME_UNKNOWN) {
+      ss.str("");
+      ss << "BATT_LIFETIME_S=" << status->BatteryLifeTime;
+      r.fields.push_back(ss.str());
+    }
+    LONG rate = GetBatteryPowerRate();
+    if(rate) {
+      ss.str("");
+      ss << "BATT_RATE_MW=" << rate;
+      r.fields.push_back(ss.str());
+    }
+    if(os.dwMajorVersion >= 10) {
+      r.fields.push_back(string("BATT_SAVER=") +
+                         (BATTSAVER(*status) ? "1" : "0"));
+    }
+  }
+
+  EnterCriticalSection(&evlog.lock);
+  if(critical_start)
+    evlog.critical.push_back(r);
+  else {
+    if(evlog.queue.size() >= EVENTLOG_QUEUE_MAX) {
+      evlog.queue.pop_front();
+      ++evlog.dropped;
+    }
+    evlog.queue.push_back(r);
+  }
+  LeaveCriticalSection(&evlog.lock);
+
+  SetEvent(evlog.wake);
+}
+
+/* Raise a critical alert in every sink, see "Critical alerts". */
+void CriticalAlert(const SYSTEM_POWER_STATUS *status, const string &message)
+{
+  LONGLONG start = CriticalStart();
+
+  CoalesceUrgent();
+  cout << TIMESTAMPED_PREFIX << "CRITICAL: " << message << endl;
+  CriticalDelivered(CRITSINK_CONSOLE, start);
+
+  if(eventlog) {
+    EventLogPost(EVENTLOG_ERROR_TYPE, EVENTLOG_ID_CRITICAL, status, message,
+                 start);
+  }
+
+  if(mqtt_broker) {
+    MqttUpdateField("critical", "true", start);
+    MqttService();
+  }
+}
+
+/* Critical benchmark (option --critical-benchmark).
+
+Measures the worst critical alert latency with the bulk lane saturated. For
+the given time the event log queue is kept full of bulk records and a critical
+alert is raised every CRITICAL_BENCHMARK_ALERT_MS, each behind
+EVENTLOG_QUEUE_MAX of them. Nothing is reported to the event log:
+instead each record takes CRITICAL_BENCHMARK_REPORT_MS, as if the event log
+service were slow, so that the bulk lane alone would take seconds to drain.
+The console lane writes the alerts to the console as usual. MQTT isn't covered
+since it needs a broker.
+
+It's an error if an alert wasn't delivered to every sink or took longer than
+CRITICAL_LATENCY_BOUND_MS.
+*/
+#define CRITICAL_BENCHMARK_ALERT_MS 250
+#define CRITICAL_BENCHMARK_REPORT_MS 5
+
+int CriticalBenchmark(DWORD seconds)
+{
+  SYSTEM_POWER_STATUS status;
+  if(!GetSystemPowerStatus(&status)) {
+    DWORD gle = GetLastError();
+    cerr << "Error: GetSystemPowerStatus failed, error " << gle << "." << endl;
+    return 1;
+  }
+
+  evlog.simulate_ms = CRITICAL_BENCHMARK_REPORT_MS;
+  if(!EventLogStart())
+    return 1;
+  eventlog = true;
+
+  unsigned long bulk = 0, alerts = 0;
+  DWORD start = GetTickCount();
+  DWORD next_alert = start + CRITICAL_BENCHMARK_ALERT_MS;
+
+  while((GetTickCount() - start) < seconds * 1000) {
+    EnterCriticalSection(&evlog.lock);
+    size_t queued = evlog.queue.size();
+    LeaveCriticalSection(&evlog.lock);
+
+    // the queue is full before each alert
+    for(; queued < EVENTLOG_QUEUE_MAX; ++queued, ++bulk) {
+      EventLogPost(EVENTLOG_INFORMATION_TYPE, EVENTLOG_ID_STATUS, NULL,
+                   "Critical benchmark bulk record.");
+    }
+
+    if((LONG)(GetTickCount() - next_alert) >= 0) {
+      stringstream ss;
+      ss << "Critical benchmark alert " << ++alerts << ".";
+      CriticalAlert(&status, ss.str());
+      next_alert += CRITICAL_BENCHMARK_ALERT_MS;
+    }
+    Sleep(1);
+  }
+
+  // an alert not delivered within the bound is over it anyway
+  start = GetTickCount();
+  for(;;) {
+    EnterCriticalSection(&crit.lock);
+    bool done = (crit.delivered[CRITSINK_EVENTLOG] == alerts);
+    LeaveCriticalSection(&crit.lock);
+    if(done || (GetTickCount() - start) > CRITICAL_LATENCY_BOUND_MS)
+      break;
+    Sleep(10);
+  }
+
+  ShowCriticalStats();
+  cout << left << setw(BATT_FIELD_WIDTH) << "Bulk records: " << right
+       << bulk << " queued" << endl;
+
+  EnterCriticalSection(&crit.lock);
+  bool late = false, lost = false;
+  for(int i = CRITSINK_CONSOLE; i <= CRITSINK_EVENTLOG; ++i) {
+    if(crit.delivered[i] != alerts)
+      lost = true;
+    if(crit.worst_us[i] > (LONGLONG)CRITICAL_LATENCY_BOUND_MS * 1000)
+      late = true;
+  }
+  LeaveCriticalSection(&crit.lock);
+
+  if(lost) {
+    cerr << "Error: A critical alert wasn't delivered to every sink." << endl;
+    return 1;
+  }
+  if(late) {
+    cerr << "Error: A critical alert took longer than "
+         << CRITICAL_LATENCY_BOUND_MS << " ms." << endl;
+    return 1;
+  }
+  return 0;
+}
+
+/* Charge sessions (option --charge-profile).
+
+A session starts when the battery charges on AC power and ends when AC is
+unplugged. Its power vs percent curve is kept as a histogram of CHARGE_BINS
+bins of percent, each the sum and count of the charge rate samples in it, so a
+session costs the same however long it is. At the end of the session it's
+shown with:
+
+- the peak charge power
+- the CC/CV knee: when the charger moves from constant current to constant
+  voltage the power falls off. It's the first bin after the peak bin whose
+  power is below CHARGE_KNEE_RATIO of the peak bin's.
+- the time from 20% to 80%, if the session covered it
+
+The battery's historical curve is a moving average of its earlier sessions per
+bin, saved in state file charge.txt per computer and set of batteries. Once a
+session has CHARGE_COMPARE_BINS bins in common with the historical curve below
+its knee (the constant current part, where the charger rather than the battery
+is the limit) a session drawing less than CHARGE_SLOW_RATIO of the usual power
+is flagged once, since the charger or dock port is likely underpowered or
+throttled.
+*/
+#define CHARGE_STATE_FILE "charge.txt"
+#define CHARGE_BINS 20
+#define CHARGE_KNEE_RATIO 0.8
+#define CHARGE_SLOW_RATIO 0.7
+#define CHARGE_COMPARE_BINS 3
+#define CHARGE_HISTORY_WEIGHT 0.25  // of a new session in the historical curve
+
+struct charge_bin {
+  double sum_mw;
+  DWORD count;
+};
+
+struct charge_session {
+  bool active;
+  bool flagged;
+  DWORD start_tick;
+  DWORD end_tick;
+  unsigned start_percent;
+  unsigned end_percent;
+  LONG peak_mw;
+  DWORD tick20;  // when 20% was reached, if the session started below it
+  DWORD tick80;  // when 80% was reached after tick20
+  struct charge_bin bin[CHARGE_BINS];
+};
+
+struct charge_history {
+  bool loaded;
+  unsigned long sessions;
+  double mw[CHARGE_BINS];  // 0 if no data
+};
+
+struct charge_session charge;
+struct charge_history charge_history;
+
+int ChargeBin(unsigned percent)
+{
+  int bin = (int)((percent * CHARGE_BINS) / 100);
+  return bin < CHARGE_BINS ? bin : CHARGE_BINS - 1;
+}
+
+/* Return the bin of the CC/CV knee of a curve, or -1 if there's none. */
+int ChargeKnee(const double *mw)
+{
+  int peak = -1;
+  for(int i = 0; i < CHARGE_BINS; ++i) {
+    if(mw[i] && (peak == -1 || mw[i] > mw[peak]))
+      peak = i;
+  }
+  if(peak == -1)
+    return -1;
+  for(int i = peak + 1; i < CHARGE_BINS; ++i) {
+    if(mw[i] && mw[i] < (mw[peak] * CHARGE_KNEE_RATIO))
+      return i;
+  }
+  return -1;
+}
+
+void ChargeSessionCurve(double *mw)
+{
+  for(int i = 0; i < CHARGE_BINS; ++i)
+    mw[i] = charge.bin[i].count ? charge.bin[i].sum_mw / charge.bin[i].count :
+                                  0;
+}
+
+/* The state record is: <sessions> <mw of bin 0> ... <mw of last bin> */
+void LoadChargeHistory()
+{
+  string value;
+  charge_history.loaded = true;
+  if(!LoadStateRecord(CHARGE_STATE_FILE, BatterySetKey(), &value))
+    return;
+
+  stringstream ss(value);
+  struct charge_history h = { true, };
+  ss >> h.sessions;
+  for(int i = 0; i < CHARGE_BINS; ++i)
+    ss >> h.mw[i];
+  if(ss)
+    charge_history = h;
+}
+
+void SaveChargeHistory()
+{
+  stringstream ss;
+  ss << charge_history.sessions << fixed << setprecision(0);
+  for(int i = 0; i < CHARGE_BINS; ++i)
+    ss << " " << charge_history.mw[i];
+  SaveStateRecord(CHARGE_STATE_FILE, BatterySetKey(), ss.str());
+}
+
+/* Flag the session if it's drawing much less power than usual. */
+void ChargeCompare(const SYSTEM_POWER_STATUS *status)
+{
+  if(charge.flagged || !charge_history.sessions)
+    return;
+
+  double mw[CHARGE_BINS];
+  ChargeSessionCurve(mw);
+
+  int knee = ChargeKnee(charge_history.mw);
+  double session_mw = 0, usual_mw = 0;
+  int common = 0;
+  for(int i = 0; i < (knee == -1 ? CHARGE_BINS : knee); ++i) {
+    if(mw[i] && charge_history.mw[i]) {
+      session_mw += mw[i];
+      usual_mw += charge_history.mw[i];
+      ++common;
+    }
+  }
+  if(common < CHARGE_COMPARE_BINS ||
+     session_mw >= (usual_mw * CHARGE_SLOW_RATIO))
+    return;
+
+  charge.flagged = true;
+  CoalesceUrgent();
+
+  stringstream ss;
+  ss << "Charging at " << (unsigned)((100 * session_mw) / usual_mw)
+     << "% of this battery's usual power. The charger or dock port may be "
+     << "underpowered or throttled.";
+
+  if(eventlog)
+    EventLogPost(EVENTLOG_WARNING_TYPE, EVENTLOG_ID_CHARGER, status, ss.str());
+
+  if(RateLimitAllow(OUTCLASS_WARNING))
+    cout << TIMESTAMPED_PREFIX << "WARNING: " << ss.str() << endl;
+}
+
+void ChargeEnd()
+{
+  charge.active = false;
+
+  double mw[CHARGE_BINS];
+  ChargeSessionCurve(mw);
+  if(!charge.peak_mw)
+    return;
+
+  int knee = ChargeKnee(mw);
+  stringstream ss;
+  ss << "Charge session: " << charge.start_percent << "% to "
+     << charge.end_percent << "% in "
+     << BatteryLifeTimeStr((charge.end_tick - charge.start_tick) / 1000)
+     << ". Peak " << charge.peak_mw << " mW";
+  if(knee != -1)
+    ss << ", knee at " << ((knee * 100) / CHARGE_BINS) << "%";
+  if(charge.tick80) {
+    ss << ", 20% to 80% in "
+       << BatteryLifeTimeStr((charge.tick80 - charge.tick20) / 1000);
+  }
+  ss << ".";
+
+  if(eventlog)
+    EventLogPost(EVENTLOG_INFORMATION_TYPE, EVENTLOG_ID_CHARGER, NULL,
+                 ss.str());
+
+  if(RateLimitAllow(OUTCLASS_STATUS))
+    cout << TIMESTAMPED_PREFIX << ss.str() << endl;
+
+  for(int i = 0; i < CHARGE_BINS; ++i) {
+    if(!mw[i])
+      continue;
+    charge_history.mw[i] = !charge_history.mw[i] ? mw[i] :
+      ((1 - CHARGE_HISTORY_WEIGHT) * charge_history.mw[i]) +
+      (CHARGE_HISTORY_WEIGHT * mw[i]);
+  }
+  ++charge_history.sessions;
+  SaveChargeHistory();
+}
+
+/* Record the charge rate. This is called for every power status poll. */
+void ChargeUpdate(const SYSTEM_POWER_STATUS *status)
+{
+  DWORD now = GetTickCount();
+  unsigned percent = status->BatteryLifePercent;
+
+  if(charge.active && !PLUGGED_IN(*status)) {
+    ChargeEnd();
+    return;
+  }
+
+  if(!PLUGGED_IN(*status) || !CHARGING(*status) || percent > 100)
+    return;
+
+  if(!charge.active) {
+    memset(&charge, 0, sizeof charge);
+    charge.active = true;
+    charge.start_tick = now;
+    charge.start_percent = percent;
+    if(!charge_history.loaded)
+      LoadChargeHistory();
+  }
+
+  LONG rate = GetBatteryPowerRate();
+  if(rate <= 0)
+    return;
+
+  struct charge_bin *bin = &charge.bin[ChargeBin(percent)];
+  bin->sum_mw += rate;
+  ++bin->count;
+  if(rate > charge.peak_mw)
+    charge.peak_mw = rate;
+  charge.end_tick = now;
+  charge.end_percent = percent;
+
+  if(!charge.tick20 && charge.start_percent < 20 && percent >= 20)
+    charge.tick20 = now;
+  if(charge.tick20 && !charge.tick80 && percent >= 80)
+    charge.tick80 = now;
+
+  ChargeCompare(status);
+}
+
+/* Drain profile (options --drain-profile and --drain-report).
+
+A 7x24 matrix, by weekday and hour of local time, of how long the computer
+ran on battery, the energy it drained and how many times it was plugged in.
+It shows when the computer is actually used on battery and how hard without
+keeping the samples themselves. Each poll adds the time since the previous
+one to the cell of the current hour, which is O(1). The time the computer was
+asleep or hibernating isn't counted: an interval isn't counted if the monitor
+window received PBT_APMSUSPEND during it, or if it's longer than the longest
+poll interval (10s, or the degraded poll with --degrade) plus
+DRAIN_GAP_MARGIN_MS, in case the broadcast was missed.
+
+The matrix is saved in state file drain.txt per computer and set of batteries
+every DRAIN_SAVE_MINUTES and on exit as 168 cells of
+"<seconds>:<mWh>:<plug ins>", Sunday 0:00 first. --drain-report shows it.
+*/
+#define DRAIN_STATE_FILE "drain.txt"
+#define DRAIN_GAP_MARGIN_MS (5 * 1000)
+#define DRAIN_SAVE_MINUTES 15
+
+struct drain_cell {
+  DWORD seconds;  // on battery
+  double mwh;     // drained
+  DWORD plugins;
+};
+
+struct drain_matrix {
+  struct drain_cell cell[7][24];
+  bool loaded;
+  bool dirty;
+  DWORD tick;       // last sample
+  double ms_frac;   // milliseconds on battery not yet counted in seconds
+  bool plugged_in;
+  DWORD save_tick;
+  bool suspended;   // the computer suspended since the last sample
+};
+
+struct drain_matrix drain;
+
+/* Return the longest interval between polls that isn't sleep. */
+DWORD DrainMaxGap()
+{
+  DWORD poll_ms = SENSOR_MAX_WAIT_MS;
+  if(degrade && degr.poll_ms > poll_ms)
+    poll_ms = degr.poll_ms;
+  return poll_ms + DRAIN_GAP_MARGIN_MS;
+}
+
+bool LoadDrainProfile()
+{
+  string value;
+  drain.loaded = true;
+  if(!LoadStateRecord(DRAIN_STATE_FILE, BatterySetKey(), &value))
+    return false;
+
+  stringstream ss(value);
+  struct drain_cell cell[7][24];
+  for(int d = 0; d < 7; ++d) {
+    for(int h = 0; h < 24; ++h) {
+      char colon1, colon2;
+      if(!(ss >> cell[d][h].seconds >> colon1 >> cell[d][h].mwh >> colon2
+              >> cell[d][h].plugins) || colon1 != ':' || colon2 != ':')
+        return false;
+    }
+  }
+  memcpy(drain.cell, cell, sizeof cell);
+  return true;
+}
+
+void SaveDrainProfile()
+{
+  if(!drain.dirty)
+    return;
+
+  stringstream ss;
+  ss << fixed << setprecision(1);
+  for(int d = 0; d < 7; ++d) {
+    for(int h = 0; h < 24; ++h) {
+      const struct drain_cell *c = &drain.cell[d][h];
+      ss << (d || h ? " " : "") << c->seconds << ":" << c->mwh << ":"
+         << c->plugins;
+    }
+  }
+  if(SaveStateRecord(DRAIN_STATE_FILE, BatterySetKey(), ss.str()))
+    drain.dirty = false;
+  drain.save_tick = GetTickCount();
+}
+
+/* Add the time since the last poll to the current hour. This is called for
+   every power status poll. */
+void DrainUpdate(const SYSTEM_POWER_STATUS *status)
+{
+  DWORD now = GetTickCount();
+
+  if(!drain.loaded) {
+    LoadDrainProfile();
+    drain.tick = drain.save_tick = now;
+    drain.plugged_in = PLUGGED_IN(*status);
+    atexit(SaveDrainProfile);
+    return;
+  }
+
+  SYSTEMTIME st;
+  GetLocalTime(&st);
+  struct drain_cell *c = &drain.cell[st.wDayOfWeek % 7][st.wHour % 24];
+
+  DWORD elapsed = now - drain.tick;
+  bool slept = (drain.suspended || elapsed > DrainMaxGap());
+  drain.tick = now;
+  drain.suspended = false;
+
+  if(!PLUGGED_IN(*status) && !NO_BATTERY(*status) && !slept) {
+    LONG rate = GetBatteryPowerRate();
+    drain.ms_frac += elapsed;
+    c->seconds += (DWORD)(drain.ms_frac / 1000);
+    drain.ms_frac -= (DWORD)(drain.ms_frac / 1000) * 1000;
+    if(rate < 0)
+      c->mwh += (-rate * (double)elapsed) / (60 * 60 * 1000);
+    drain.dirty = true;
+  }
+
+  if(PLUGGED_IN(*status) && !drain.plugged_in) {
+    ++c->plugins;
+    drain.dirty = true;
+  }
+  drain.plugged_in = PLUGGED_IN(*status);
+
+  if((now - drain.save_tick) >= (DRAIN_SAVE_MINUTES * 60 * 1000))
+    SaveDrainProfile();
+}
+
+/* Show the saved drain profile. Return 0 on success. */
+int DrainReport()
+{
+  if(!LoadDrainProfile()) {
+    cerr << "Error: There's no drain profile for " << BatterySetKey()
+         << ". Record one with --drain-profile." << endl;
+    return 1;
+  }
+
+  const char *days[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  const char *titles[3] = {
+    "Mean drain in W, by hour and weekday:",
+    "Minutes on battery, by hour and weekday:",
+    "Times plugged in, by hour and weekday:"
+  };
+
+  for(int table = 0; table < 3; ++table) {
+    cout << "\n" << titles[table] << "\n\nHour";
+    for(int d = 0; d < 7; ++d)
+      cout << setw(8) << days[d];
+    cout << "\n";
+
+    for(int h = 0; h < 24; ++h) {
+      cout << setw(2) << setfill('0') << h << setfill(' ') << "  ";
+      for(int d = 0; d < 7; ++d) {
+        const struct drain_cell *c = &drain.cell[d][h];
+        stringstream ss;
+        if(table == 0) {
+          if(c->seconds)
+            ss << fixed << setprecision(1)
+               << (c->mwh / (c->seconds / 3600.0)) / 1000;
+          else
+            ss << "-";
+        }
+        else if(table == 1)
+          ss << (c->seconds / 60);
+        else
+          ss << c->plugins;
+        cout << setw(8) << ss.str();
+      }
+      cout << "\n";
+    }
+  }
+
+  DWORD total_seconds = 0, total_plugins = 0;
+  double total_mwh = 0;
+  for(int d = 0; d < 7; ++d) {
+    for(int h = 0; h < 24; ++h) {
+      total_seconds += drain.cell[d][h].seconds;
+      total_mwh += drain.cell[d][h].mwh;
+      total_plugins += drain.cell[d][h].plugins;
+    }
+  }
+
+  cout << "\n" << left << setw(BATT_FIELD_WIDTH) << "On battery: " << right
+       << BatteryLifeTimeStr(total_seconds) << "\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Drained: " << right
+       << fixed << setprecision(0) << total_mwh << " mWh\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Plugged in: " << right
+       << total_plugins << " times\n" << flush;
+  return 0;
+}
+
+/* Trace record and replay (options --record and --replay).
+
+--record <file> appends to <file> each poll whose power status or rate
+changed, and each power broadcast, one record per line with tab separated
+fields:
+
+S <time> <tick> <ac> <flag> <percent> <saver> <lifetime> <full_lifetime> <rate>
+E <time> <tick> <event>
+
+<time> is the Unix time in seconds and <tick> is GetTickCount. The status
+fields are SYSTEM_POWER_STATUS members as numbers, <rate> is in mW (negative
+when discharging) and <event> is the WM_POWERBROADCAST wParam. The first line
+is TRACE_HEADER and the commit offset: " commit=" and TRACE_COMMIT_DIGITS
+digits, the size of the file up to the end of the last complete record.
+
+A trace can be read while it's being recorded, by --replay, --compare or any
+other process, without a lock that could slow down the monitor: each record is
+appended with a single write and only then is the commit offset rewritten in
+place. The reader maps the file rather than copying it and parses only up to
+the commit offset, clamped to the size it mapped and moved back to the end of
+the last complete line. The offset can be read while it's being rewritten, a
+mix of old and new digits, and the clamp and the walk back are what keep such
+a read within complete records, see TraceReadCommit. If the monitor was killed
+in the middle of a write then the next --record overwrites the torn record.
+--record refuses a file that isn't empty and doesn't start with the header, so
+it never appends to or truncates something that isn't a trace.
+
+--trace-benchmark <time> stresses that: one thread appends samples to a
+temporary trace as fast as it can, alone for the first half of <time> and
+with TRACE_BENCHMARK_READERS threads loading the trace over and over for the
+second half. Each reader checks that the samples it loaded are consecutive and
+intact. It shows the write rate and the slowest write of each half, and it's
+an error if any reader saw a torn sample.
+
+--replay <file> runs a recorded trace through the per-poll pipeline of the
+monitor as fast as it can: the sensor profile, the average lifetime (-a), the
+hysteresis compare, the revival detection, the rate leases (which schedule
+polls, though only --soak asks for any), the line format and the output, which
+is discarded. The options given apply as usual, so a replay measures the
+configuration it's run with. --replay synthetic:<n> replays a generated trace
+of <n> one second polls of discharge and charge cycles with suspends, the same
+every time, so that it doesn't need a large file.
+
+The trace is run REPLAY_RUNS times and the fastest run is shown: the samples
+per second, the nanoseconds per sample for each phase (from every
+REPLAY_TIMING_STRIDE sample, so that timing doesn't slow down the rest) and
+the allocations per sample. It also shows the wakeups the monitor would have
+had over the trace (its polls as the sensor profile schedules them, see
+SensorPollDelay, and the power broadcasts) and the CPU time of the run, each
+per hour of the trace, so that --align-polls can be compared over a simulated
+day, for example synthetic:86400, without running the monitor for one. The
+compare is the main loop's StatusLineChanged.
+The samples per second are compared with the baseline saved for the trace
+name and the options that apply to the replay (-a, --hysteresis and
+--line-format), and if they're more than --replay-threshold (default 10%)
+lower it's an error, so a regression fails a script that runs it. The first
+replay of a trace saves its baseline, and --replay-save replaces it.
+*/
+#define TRACE_HEADER "# battstatus trace 1"
+#define TRACE_COMMIT " commit="
+#define TRACE_COMMIT_DIGITS 20
+#define TRACE_COMMIT_OFFSET (sizeof TRACE_HEADER TRACE_COMMIT - 1)
+#define TRACE_HEADER_SIZE (TRACE_COMMIT_OFFSET + TRACE_COMMIT_DIGITS + 1)
+#define TRACE_LINE_MAX 160
+#define TRACE_BENCHMARK_READERS 4
+#define REPLAY_STATE_FILE "replay.txt"
+#define REPLAY_TIMING_STRIDE 64
+#define REPLAY_RUNS 5
+
+struct trace_record {
+  char type;                   // 'S' for a status sample or 'E' for an event
+  time_t time;
+  DWORD tick;
+  SYSTEM_POWER_STATUS status;  // 'S' only
+  LONG rate_mw;                // 'S' only
+  DWORD event;                 // 'E' only, the WM_POWERBROADCAST wParam
+};
+
+struct trace_writer {
+  HANDLE file;
+  ULONGLONG size;              // where the next record is written
+  bool any;                    // if a sample has been written
+  SYSTEM_POWER_STATUS status;  // the last sample written
+  LONG rate_mw;
+  unsigned long records;
+} tracew = { INVALID_HANDLE_VALUE };
+
+/* Count the allocations made with new and the blocks freed, for --replay and
+   --soak. This replaces the global operator new and delete, which the
+   containers and strings use. */
+volatile LONG alloc_count;
+volatile LONG free_count;
+
+void *operator new(size_t size)
+{
+  InterlockedIncrement(&alloc_count);
+  void *p = malloc(size ? size : 1);
+  if(!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) throw()
+{
+  if(p)
+    InterlockedIncrement(&free_count);
+  free(p);
+}
+
+/* Format a commit offset as TRACE_COMMIT_DIGITS digits, not terminated. */
+void TraceCommitDigits(ULONGLONG offset, char *digits)
+{
+  for(int i = TRACE_COMMIT_DIGITS - 1; i >= 0; --i) {
+    digits[i] = (char)('0' + (offset % 10));
+    offset /= 10;
+  }
+}
+
+/* Parse the commit offset from the start of a trace. Return false if the
+   trace doesn't have one. */
+bool TraceCommitOffset(const char *data, size_t size, ULONGLONG *offset)
+{
+  if(size < TRACE_HEADER_SIZE ||
+     memcmp(data, TRACE_HEADER TRACE_COMMIT, TRACE_COMMIT_OFFSET) ||
+     data[TRACE_HEADER_SIZE - 1] != '\n')
+    return false;
+  *offset = 0;
+  for(size_t i = TRACE_COMMIT_OFFSET; i < TRACE_HEADER_SIZE - 1; ++i) {
+    char c = ((volatile const char *)data)[i];
+    if(!('0' <= c && c <= '9'))
+      return false;
+    *offset = (*offset * 10) + (c - '0');
+  }
+  return true;
+}
+
+/* Write 'len' bytes at 'offset' of the trace. */
+bool TraceWriteAt(ULONGLONG offset, const char *data, DWORD len)
+{
+  OVERLAPPED ov = OVERLAPPED();
+  ov.Offset = (DWORD)offset;
+  ov.OffsetHigh = (DWORD)(offset >> 32);
+  DWORD written;
+  return WriteFile(tracew.file, data, len, &written, &ov) && written == len;
+}
+
+/* Append a record and then publish it by rewriting the commit offset. */
+void TraceWrite(const char *line, int len)
+{
+  bool ok = TraceWriteAt(tracew.size, line, (DWORD)len);
+  if(ok) {
+    tracew.size += len;
+    char digits[TRACE_COMMIT_DIGITS];
+    TraceCommitDigits(tracew.size, digits);
+    ok = TraceWriteAt(TRACE_COMMIT_OFFSET, digits, TRACE_COMMIT_DIGITS);
+  }
+  if(!ok) {
+    DWORD gle = GetLastError();
+    cerr << "Error: Failed to write to the trace, error " << gle
+         << ". Recording stopped." << endl;
+    CloseHandle(tracew.file);
+    tracew.file = INVALID_HANDLE_VALUE;
+    return;
+  }
+  ++tracew.records;
+}
+
+bool TraceOpen(const char *path)
+{
+  tracew.file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                            OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  LARGE_INTEGER size;
+  if(tracew.file == INVALID_HANDLE_VALUE ||
+     !GetFileSizeEx(tracew.file, &size)) {
+    DWORD gle = GetLastError();
+    cerr << "Error: Failed to open trace file " << path << ", error " << gle
+         << "." << endl;
+    return false;
+  }
+  tracew.size = (ULONGLONG)size.QuadPart;
+
+  if(!tracew.size) {
+    char header[TRACE_HEADER_SIZE];
+    memcpy(header, TRACE_HEADER TRACE_COMMIT, TRACE_COMMIT_OFFSET);
+    TraceCommitDigits(TRACE_HEADER_SIZE, header + TRACE_COMMIT_OFFSET);
+    header[TRACE_HEADER_SIZE - 1] = '\n';
+    TraceWrite(header, (int)TRACE_HEADER_SIZE);
+    return tracew.file != INVALID_HANDLE_VALUE;
+  }
+
+  /* Continue after the last committed record, which overwrites a record that
+     was torn when the monitor was killed. Anything else is left alone. */
+  char header[TRACE_HEADER_SIZE];
+  DWORD read;
+  ULONGLONG commit;
+  if(!ReadFile(tracew.file, header, sizeof header, &read, NULL) ||
+     !TraceCommitOffset(header, read, &commit) ||
+     commit < TRACE_HEADER_SIZE || commit > tracew.size) {
+    cerr << "Error: " << path << " isn't a battstatus trace, not recording "
+         << "to it." << endl;
+    CloseHandle(tracew.file);
+    tracew.file = INVALID_HANDLE_VALUE;
+    return false;
+  }
+  tracew.size = commit;
+
+  LARGE_INTEGER end;
+  end.QuadPart = (LONGLONG)commit;
+  if(SetFilePointerEx(tracew.file, end, NULL, FILE_BEGIN))
+    SetEndOfFile(tracew.file);  // fails harmlessly while a reader maps it
+  return true;
+}
+
+/* Format a sample record into 'line', which is at least TRACE_LINE_MAX bytes.
+   Return its length. */
+int TraceSampleLine(char *line, time_t when, DWORD tick,
+                    const SYSTEM_POWER_STATUS *status, LONG rate_mw)
+{
+  return sprintf(line, "S\t%lu\t%lu\t%u\t%u\t%u\t%u\t%lu\t%lu\t%ld\n",
+                 (unsigned long)when, (unsigned long)tick,
+                 (unsigned)status->ACLineStatus,
+                 (unsigned)status->BatteryFlag,
+                 (unsigned)status->BatteryLifePercent,
+                 (unsigned)status->SystemStatusFlag,
+                 (unsigned long)status->BatteryLifeTime,
+                 (unsigned long)status->BatteryFullLifeTime,
+                 (long)rate_mw);
+}
+
+/* Record a poll if the power status or rate changed. */
+void TraceSample(const SYSTEM_POWER_STATUS *status, LONG rate_mw)
+{
+  if(tracew.file == INVALID_HANDLE_VALUE ||
+     (tracew.any && rate_mw == tracew.rate_mw &&
+      !memcmp(&tracew.status, status, sizeof *status)))
+    return;
+  tracew.any = true;
+  tracew.status = *status;
+  tracew.rate_mw = rate_mw;
+
+  char line[TRACE_LINE_MAX];
+  TraceWrite(line, TraceSampleLine(line, time(NULL), GetTickCount(), status,
+                                   rate_mw));
+}
+
+/* Record a power broadcast. */
+void TraceEvent(WPARAM event)
+{
+  if(tracew.file == INVALID_HANDLE_VALUE)
+    return;
+
+  char line[64];
+  int len = sprintf(line, "E\t%lu\t%lu\t%lu\n", (unsigned long)time(NULL),
+                    (unsigned long)GetTickCount(), (unsigned long)event);
+  TraceWrite(line, len);
+}
+
+/* Parse the tab separated unsigned or signed numbers of a trace line.
+   Return how many were parsed. */
+int TraceParseFields(const char *p, const char *end, long long *fields,
+                     int max)
+{
+  int n = 0;
+  while(n < max && p < end && *p == '\t') {
+    ++p;
+    bool negative = (p < end && *p == '-');
+    if(negative)
+      ++p;
+    if(p >= end || !('0' <= *p && *p <= '9'))
+      break;
+    long long value = 0;
+    for(; p < end && '0' <= *p && *p <= '9'; ++p)
+      value = (value * 10) + (*p - '0');
+    fields[n++] = negative ? -value : value;
+  }
+  return (p == end) ? n : -1;
+}
+
+/* Parse a trace line, without its newline, into 'r'. Return false if it's not
+   a record. */
+bool TraceParseLine(const char *line, const char *end, struct trace_record *r)
+{
+  if(end > line && end[-1] == '\r')
+    --end;
+
+  long long f[9];
+  int n = (line < end) ? TraceParseFields(line + 1, end, f, 9) : -1;
+  *r = trace_record();
+  r->type = (line < end) ? *line : '\0';
+  if(r->type == 'S' && n == 9) {
+    r->status.ACLineStatus = (BYTE)f[2];
+    r->status.BatteryFlag = (BYTE)f[3];
+    r->status.BatteryLifePercent = (BYTE)f[4];
+    r->status.SystemStatusFlag = (BYTE)f[5];
+    r->status.BatteryLifeTime = (DWORD)f[6];
+    r->status.BatteryFullLifeTime = (DWORD)f[7];
+    r->rate_mw = (LONG)f[8];
+  }
+  else if(r->type == 'E' && n == 3)
+    r->event = (DWORD)f[2];
+  else
+    return false;
+  r->time = (time_t)f[0];
+  r->tick = (DWORD)f[1];
+  return true;
+}
+
+/* A pass over a trace by TraceScan. Before the first record is passed to
+   'proc' the times of the first and last records are set, so that a pass
+   can plan for the whole trace. */
+struct trace_scan {
+  void (*proc)(const struct trace_record *r, struct trace_scan *scan);
+  void *data;
+  time_t first;
+  time_t last;
+  unsigned long invalid;  // lines that aren't records
+};
+
+void TraceUnmap(const char *data, HANDLE mapping)
+{
+  UnmapViewOfFile(data);
+  CloseHandle(mapping);
+}
+
+/* Open a trace file, which may be being recorded, for mapping and set 'size'
+   to its size. Return the mapping, or NULL if the file can't be mapped. */
+HANDLE TraceOpenMapping(const string &path, ULONGLONG *size)
+{
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE |
+                            FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, NULL);
+  if(file == INVALID_HANDLE_VALUE)
+    return NULL;
+
+  LARGE_INTEGER file_size;
+  HANDLE mapping = NULL;
+  if(GetFileSizeEx(file, &file_size) && file_size.QuadPart) {
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    *size = (ULONGLONG)file_size.QuadPart;
+  }
+  CloseHandle(file);
+  return mapping;
+}
+
+/* Return the commit offset of a trace of 'size' bytes whose start is mapped at
+   'head', at most 'size', or 'size' if the header has no offset. The writer
+   may rewrite the digits while they're read, so a read can mix old and new
+   ones. Reading until two reads agree makes that less likely but doesn't rule
+   it out. What makes the result safe is the clamp to 'size', the part that was
+   mapped, and the caller parsing only the complete lines before it. */
+ULONGLONG TraceReadCommit(const char *head, size_t head_len, ULONGLONG size)
+{
+  ULONGLONG commit, again;
+  for(;;) {
+    if(!TraceCommitOffset(head, head_len, &commit))
+      return size;
+    MemoryBarrier();
+    if(TraceCommitOffset(head, head_len, &again) && commit == again)
+      break;
+  }
+  return commit < size ? commit : size;
+}
+
+/* Map a trace file, which may be being recorded, and set 'committed' to the
+   end of its last committed record. Return the view, or NULL if the file
+   can't be mapped or isn't a trace. Unmap it with TraceUnmap. */
+const char *TraceMap(const string &path, HANDLE *mapping, size_t *committed)
+{
+  ULONGLONG file_size;
+  const char *data = NULL;
+  *mapping = TraceOpenMapping(path, &file_size);
+  if(*mapping && file_size <= (SIZE_T)-1)
+    data = (const char *)MapViewOfFile(*mapping, FILE_MAP_READ, 0, 0, 0);
+  if(!data) {
+    if(*mapping)
+      CloseHandle(*mapping);
+    return NULL;
+  }
+
+  size_t size = (size_t)file_size;
+  if(size < sizeof TRACE_HEADER - 1 ||
+     memcmp(data, TRACE_HEADER, sizeof TRACE_HEADER - 1)) {
+    TraceUnmap(data, *mapping);
+    return NULL;
+  }
+
+  // parse up to the commit offset, back to the end of the last complete line,
+  // which also bounds an offset that was read while it was being rewritten
+  size_t commit = (size_t)TraceReadCommit(data, size, size);
+  while(commit && data[commit - 1] != '\n')
+    --commit;
+  *committed = (size_t)commit;
+  return data;
+}
+
+/* Pass each record of a trace file, which may be being recorded, up to its
+   last committed record to scan->proc. Return false if the file can't be
+   read or isn't a trace. */
+bool TraceScan(const string &path, struct trace_scan *scan)
+{
+  HANDLE mapping;
+  size_t committed;
+  const char *data = TraceMap(path, &mapping, &committed);
+  if(!data)
+    return false;
+
+  const char *data_end = data + committed;
+  struct trace_record r;
+
+  // the last record, found from the end
+  scan->first = scan->last = 0;
+  for(const char *end = data_end - 1; end > data;) {
+    const char *line = end;
+    while(line > data && line[-1] != '\n')
+      --line;
+    if(TraceParseLine(line, end, &r)) {
+      scan->last = r.time;
+      break;
+    }
+    end = line - 1;
+  }
+
+  bool first = true;
+  for(const char *p = data; p < data_end;) {
+    const char *end = (const char *)memchr(p, '\n', data_end - p);
+    if(!end)
+      end = data_end;
+    const char *line = p;
+    p = end + 1;
+
+    if(!TraceParseLine(line, end, &r)) {
+      if(*line != '#')
+        ++scan->invalid;
+      continue;
+    }
+    if(first) {
+      scan->first = r.time;
+      first = false;
+    }
+    scan->proc(&r, scan);
+  }
+
+  TraceUnmap(data, mapping);
+  return true;
+}
+
+void TraceLoadProc(const struct trace_record *r, struct trace_scan *scan)
+{
+  ((vector<trace_record> *)scan->data)->push_back(*r);
+}
+
+/* Load a trace file, which may be being recorded, up to its last committed
+   record. Lines that aren't records are skipped and counted in 'invalid' if
+   it's not NULL. Return false if the file can't be read or isn't a trace. */
+bool TraceLoad(const string &path, vector<trace_record> *records,
+               unsigned long *invalid = NULL)
+{
+  struct trace_scan scan = { TraceLoadProc, records, 0, 0, 0 };
+  bool ok = TraceScan(path, &scan);
+  if(invalid)
+    *invalid += scan.invalid;
+  return ok;
+}
+
+/* The state of a synthetic trace, so that it can be generated a part at a
+   time. */
+struct synthetic_trace {
+  DWORD seed;
+  unsigned long i;         // polls so far
+  struct trace_record r;   // the next poll
+};
+
+/* Start a synthetic trace whose first poll is at tick 'tick'. */
+void TraceSyntheticInit(struct synthetic_trace *st, DWORD tick)
+{
+  *st = synthetic_trace();
+  st->seed = 1;
+  st->r.type = 'S';
+  st->r.time = 1500000000;
+  st->r.tick = tick;
+  st->r.status.ACLineStatus = 0;
+  st->r.status.BatteryLifePercent = 100;
+  st->r.status.BatteryFullLifeTime = LIFETIME_UNKNOWN;
+}
+
+/* Append the next 'n' one second polls of a synthetic trace: discharge from
+   100% to 10% at a varying rate, charge back to 100%, and a one hour suspend
+   every 20000 polls. It uses its own random number generator so it's the
+   same every time. */
+void TraceSyntheticNext(struct synthetic_trace *st, unsigned long n,
+                        vector<trace_record> *records)
+{
+  DWORD &seed = st->seed;
+  struct trace_record &r = st->r;
+  unsigned long &i = st->i;
+
+  for(unsigned long end = i + n; i < end; ++i) {
+    seed = (seed * 1103515245) + 12345;
+    DWORD random = (seed >> 16) & 0x7FFF;
+    BYTE &percent = r.status.BatteryLifePercent;
+    bool charging = (r.status.ACLineStatus == 1);
+
+    if(charging) {
+      if(!(i % 60) && percent < 100)
+        ++percent;
+      r.rate_mw = (percent < 80) ? 45000 : 45000 - ((percent - 80) * 2000);
+      if(percent == 100)
+        r.status.ACLineStatus = 0;
+    }
+    else {
+      if(!(i % 300) && percent > 10)
+        --percent;
+      r.rate_mw = -(LONG)(8000 + (random % 4000));
+      if(percent == 10)
+        r.status.ACLineStatus = 1;
+    }
+    r.status.BatteryFlag = (BYTE)((percent > 66 ? 1 : percent < 5 ? 4 :
+                                   percent < 33 ? 2 : 0) |
+                                  (charging ? 8 : 0));
+    // a 50 Wh battery
+    r.status.BatteryLifeTime = charging ? LIFETIME_UNKNOWN :
+                               (DWORD)(percent * 500 * 3600 / -r.rate_mw);
+    r.status.SystemStatusFlag = (!charging && percent <= 20);
+
+    if(i && !(i % 20000)) {
+      struct trace_record e = r;
+      e.type = 'E';
+      e.event = PBT_APMSUSPEND;
+      records->push_back(e);
+      e.time += 3600;
+      e.tick += 3600 * 1000;
+      e.event = PBT_APMRESUMEAUTOMATIC;
+      records->push_back(e);
+      r.time = e.time;
+      r.tick = e.tick;
+    }
+    if(charging != (r.status.ACLineStatus == 1)) {
+      struct trace_record e = r;
+      e.type = 'E';
+      e.event = PBT_APMPOWERSTATUSCHANGE;
+      records->push_back(e);
+    }
+
+    records->push_back(r);
+    r.time += 1;
+    r.tick += 1000;
+  }
+}
+
+/* Generate a synthetic trace of 'n' polls, see TraceSyntheticNext. */
+void TraceSynthetic(unsigned long n, vector<trace_record> *records)
+{
+  struct synthetic_trace st;
+  TraceSyntheticInit(&st, 1000000);
+  TraceSyntheticNext(&st, n, records);
+}
+
+struct trace_benchmark {
+  string path;
+  volatile LONG stop;
+  volatile LONG loads;
+  volatile LONG failed;  // loads that failed
+  volatile LONG torn;    // loads that saw a torn sample
+};
+
+/* The rate of benchmark sample 'tick', so that a reader can tell a truncated
+   rate from a complete one. */
+LONG TraceBenchmarkRate(DWORD tick)
+{
+  return -(LONG)(1000000 + (tick % 1000000));
+}
+
+DWORD WINAPI TraceBenchmarkReader(LPVOID param)
+{
+  struct trace_benchmark *tb = (struct trace_benchmark *)param;
+  vector<trace_record> records;
+
+  while(!tb->stop) {
+    unsigned long invalid = 0;
+    records.clear();
+    if(!TraceLoad(tb->path, &records, &invalid)) {
+      InterlockedIncrement(&tb->failed);
+      continue;
+    }
+    for(size_t i = 0; i < records.size() && !invalid; ++i) {
+      if(records[i].tick != i ||
+         records[i].rate_mw != TraceBenchmarkRate(records[i].tick))
+        invalid = 1;
+    }
+    if(invalid)
+      InterlockedIncrement(&tb->torn);
+    InterlockedIncrement(&tb->loads);
+  }
+  return 0;
+}
+
+/* Append to a temporary trace as fast as possible for 'seconds', with
+   readers for the second half, and show the write rates. */
+int TraceBenchmark(DWORD seconds)
+{
+  struct trace_benchmark tb;
+  char dir[MAX_PATH + 1];
+  DWORD len = GetTempPathA(sizeof dir, dir);
+  if(!len || len >= sizeof dir) {
+    cerr << "Error: Failed to get the temporary directory." << endl;
+    return 1;
+  }
+  tb.path = string(dir) + "battstatus-trace-benchmark.txt";
+  tb.stop = tb.loads = tb.failed = tb.torn = 0;
+  DeleteFileA(tb.path.c_str());
+  if(!TraceOpen(tb.path.c_str()))
+    return 1;
+
+  LARGE_INTEGER freq, start, now, prev;
+  QueryPerformanceFrequency(&freq);
+
+  SYSTEM_POWER_STATUS status = SYSTEM_POWER_STATUS();
+  status.BatteryLifePercent = 50;
+  status.BatteryLifeTime = 3600;
+  status.BatteryFullLifeTime = LIFETIME_UNKNOWN;
+
+  DWORD tick = 0;
+  unsigned long writes[2] = { 0, 0 };
+  LONGLONG slowest[2] = { 0, 0 };
+  double elapsed[2];
+  vector<HANDLE> readers;
+
+  for(int half = 0; half < 2; ++half) {
+    if(half) {
+      for(int i = 0; i < TRACE_BENCHMARK_READERS; ++i) {
+        HANDLE thread = CreateThread(NULL, 0, TraceBenchmarkReader, &tb, 0,
+                                     NULL);
+        if(thread)
+          readers.push_back(thread);
+      }
+    }
+
+    QueryPerformanceCounter(&start);
+    prev = start;
+    do {
+      char line[TRACE_LINE_MAX];
+      TraceWrite(line, TraceSampleLine(line, 1500000000, tick, &status,
+                                       TraceBenchmarkRate(tick)));
+      if(tracew.file == INVALID_HANDLE_VALUE)
+        return 1;
+      ++tick;
+      ++writes[half];
+      QueryPerformanceCounter(&now);
+      if((now.QuadPart - prev.QuadPart) > slowest[half])
+        slowest[half] = now.QuadPart - prev.QuadPart;
+      prev = now;
+    } while((now.QuadPart - start.QuadPart) <
+            (LONGLONG)seconds * freq.QuadPart / 2);
+    elapsed[half] = (double)(now.QuadPart - start.QuadPart) / freq.QuadPart;
+  }
+
+  tb.stop = 1;
+  if(readers.size()) {
+    WaitForMultipleObjects((DWORD)readers.size(), &readers[0], TRUE,
+                           INFINITE);
+    for(size_t i = 0; i < readers.size(); ++i)
+      CloseHandle(readers[i]);
+  }
+  CloseHandle(tracew.file);
+  tracew.file = INVALID_HANDLE_VALUE;
+
+  // the complete trace must have every sample
+  vector<trace_record> records;
+  unsigned long invalid = 0;
+  if(!TraceLoad(tb.path, &records, &invalid) || invalid ||
+     records.size() != tick)
+    ++tb.torn;
+  DeleteFileA(tb.path.c_str());
+
+  cerr << fixed << setprecision(1);
+  for(int half = 0; half < 2; ++half) {
+    cerr << left << setw(BATT_FIELD_WIDTH)
+         << (half ? "Writes with readers: " : "Writes alone: ") << right
+         << (writes[half] / elapsed[half]) << " per second (slowest "
+         << setprecision(3) << ((slowest[half] * 1000.0) / freq.QuadPart)
+         << " ms)\n" << setprecision(1);
+  }
+  cerr << left << setw(BATT_FIELD_WIDTH) << "Readers: " << right
+       << readers.size() << " (" << tb.loads << " loads, " << tb.failed
+       << " failed)\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Torn samples seen: " << right
+       << tb.torn << endl;
+
+  if(tb.torn) {
+    cerr << "Error: A reader saw a torn sample." << endl;
+    return 1;
+  }
+  return 0;
+}
+
+/* A streambuf that discards the output, so a replay doesn't measure the
+   console. */
+class NullBuf : public streambuf
+{
+protected:
+  int overflow(int c) { return c; }
+  streamsize xsputn(const char *, streamsize n) { return n; }
+};
+
+enum replay_phase {
+  REPLAY_SENSOR,
+  REPLAY_AVERAGE,
+  REPLAY_COMPARE,
+  REPLAY_FORMAT,
+  REPLAY_OUTPUT,
+  REPLAY_PHASE_COUNT
+};
+
+const char *replay_phase_names[REPLAY_PHASE_COUNT] = {
+  "sensor", "average", "compare", "format", "output"
+};
+
+struct replay_run {
+  LONGLONG elapsed;  // in performance counter ticks
+  ULONGLONG cpu_ms;
+  unsigned long samples, events, timed, lines;
+  unsigned long wakeups;  // that the monitor would have had
+  DWORD span_ms;          // of the trace, not counting suspends
+  LONGLONG phase[REPLAY_PHASE_COUNT];
+  LONG allocs;
+};
+
+/* The state the main loop keeps between polls, for the replay of a trace. */
+struct replay_state {
+  deque<lifetime_data> deck;
+  SYSTEM_POWER_STATUS reported, prev;
+  struct revival_state revival;
+  DWORD resume_tick, poll_tick, awake_tick, sample_tick;
+  bool resumed, awake;
+};
+
+/* Start a replay: the sensor profile and the leases are learned from
+   scratch. */
+void ReplayInit(struct replay_state *rs)
+{
+  *rs = replay_state();
+  sensors = sensor_profile();
+  lease = lease_table();
+}
+
+/* Run one record of a trace through the per-poll pipeline and count it in
+   'run'. The output is discarded by the caller. */
+void ReplayStep(struct replay_state *rs, const struct trace_record *r,
+                struct replay_run *run)
+{
+  if(r->type == 'E') {
+    ++run->events;
+    if(r->event == PBT_APMSUSPEND && rs->awake) {
+      run->span_ms += r->tick - rs->awake_tick;
+      rs->awake = false;
+    }
+    if(r->event == PBT_APMRESUMEAUTOMATIC) {
+      rs->resumed = true;
+      rs->resume_tick = r->tick;
+    }
+    return;
+  }
+  if(rs->resumed &&
+     (r->tick - rs->resume_tick) >= (RESUME_SPAN_MINUTES * 60 * 1000))
+    rs->resumed = false;
+
+  /* Count the wakeups the monitor would have had up to this sample: its
+     polls, as the sensor profile and any rate lease schedule them, and a
+     power broadcast for each change in an announced field. None while
+     suspended. */
+  if(!rs->awake) {
+    rs->awake = true;
+    rs->awake_tick = rs->poll_tick = r->tick;
+  }
+  while((LONG)(r->tick - rs->poll_tick) >= 0) {
+    ++run->wakeups;
+    rs->poll_tick += LeasePollDelay(SensorPollDelay(rs->poll_tick),
+                                    rs->poll_tick);
+  }
+  rs->sample_tick = r->tick;
+  if(r->status.ACLineStatus != rs->prev.ACLineStatus ||
+     r->status.BatteryFlag != rs->prev.BatteryFlag ||
+     r->status.BatteryLifePercent != rs->prev.BatteryLifePercent)
+    ++run->wakeups;
+
+  bool timing = !(run->samples++ % REPLAY_TIMING_STRIDE);
+  LARGE_INTEGER t[REPLAY_PHASE_COUNT + 1];
+#define REPLAY_MARK(i) if(timing) QueryPerformanceCounter(&t[i])
+
+  REPLAY_MARK(REPLAY_SENSOR);
+  SensorSample(&r->status, r->tick, NULL);
+
+  REPLAY_MARK(REPLAY_AVERAGE);
+  DWORD average_lifetime = lifetime_span_minutes ?
+    AverageLifetime(&rs->deck, r->status.BatteryLifeTime, r->tick,
+                    rs->resumed) :
+    LIFETIME_UNKNOWN;
+
+  // as in the main loop, a revival's charge state is ignored unless verbose
+  REPLAY_MARK(REPLAY_COMPARE);
+  bool reviving = RevivalUpdate(&rs->revival,
+                                CHARGING(r->status) != CHARGING(rs->prev),
+                                r->tick);
+  bool show = StatusLineChanged(&r->status, &rs->reported, &rs->prev,
+                                reviving && !verbose);
+  rs->prev = r->status;
+
+  REPLAY_MARK(REPLAY_FORMAT);
+  char line[LINE_FORMAT_MAX];
+  if(show) {
+    rs->reported = r->status;
+    struct line_values lv;
+    lv.status = &r->status;
+    lv.average_lifetime = average_lifetime;
+    lv.rate = r->rate_mw;
+    lv.state = LineState(&r->status, lv.rate);
+    RenderLineFormat(&line_format, &lv, line, sizeof line);
+  }
+
+  REPLAY_MARK(REPLAY_OUTPUT);
+  if(show) {
+    cout << TIMESTAMPED_PREFIX << line << endl;
+    ++run->lines;
+  }
+
+  REPLAY_MARK(REPLAY_PHASE_COUNT);
+#undef REPLAY_MARK
+  if(timing) {
+    ++run->timed;
+    for(int p = 0; p < REPLAY_PHASE_COUNT; ++p)
+      run->phase[p] += t[p + 1].QuadPart - t[p].QuadPart;
+  }
+}
+
+/* Run the trace through the per-poll pipeline once. The output is discarded
+   by the caller. */
+void ReplayRun(const vector<trace_record> &trace, struct replay_run *run)
+{
+  LARGE_INTEGER start, now;
+  struct replay_state rs;
+
+  *run = replay_run();
+  ReplayInit(&rs);
+  LONG allocs = alloc_count;
+  ULONGLONG cpu_ms = 0;
+  GetProcessCpuTime(&cpu_ms);
+
+  QueryPerformanceCounter(&start);
+  for(size_t i = 0; i < trace.size(); ++i)
+    ReplayStep(&rs, &trace[i], run);
+  QueryPerformanceCounter(&now);
+  run->elapsed = now.QuadPart - start.QuadPart;
+  run->allocs = alloc_count - allocs;
+  if(GetProcessCpuTime(&run->cpu_ms))
+    run->cpu_ms -= cpu_ms;
+  if(rs.awake)
+    run->span_ms += rs.sample_tick - rs.awake_tick;
+}
+
+int Replay()
+{
+  LARGE_INTEGER freq, start, now;
+  QueryPerformanceFrequency(&freq);
+
+  vector<trace_record> trace;
+  string name = replay_trace;
+  QueryPerformanceCounter(&start);
+  if(!name.compare(0, 10, "synthetic:")) {
+    DWORD n;
+    if(!ParseUnsigned(name.c_str() + 10, &n) || !n) {
+      cerr << "Error: Invalid synthetic trace: " << name << endl;
+      return 1;
+    }
+    trace.reserve(n + (n / 1000));
+    TraceSynthetic(n, &trace);
+  }
+  else {
+    if(!TraceLoad(name, &trace)) {
+      cerr << "Error: Failed to load trace " << name << endl;
+      return 1;
+    }
+    name = name.substr(name.find_last_of("\\/") + 1);
+  }
+  QueryPerformanceCounter(&now);
+  double load_ms = (now.QuadPart - start.QuadPart) * 1000.0 / freq.QuadPart;
+
+  NullBuf null_buf;
+  streambuf *cout_buf = cout.rdbuf(&null_buf);
+
+  /* Other work on the computer can only slow a run down, so the fastest of
+     REPLAY_RUNS is the best estimate of the pipeline's own speed. */
+  struct replay_run best, run;
+  for(int i = 0; i < REPLAY_RUNS; ++i) {
+    ReplayRun(trace, &run);
+    if(!i || run.elapsed < best.elapsed)
+      best = run;
+  }
+  cout.rdbuf(cout_buf);
+
+  if(!best.samples) {
+    cerr << "Error: The trace has no samples." << endl;
+    return 1;
+  }
+
+  double elapsed = (double)best.elapsed / freq.QuadPart;
+  double rate = elapsed > 0 ? best.samples / elapsed : 0;
+
+  cerr << fixed << setprecision(1)
+       << left << setw(BATT_FIELD_WIDTH) << "Trace: " << right
+       << name << " (loaded in " << load_ms << " ms)\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Samples: " << right
+       << best.samples << " (" << rate << " per second, best of "
+       << REPLAY_RUNS << " runs)\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Events: " << right
+       << best.events << "\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Lines: " << right
+       << best.lines << "\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Per sample: " << right
+       << (elapsed * 1e9 / best.samples) << " ns\n";
+  for(int p = 0; p < REPLAY_PHASE_COUNT; ++p) {
+    cerr << left << setw(BATT_FIELD_WIDTH)
+         << (string("  ") + replay_phase_names[p] + ": ") << right
+         << (best.phase[p] * 1e9 / freq.QuadPart / best.timed) << " ns\n";
+  }
+  cerr << left << setw(BATT_FIELD_WIDTH) << "Allocations: " << right
+       << setprecision(2) << ((double)best.allocs / best.samples)
+       << " per sample\n";
+
+  /* The wakeups and CPU time per hour of the trace, to compare the monitor's
+     cost with and without --align-polls without running it for a day. */
+  double hours = best.span_ms / 3600000.0;
+  cerr << left << setw(BATT_FIELD_WIDTH) << "Trace time: " << right
+       << BatteryLifeTimeStr(best.span_ms / 1000) << "\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Wakeups: " << right
+       << best.wakeups;
+  if(hours > 0)
+    cerr << " (" << (unsigned long)(best.wakeups / hours + 0.5)
+         << " per hour)";
+  cerr << "\n"
+       << left << setw(BATT_FIELD_WIDTH) << "CPU time: " << right
+       << best.cpu_ms << " ms";
+  if(hours > 0) {
+    cerr << " (" << setprecision(3) << (best.cpu_ms / hours)
+         << " ms per hour)";
+  }
+  cerr << "\n";
+
+  /* The baseline is per trace and per the options that apply to the
+     replay, since they change what it measures. */
+  stringstream options;
+  options << name << " -a " << lifetime_span_minutes << " --hysteresis "
+          << hysteresis.percent << " --line-format " << line_format.text;
+
+  string key = StateKeyStr(options.str()), value;
+  double baseline = 0;
+  if(!replay_save && LoadStateRecord(REPLAY_STATE_FILE, key, &value))
+    baseline = atof(value.c_str());
+
+  if(baseline <= 0) {
+    stringstream ss;
+    ss << fixed << setprecision(1) << rate;
+    bool saved = SaveStateRecord(REPLAY_STATE_FILE, key, ss.str());
+    cerr << left << setw(BATT_FIELD_WIDTH) << "Baseline: " << right
+         << (saved ? "saved" : "failed to save") << endl;
+    return saved ? 0 : 1;
+  }
+
+  double change = ((rate - baseline) / baseline) * 100;
+  cerr << left << setw(BATT_FIELD_WIDTH) << "Baseline: " << right
+       << setprecision(1) << baseline << " per second ("
+       << (change >= 0 ? "+" : "") << change << "%)" << endl;
+  if(change < -(double)replay_threshold) {
+    cerr << "Error: Throughput regressed by " << -change << "%, more than the "
+         << replay_threshold << "% threshold." << endl;
+    return 1;
+  }
+  return 0;
+}
+
+/* A/B drain comparison (option --compare).
+
+--compare <A> <B> compares the drain of two sets of traces recorded with
+--record, for example before and after a driver update. <A> and <B> are each a
+trace file or a directory of them; files that aren't traces are skipped.
+
+Each trace is split into discharge sessions: runs of samples on battery power
+that end when AC is plugged in, the computer suspends, or there's no record
+for COMPARE_MAX_GAP_SECONDS (battstatus wasn't running). Samples in the resume
+window (RESUME_SPAN_MINUTES after a resume) aren't counted since the drain
+isn't comparable then, and sessions shorter than COMPARE_MIN_SESSION_SECONDS
+are discarded. Each reported rate is held until the next sample, so a session
+is its energy and its duration, and the mean drain of a set is its total energy
+over its total duration.
+
+The sessions rather than the samples are the independent units, so the 95%
+confidence intervals are from a bootstrap over sessions: the sessions of each
+set are resampled with replacement COMPARE_BOOTSTRAP times. The resamples are
+done in chunks of COMPARE_CHUNK, each with its own random number generator
+seeded by the chunk number, by a thread per core. So the result is the same
+however many cores there are. The difference is significant if its interval
+doesn't include 0.
+*/
+#define COMPARE_MAX_GAP_SECONDS (15 * 60)
+#define COMPARE_MIN_SESSION_SECONDS (10 * 60)
+#define COMPARE_MIN_SESSIONS 2
+#define COMPARE_BOOTSTRAP 10000
+#define COMPARE_CHUNK 250
+
+struct drain_session {
+  double seconds;
+  double energy_mws;  // mW seconds drained
+};
+
+struct compare_set {
+  const char *path;
+  unsigned long traces;
+  unsigned long discarded;  // sessions too short or without a rate
+  vector<drain_session> sessions;
+};
+
+/* The bootstrap, shared by the threads. Each chunk writes only its own slice
+   of the results. */
+struct compare_job {
+  const struct compare_set *set[2];
+  volatile LONG next_chunk;
+  vector<double> mean[2];  // resampled mean drain of each set
+  vector<double> diff;     // resampled B - A
+};
+
+/* Split a trace into discharge sessions. */
+void CompareSessions(const vector<trace_record> &trace,
+                     struct compare_set *set)
+{
+  struct drain_session s = { 0, 0 };
+  const struct trace_record *prev = NULL;  // the last sample of the session
+  time_t resume_time = 0;
+  bool resumed = false;
+
+  for(size_t i = 0; i <= trace.size(); ++i) {
+    const struct trace_record *r = (i < trace.size()) ? &trace[i] : NULL;
+    bool end = !r;
+
+    if(r && r->type == 'E') {
+      if(r->event == PBT_APMSUSPEND)
+        end = true;
+      else if(r->event == PBT_APMRESUMEAUTOMATIC) {
+        resumed = true;
+        resume_time = r->time;
+      }
+      else
+        continue;
+    }
+    if(r && r->type == 'S') {
+      if(resumed &&
+         (r->time - resume_time) >= (RESUME_SPAN_MINUTES * 60))
+        resumed = false;
+      if(prev && (r->time - prev->time) > COMPARE_MAX_GAP_SECONDS)
+        end = true;
+      else if(prev && prev->rate_mw < 0) {
+        s.seconds += (double)(r->time - prev->time);
+        s.energy_mws += (double)-prev->rate_mw * (r->time - prev->time);
+      }
+      if(r->status.ACLineStatus != 0 || resumed)
+        end = true;
+    }
+
+    if(end && prev) {
+      if(s.seconds >= COMPARE_MIN_SESSION_SECONDS)
+        set->sessions.push_back(s);
+      else
+        ++set->discarded;
+      s.seconds = s.energy_mws = 0;
+      prev = NULL;
+    }
+
+    if(r && r->type == 'S' && r->status.ACLineStatus == 0 && !resumed)
+      prev = r;
+  }
+}
+
+/* Load the traces of a set from a trace file or a directory of them. */
+bool CompareLoad(struct compare_set *set)
+{
+  string path = set->path;
+  vector<string> files;
+  DWORD attributes = GetFileAttributesA(path.c_str());
+
+  if(attributes == INVALID_FILE_ATTRIBUTES) {
+    cerr << "Error: " << path << " not found." << endl;
+    return false;
+  }
+  if(attributes & FILE_ATTRIBUTE_DIRECTORY) {
+    if(path.size() && path[path.size() - 1] != '\\' &&
+       path[path.size() - 1] != '/')
+      path += '\\';
+    WIN32_FIND_DATAA fd;
+    HANDLE find = FindFirstFileA((path + "*").c_str(), &fd);
+    if(find != INVALID_HANDLE_VALUE) {
+      do {
+        if(!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+          files.push_back(path + fd.cFileName);
+      } while(FindNextFileA(find, &fd));
+      FindClose(find);
+    }
+    sort(files.begin(), files.end());
+  }
+  else
+    files.push_back(path);
+
+  for(size_t i = 0; i < files.size(); ++i) {
+    vector<trace_record> trace;
+    if(!TraceLoad(files[i], &trace))
+      continue;
+    ++set->traces;
+    CompareSessions(trace, set);
+  }
+
+  if(set->sessions.size() < COMPARE_MIN_SESSIONS) {
+    cerr << "Error: " << set->path << " has " << set->sessions.size()
+         << " discharge sessions in " << set->traces << " traces, at least "
+         << COMPARE_MIN_SESSIONS << " are needed." << endl;
+    return false;
+  }
+  return true;
+}
+
+/* The mean drain of the sessions 'index' of 'set', in mW. */
+double CompareMean(const struct compare_set *set, const vector<size_t> &index)
+{
+  double seconds = 0, energy = 0;
+  for(size_t i = 0; i < index.size(); ++i) {
+    seconds += set->sessions[index[i]].seconds;
+    energy += set->sessions[index[i]].energy_mws;
+  }
+  return seconds ? energy / seconds : 0;
+}
+
+DWORD WINAPI CompareThread(LPVOID param)
+{
+  struct compare_job *job = (struct compare_job *)param;
+  const LONG chunks = COMPARE_BOOTSTRAP / COMPARE_CHUNK;
+  vector<size_t> index[2];
+
+  for(LONG chunk; (chunk = InterlockedIncrement(&job->next_chunk) - 1) <
+                  chunks;) {
+    DWORD seed = (DWORD)chunk + 1;
+    for(int i = chunk * COMPARE_CHUNK; i < (chunk + 1) * COMPARE_CHUNK; ++i) {
+      for(int s = 0; s < 2; ++s) {
+        size_t n = job->set[s]->sessions.size();
+        index[s].resize(n);
+        for(size_t k = 0; k < n; ++k) {
+          seed = (seed * 1103515245) + 12345;
+          DWORD high = (seed >> 16) & 0x7FFF;
+          seed = (seed * 1103515245) + 12345;
+          index[s][k] = ((high << 15) | ((seed >> 16) & 0x7FFF)) % n;
+        }
+        job->mean[s][i] = CompareMean(job->set[s], index[s]);
+      }
+      job->diff[i] = job->mean[1][i] - job->mean[0][i];
+    }
+  }
+  return 0;
+}
+
+/* The 95% confidence interval of the resampled values, which are sorted. */
+void CompareInterval(vector<double> &values, double *low, double *high)
+{
+  sort(values.begin(), values.end());
+  *low = values[(size_t)(values.size() * 0.025)];
+  *high = values[(size_t)(values.size() * 0.975) - 1];
+}
+
+int Compare()
+{
+  struct compare_set set[2] = { { compare_path[0], 0, 0 },
+                                { compare_path[1], 0, 0 } };
+  if(!CompareLoad(&set[0]) || !CompareLoad(&set[1]))
+    return 1;
+
+  struct compare_job job;
+  job.set[0] = &set[0];
+  job.set[1] = &set[1];
+  job.next_chunk = 0;
+  job.mean[0].resize(COMPARE_BOOTSTRAP);
+  job.mean[1].resize(COMPARE_BOOTSTRAP);
+  job.diff.resize(COMPARE_BOOTSTRAP);
+
+  // this thread takes chunks too, so the result doesn't depend on the others
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  vector<HANDLE> threads;
+  for(DWORD i = 1; i < si.dwNumberOfProcessors &&
+                   i < (COMPARE_BOOTSTRAP / COMPARE_CHUNK) &&
+                   threads.size() < MAXIMUM_WAIT_OBJECTS; ++i) {
+    HANDLE thread = CreateThread(NULL, 0, CompareThread, &job, 0, NULL);
+    if(!thread)
+      break;
+    threads.push_back(thread);
+  }
+  CompareThread(&job);
+  if(threads.size()) {
+    WaitForMultipleObjects((DWORD)threads.size(), &threads[0], TRUE,
+                           INFINITE);
+    for(size_t i = 0; i < threads.size(); ++i)
+      CloseHandle(threads[i]);
+  }
+
+  double mean[2];
+  cout << fixed << setprecision(0);
+  for(int s = 0; s < 2; ++s) {
+    vector<size_t> all(set[s].sessions.size());
+    double seconds = 0, low, high;
+    for(size_t k = 0; k < all.size(); ++k) {
+      all[k] = k;
+      seconds += set[s].sessions[k].seconds;
+    }
+    mean[s] = CompareMean(&set[s], all);
+    CompareInterval(job.mean[s], &low, &high);
+
+    cout << (s ? "\n" : "") << set[s].path << ":\n"
+         << left << setw(BATT_FIELD_WIDTH) << "  Sessions: " << right
+         << set[s].sessions.size() << " (" << set[s].discarded
+         << " discarded) in " << set[s].traces << " traces\n"
+         << left << setw(BATT_FIELD_WIDTH) << "  On battery: " << right
+         << BatteryLifeTimeStr((DWORD)seconds) << "\n"
+         << left << setw(BATT_FIELD_WIDTH) << "  Mean drain: " << right
+         << mean[s] << " mW (95% CI " << low << " to " << high << " mW)\n";
+  }
+
+  double diff = mean[1] - mean[0], low, high;
+  CompareInterval(job.diff, &low, &high);
+  cout << "\n" << left << setw(BATT_FIELD_WIDTH) << "Difference: " << right
+       << showpos << diff << " mW";
+  if(mean[0])
+    cout << " (" << setprecision(1) << (diff * 100 / mean[0]) << "%)"
+         << setprecision(0);
+  cout << " (95% CI " << low << " to " << high << " mW)\n" << noshowpos;
+
+  cout << left << setw(BATT_FIELD_WIDTH) << "Result: " << right;
+  if(low > 0 || high < 0) {
+    cout << set[1].path << " drains " << (diff > 0 ? "more" : "less")
+         << " than " << set[0].path;
+  }
+  else
+    cout << "No significant difference";
+  cout << "\n" << flush;
+  return 0;
+}
+
+/* Downsampling for plots (option --plot).
+
+A month of polls is millions of points, more than a chart can show, so --plot
+<file> downsamples each series of a trace (the percent and the rate) to at most
+--plot-points points, 1000 by default, that look the same when plotted. The
+points are written as tab separated time and value, each series after a
+"# <series>" line, ready for gnuplot or a spreadsheet. --plot-last <duration>
+plots only the end of the trace.
+
+Both methods split the time range into buckets of equal duration and work in a
+single pass over the trace as it's read, holding at most two buckets:
+
+- Largest-Triangle-Three-Buckets (the default) keeps the first and last points
+  and one point per bucket: the one that makes the largest triangle with the
+  point kept from the previous bucket and the average of the next bucket. So a
+  bucket's point is chosen when the next bucket is complete.
+  https://skemman.is/bitstream/1946/15343/3/SS_MSthesis.pdf
+
+- Min/max envelope (--plot-envelope) keeps the lowest and highest point of
+  each bucket in time order, so every peak and dip is kept exactly. It needs
+  two points per bucket so it has half as many buckets.
+*/
+#define PLOT_MIN_POINTS 4
+
+struct plot_point {
+  double x;  // time
+  double y;
+};
+
+struct downsampler {
+  const char *series;
+  bool envelope;
+  double start, width;  // of the buckets
+  long buckets;
+  long bucket;          // being filled, -1 before the first point
+  bool any;             // if the first point was seen
+  plot_point kept;      // LTTB: the point kept from the previous bucket
+  vector<plot_point> prev, cur;  // LTTB: the previous and current bucket
+  plot_point lo, hi;    // envelope: of the current bucket
+  vector<plot_point> out;
+};
+
+void DownsampleInit(struct downsampler *ds, const char *series, double first,
+                    double last, DWORD points, bool envelope)
+{
+  ds->series = series;
+  ds->envelope = envelope;
+  ds->buckets = envelope ? (long)points / 2 : (long)points - 2;
+  ds->start = first;
+  ds->width = (last - first) / ds->buckets;
+  ds->bucket = -1;
+  ds->any = false;
+  ds->out.reserve(points);
+}
+
+/* LTTB: keep the point of 'bucket' that makes the largest triangle with the
+   point kept before it and 'next'. */
+void DownsampleKeep(struct downsampler *ds, const vector<plot_point> &bucket,
+                    const plot_point &next)
+{
+  double best = -1;
+  size_t keep = 0;
+  for(size_t i = 0; i < bucket.size(); ++i) {
+    double area = fabs((ds->kept.x - next.x) * (bucket[i].y - ds->kept.y) -
+                       (ds->kept.x - bucket[i].x) * (next.y - ds->kept.y));
+    if(area > best) {
+      best = area;
+      keep = i;
+    }
+  }
+  ds->kept = bucket[keep];
+  ds->out.push_back(ds->kept);
+}
+
+plot_point DownsampleAverage(const vector<plot_point> &bucket)
+{
+  plot_point avg = { 0, 0 };
+  for(size_t i = 0; i < bucket.size(); ++i) {
+    avg.x += bucket[i].x;
+    avg.y += bucket[i].y;
+  }
+  avg.x /= bucket.size();
+  avg.y /= bucket.size();
+  return avg;
+}
+
+/* Finish the current bucket. */
+void DownsampleFlush(struct downsampler *ds)
+{
+  if(ds->envelope) {
+    if(ds->bucket < 0)
+      return;
+    bool lo_first = (ds->lo.x <= ds->hi.x);
+    ds->out.push_back(lo_first ? ds->lo : ds->hi);
+    if(ds->lo.x != ds->hi.x || ds->lo.y != ds->hi.y)
+      ds->out.push_back(lo_first ? ds->hi : ds->lo);
+  }
+  else {
+    if(ds->prev.size() && ds->cur.size())
+      DownsampleKeep(ds, ds->prev, DownsampleAverage(ds->cur));
+    ds->prev.swap(ds->cur);
+    ds->cur.clear();
+  }
+}
+
+/* Add the next point, in time order. */
+void DownsampleAdd(struct downsampler *ds, double x, double y)
+{
+  plot_point p = { x, y };
+
+  if(!ds->envelope && !ds->any) {
+    ds->any = true;
+    ds->kept = p;
+    ds->out.push_back(p);
+    return;
+  }
+
+  long bucket = (ds->width > 0) ? (long)((x - ds->start) / ds->width) : 0;
+  if(bucket < 0)
+    bucket = 0;
+  else if(bucket >= ds->buckets)
+    bucket = ds->buckets - 1;
+
+  if(bucket != ds->bucket) {
+    DownsampleFlush(ds);
+    ds->bucket = bucket;
+    ds->lo = ds->hi = p;
+  }
+
+  if(ds->envelope) {
+    if(y < ds->lo.y)
+      ds->lo = p;
+    if(y > ds->hi.y)
+      ds->hi = p;
+  }
+  else
+    ds->cur.push_back(p);
+}
+
+/* Finish after the last point. */
+void DownsampleEnd(struct downsampler *ds)
+{
+  if(ds->envelope) {
+    DownsampleFlush(ds);
+    return;
+  }
+
+  // the last point is kept as is, and is the next of the buckets before it
+  if(ds->cur.empty())
+    return;
+  plot_point last = ds->cur.back();
+  ds->cur.pop_back();
+  if(ds->prev.size())
+    DownsampleKeep(ds, ds->prev, ds->cur.size() ?
+                                 DownsampleAverage(ds->cur) : last);
+  if(ds->cur.size())
+    DownsampleKeep(ds, ds->cur, last);
+  ds->out.push_back(last);
+}
+
+struct plot_job {
+  bool started;
+  time_t from;  // the first time plotted
+  struct downsampler percent;
+  struct downsampler rate;
+};
+
+void PlotProc(const struct trace_record *r, struct trace_scan *scan)
+{
+  struct plot_job *job = (struct plot_job *)scan->data;
+
+  if(!job->started) {
+    job->started = true;
+    job->from = (plot_last && scan->last - scan->first > (time_t)plot_last) ?
+                scan->last - (time_t)plot_last : scan->first;
+    DownsampleInit(&job->percent, "percent", (double)job->from,
+                   (double)scan->last, plot_points, plot_envelope);
+    DownsampleInit(&job->rate, "rate_mw", (double)job->from,
+                   (double)scan->last, plot_points, plot_envelope);
+  }
+
+  if(r->type != 'S' || r->time < job->from)
+    return;
+  if(r->status.BatteryLifePercent <= 100)
+    DownsampleAdd(&job->percent, (double)r->time,
+                  r->status.BatteryLifePercent);
+  DownsampleAdd(&job->rate, (double)r->time, r->rate_mw);
+}
+
+/* Show the downsampled series of a trace. Return 0 on success. */
+int Plot()
+{
+  LARGE_INTEGER freq, start, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&start);
+
+  struct plot_job job;
+  job.started = false;
+
+  struct trace_scan scan = { PlotProc, &job, 0, 0, 0 };
+  if(!TraceScan(plot_trace, &scan)) {
+    cerr << "Error: Failed to load trace " << plot_trace << endl;
+    return 1;
+  }
+  if(!job.started) {
+    cerr << "Error: The trace has no records." << endl;
+    return 1;
+  }
+  DownsampleEnd(&job.percent);
+  DownsampleEnd(&job.rate);
+  QueryPerformanceCounter(&now);
+
+  struct downsampler *series[] = { &job.percent, &job.rate };
+  for(int s = 0; s < 2; ++s) {
+    cout << (s ? "\n" : "") << "# " << series[s]->series << "\n";
+    for(size_t i = 0; i < series[s]->out.size(); ++i) {
+      cout << (long long)series[s]->out[i].x << "\t"
+           << (long long)series[s]->out[i].y << "\n";
+    }
+  }
+  cout << flush;
+
+  if(verbose) {
+    cerr << "Downsampled in " << fixed << setprecision(1)
+         << ((now.QuadPart - start.QuadPart) * 1000.0 / freq.QuadPart)
+         << " ms." << endl;
+  }
+  return 0;
+}
+
+/* Trace shipping (option --ship).
+
+--ship <file> --collector <host>[:<port>] forwards the records of a trace to a
+collector over TCP as they're recorded. The trace is usually being recorded by
+another battstatus with --record; the shipper only reads it, up to its commit
+offset, so the two never wait on each other.
+
+The protocol is lines of text. Once per connection the shipper sends
+"H <key>\n", where <key> identifies the trace (the computer name and the full
+path of the trace). Then for each batch it sends "B <offset> <length>\n"
+followed by <length> bytes: the complete record lines at <offset> in the trace.
+The collector answers "A <offset>\n" once everything before <offset> is
+stored. A batch may arrive again after a reconnect if its acknowledgement was
+lost, and since it has its offset the collector can drop what it already has.
+
+At most one batch of up to SHIP_BATCH_MAX bytes is in flight and it's read
+from the trace when it's sent, so when the collector is slow or unreachable
+the shipper falls behind on disk rather than in memory, however long a laptop
+is offline. Only the header and the batch are mapped, never the whole trace,
+so a trace of any size can be shipped even by a 32-bit build.
+
+The acknowledged offset is saved in state file ship.txt per trace after each
+acknowledgement, with the time and tick of the trace's first record, so a
+restart resumes exactly where it left off. If the trace was replaced (its
+first record differs or it's shorter than the offset) it's shipped from the
+start. When there's nothing new the trace is checked again every
+SHIP_POLL_SECONDS. After a failure, to connect or to read the
+trace (which may not exist yet or may be being replaced), the shipper waits an
+increasing amount of time, up to SHIP_RETRY_MAX_SECONDS, before trying again.
+*/
+#define SHIP_DEFAULT_PORT "5140"
+#define SHIP_STATE_FILE "ship.txt"
+#define SHIP_BATCH_MAX (64 * 1024)
+#define SHIP_HEAD_MAX (TRACE_HEADER_SIZE + TRACE_LINE_MAX)
+#define SHIP_POLL_SECONDS 5
+#define SHIP_TIMEOUT_SECONDS 30
+#define SHIP_RETRY_MAX_SECONDS 300
+
+struct trace_shipper {
+  string key;           // the trace's key in the protocol and state file
+  SOCKET sock;
+  ULONGLONG acked;      // everything before this offset is stored
+  time_t first_time;    // of the trace's first record
+  DWORD first_tick;
+  DWORD retry_seconds;  // how long to wait after the next failure
+  unsigned long batches;
+  ULONGLONG bytes;
+} ship = { "", INVALID_SOCKET };
+
+/* Wait after a failure, longer after each one until a batch is
+   acknowledged. */
+void ShipWait(const char *reason, const char *action)
+{
+  cout << TIMESTAMPED_PREFIX << "Ship: " << reason << ", " << action
+       << " in " << ship.retry_seconds << " seconds." << endl;
+  Sleep(ship.retry_seconds * 1000);
+  ship.retry_seconds *= 2;
+  if(ship.retry_seconds > SHIP_RETRY_MAX_SECONDS)
+    ship.retry_seconds = SHIP_RETRY_MAX_SECONDS;
+}
+
+void ShipDisconnect(const char *reason)
+{
+  if(ship.sock != INVALID_SOCKET) {
+    closesocket(ship.sock);
+    ship.sock = INVALID_SOCKET;
+  }
+  ShipWait(reason, "reconnecting");
+}
+
+bool ShipSend(const char *data, size_t len)
+{
+  while(len) {
+    int n = send(ship.sock, data, (int)min(len, (size_t)INT_MAX), 0);
+    if(n <= 0)
+      return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* Receive a line, without its newline. */
+bool ShipRecvLine(string *line)
+{
+  line->clear();
+  for(;;) {
+    char c;
+    if(recv(ship.sock, &c, 1, 0) != 1)
+      return false;
+    if(c == '\n')
+      return true;
+    if(line->size() >= 64)
+      return false;
+    *line += c;
+  }
+}
+
+bool ShipConnect(const struct sockaddr_storage *addr, int addrlen)
+{
+  ship.sock = socket(addr->ss_family, SOCK_STREAM, IPPROTO_TCP);
+  if(ship.sock == INVALID_SOCKET)
+    return false;
+
+  DWORD timeout = SHIP_TIMEOUT_SECONDS * 1000;
+  setsockopt(ship.sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout,
+             sizeof timeout);
+  setsockopt(ship.sock, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout,
+             sizeof timeout);
+  if(connect(ship.sock, (const struct sockaddr *)addr, addrlen))
+    return false;
+
+  string hello = "H " + ship.key + "\n";
+  return ShipSend(hello.data(), hello.size());
+}
+
+void ShipSaveState()
+{
+  stringstream ss;
+  ss << ship.acked << " " << (long long)ship.first_time << " "
+     << ship.first_tick;
+  SaveStateRecord(SHIP_STATE_FILE, ship.key, ss.str());
+}
+
+/* Ship the trace until killed. Return 1 if it can't start. */
+int Ship()
+{
+  struct sockaddr_storage addr;
+  int addrlen;
+  if(!ResolveHostPort(collector, SHIP_DEFAULT_PORT, "collector", &addr,
+                      &addrlen))
+    return 1;
+
+  char path[MAX_PATH];
+  DWORD len = GetFullPathNameA(ship_trace, sizeof path, path, NULL);
+  if(!len || len >= sizeof path) {
+    cerr << "Error: Invalid trace path " << ship_trace << endl;
+    return 1;
+  }
+  ship.key = StateKeyStr(ComputerNameStr() + ":" + path);
+  ship.retry_seconds = 1;
+
+  string value;
+  if(LoadStateRecord(SHIP_STATE_FILE, ship.key, &value)) {
+    stringstream ss(value);
+    long long first_time;
+    if(ss >> ship.acked >> first_time >> ship.first_tick)
+      ship.first_time = (time_t)first_time;
+    else
+      ship.acked = 0;
+  }
+  cout << TIMESTAMPED_PREFIX << "Ship: Shipping " << path << " to "
+       << collector << " from offset " << ship.acked << "." << endl;
+
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+
+  for(;;) {
+    /* Map the header and the first record, which tell whether the trace was
+       replaced, and then only the batch: the trace may be far larger than
+       the address space. */
+    ULONGLONG size = 0;
+    HANDLE mapping = TraceOpenMapping(path, &size);
+    size_t head_len = (size_t)min(size, (ULONGLONG)SHIP_HEAD_MAX);
+    const char *head = mapping ?
+      (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, head_len) :
+      NULL;
+    if(!head || head_len < sizeof TRACE_HEADER - 1 ||
+       memcmp(head, TRACE_HEADER, sizeof TRACE_HEADER - 1)) {
+      if(head)
+        UnmapViewOfFile(head);
+      if(mapping)
+        CloseHandle(mapping);
+      ShipWait("Failed to read the trace", "trying again");
+      continue;
+    }
+    ULONGLONG committed = TraceReadCommit(head, head_len, size);
+
+    // the records start after the header line
+    size_t head_end = (size_t)min(committed, (ULONGLONG)head_len);
+    const char *nl = (const char *)memchr(head, '\n', head_end);
+    size_t start = nl ? (size_t)(nl - head) + 1 : head_end;
+    struct trace_record first;
+    const char *first_end = (const char *)memchr(head + start, '\n',
+                                                 head_end - start);
+    bool have_first = first_end &&
+                      TraceParseLine(head + start, first_end, &first);
+    UnmapViewOfFile(head);
+
+    if(have_first && (first.time != ship.first_time ||
+                      first.tick != ship.first_tick ||
+                      ship.acked > committed)) {
+      if(ship.acked) {
+        cout << TIMESTAMPED_PREFIX << "Ship: The trace was replaced, "
+             << "shipping it from the start." << endl;
+      }
+      ship.acked = start;
+      ship.first_time = first.time;
+      ship.first_tick = first.tick;
+    }
+
+    ULONGLONG offset = ship.acked, end = committed;
+    if(!have_first || offset >= end) {
+      CloseHandle(mapping);
+      Sleep(SHIP_POLL_SECONDS * 1000);
+      continue;
+    }
+    if(end - offset > SHIP_BATCH_MAX)
+      end = offset + SHIP_BATCH_MAX;
+
+    // a view starts at a multiple of the allocation granularity
+    ULONGLONG base = offset - (offset % si.dwAllocationGranularity);
+    const char *view = (const char *)MapViewOfFile(mapping, FILE_MAP_READ,
+                                                   (DWORD)(base >> 32),
+                                                   (DWORD)base,
+                                                   (SIZE_T)(end - base));
+    CloseHandle(mapping);
+    if(!view) {
+      ShipWait("Failed to read the trace", "trying again");
+      continue;
+    }
+    const char *data = view + (size_t)(offset - base);
+
+    // the batch is complete lines only
+    size_t len = (size_t)(end - offset);
+    while(len && data[len - 1] != '\n')
+      --len;
+    if(!len) {
+      UnmapViewOfFile(view);
+      Sleep(SHIP_POLL_SECONDS * 1000);
+      continue;
+    }
+    end = offset + len;
+
+    if(ship.sock == INVALID_SOCKET) {
+      if(!ShipConnect(&addr, addrlen)) {
+        UnmapViewOfFile(view);
+        ShipDisconnect("Failed to connect to the collector");
+        continue;
+      }
+      if(verbose) {
+        cout << TIMESTAMPED_PREFIX << "Ship: Connected, resuming at offset "
+             << offset << "." << endl;
+      }
+    }
+
+    stringstream ss;
+    ss << "B " << offset << " " << (end - offset) << "\n";
+    bool sent = ShipSend(ss.str().data(), ss.str().size()) &&
+                ShipSend(data, len);
+    UnmapViewOfFile(view);
+
+    string ack;
+    ULONGLONG acked = 0;
+    if(!sent || !ShipRecvLine(&ack) || ack.compare(0, 2, "A ") ||
+       !(stringstream(ack.substr(2)) >> acked) ||
+       acked <= ship.acked || acked > end) {
+      ShipDisconnect(sent ? "No valid acknowledgement from the collector" :
+                     "Failed to send to the collector");
+      continue;
+    }
+
+    ship.bytes += acked - ship.acked;
+    ship.acked = acked;
+    ++ship.batches;
+    ship.retry_seconds = 1;
+    ShipSaveState();
+    if(verbose) {
+      cout << TIMESTAMPED_PREFIX << "Ship: Shipped up to offset " << acked
+           << " (" << ship.batches << " batches, " << ship.bytes
+           << " bytes)." << endl;
+    }
+  }
+}
+
+/* Terminal dashboard (option --tui).
+
+The dashboard shows the current power status, the health of each battery,
+sparklines of the percent and rate over the last hour and the most recent
+events. Anything the monitor would normally write to stdout is captured as an
+event instead.
+
+The screen is double-buffered. Each frame is drawn into the back buffer and
+then only the runs of cells that differ from the front buffer (what's already
+on the screen) are written, and the cursor is moved only if it isn't already
+where the run starts. An idle dashboard writes little more than the seconds of
+its clock, which keeps it cheap over a slow remote connection. VT escape
+sequences are used if the console supports them (Windows 10+) or stdout isn't
+a console, otherwise the console API is used.
+*/
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
+
+#define TUI_HISTORY_MINUTES 60
+#define TUI_EVENTS_MAX 50
+#define TUI_HEALTH_REFRESH_MINUTES 5
+#define TUI_REFRESH_MS 1000
+
+/* Collects the lines written to cout while the dashboard is shown. */
+class TuiEventBuf : public streambuf
+{
+public:
+  deque<string> lines;
+
+protected:
+  int overflow(int c)
+  {
+    if(c == EOF)
+      return 0;
+    if(c == '\n') {
+      if(partial.size()) {
+        if(lines.size() == TUI_EVENTS_MAX)
+          lines.pop_front();
+        lines.push_back(partial);
+        partial.clear();
+      }
+    }
+    else
+      partial += (char)c;
+    return c;
+  }
+
+private:
+  string partial;
+};
+
+struct tui_sample {
+  BYTE percent;
+  LONG rate;
+  LONG rate_lo, rate_hi;  // the min/max envelope of the minute
+};
+
+struct tui_dashboard {
+  HANDLE out;
+  bool vt;             // use VT escape sequences instead of the console API
+  SHORT top;           // console API only: the first row of the window
+  int rows, cols;
+  vector<char> front;  // what's on the screen
+  vector<char> back;   // what should be on the screen after the next flush
+  int cursor;          // VT only: where the cursor is in the grid, or -1
+  string pending;      // VT only: output for the current flush
+  TuiEventBuf events;
+  streambuf *cout_buf;        // cout's original buffer
+  deque<tui_sample> history;  // one sample per minute, the last is current
+  DWORD history_tick;
+  vector<string> health;      // one line per battery slot
+  DWORD health_tick;
+  bool active;
+};
+
+struct tui_dashboard tui;
+
+void TuiWrite(const string &text)
+{
+  DWORD written;
+  if(text.size())
+    WriteFile(tui.out, text.data(), (DWORD)text.size(), &written, NULL);
+}
+
+void TuiRestore()
+{
+  if(!tui.active)
+    return;
+  tui.active = false;
+  if(tui.vt)
+    TuiWrite("\x1b[?25h\x1b[?1049l");
+  cout.rdbuf(tui.cout_buf);
+}
+
+BOOL WINAPI TuiCtrlHandler(DWORD)
+{
+  TuiRestore();
+  return FALSE;  // continue on to the default handler, which exits
+}
+
+bool TuiInit()
+{
+  tui.out = GetStdHandle(STD_OUTPUT_HANDLE);
+
+  DWORD mode;
+  if(!GetConsoleMode(tui.out, &mode))
+    tui.vt = true;
+  else
+    tui.vt = !!SetConsoleMode(tui.out,
+                              mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+
+  // switch to the alternate screen and hide the cursor
+  if(tui.vt)
+    TuiWrite("\x1b[?1049h\x1b[?25l");
+
+  cout << flush;
+  tui.cout_buf = cout.rdbuf(&tui.events);
+  tui.active = true;
+  atexit(TuiRestore);
+  SetConsoleCtrlHandler(TuiCtrlHandler, TRUE);
+  return true;
+}
+
+/* Resize the grid to the size of the window, and if it changed or the window
+   was scrolled clear the screen and force a full redraw. */
+void TuiResize()
+{
+  CONSOLE_SCREEN_BUFFER_INFO csbi;
+  int rows = 24, cols = 80;  // if not a console then assume the usual size
+  SHORT top = tui.top;
+
+  if(GetConsoleScreenBufferInfo(tui.out, &csbi)) {
+    rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+    cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+    top = csbi.srWindow.Top;
+  }
+
+  if(rows == tui.rows && cols == tui.cols && top == tui.top)
+    return;
+
+  tui.top = top;
+  tui.rows = rows;
+  tui.cols = cols;
+  tui.front.assign(rows * cols, ' ');
+  tui.back.assign(rows * cols, ' ');
+  tui.cursor = -1;
+
+  if(tui.vt)
+    TuiWrite("\x1b[H\x1b[2J");
+  else {
+    COORD origin = { 0, tui.top };
+    DWORD written;
+    FillConsoleOutputCharacterA(tui.out, ' ', rows * cols, origin, &written);
+  }
+}
+
+/* Put text in the back buffer, clipped to the grid. */
+void TuiPut(int row, int col, const string &text)
+{
+  if(row < 0 || row >= tui.rows)
+    return;
+  for(size_t i = 0; i < text.size() && (col + (int)i) < tui.cols; ++i) {
+    if((col + (int)i) < 0)
+      continue;  // off the left edge
+    char c = text[i];
+    tui.back[row * tui.cols + col + i] = isprint((BYTE)c) ? c : ' ';
+  }
+}
+
+/* Put a status field in the back buffer in the same style as -v output. */
+void TuiPutField(int row, const string &name, const string &value)
+{
+  stringstream ss;
+  ss << left << setw(BATT_FIELD_WIDTH) << (name + ": ") << right << value;
+  TuiPut(row, 0, ss.str());
+}
+
+void TuiWriteRun(int row, int col, int len)
+{
+  const char *text = &tui.back[row * tui.cols + col];
+
+  if(tui.vt) {
+    if(tui.cursor != (row * tui.cols + col)) {
+      char buf[32];
+      sprintf(buf, "\x1b[%d;%dH", row + 1, col + 1);
+      tui.pending += buf;
+    }
+    tui.pending.append(text, len);
+    /* the cursor doesn't advance past the last column */
+    tui.cursor = (col + len < tui.cols) ? (row * tui.cols + col + len) : -1;
+  }
+  else {
+    COORD pos = { (SHORT)col, (SHORT)(tui.top + row) };
+    DWORD written;
+    WriteConsoleOutputCharacterA(tui.out, text, len, pos, &written);
+  }
+}
+
+/* Write the cells that changed since the last flush. */
+void TuiFlush()
+{
+  for(int row = 0; row < tui.rows; ++row) {
+    char *front = &tui.front[row * tui.cols];
+    char *back = &tui.back[row * tui.cols];
+
+    for(int col = 0; col < tui.cols; ++col) {
+      if(front[col] == back[col])
+        continue;
+
+      /* Extend the run over a few unchanged cells if there's another change
+         after them, since rewriting them is cheaper than a cursor move. */
+      int last = col;
+      for(int i = col + 1; i < tui.cols && (i - last) <= 4; ++i) {
+        if(front[i] != back[i])
+          last = i;
+      }
+
+      TuiWriteRun(row, col, last - col + 1);
+      memcpy(front + col, back + col, last - col + 1);
+      col = last;
+    }
+  }
+
+  if(tui.pending.size()) {
+    TuiWrite(tui.pending);
+    tui.pending.clear();
+  }
+}
+
+/* Map each value between lo and hi to one of the sparkline characters. A
+   value is shown as blank if there was no sample for that minute. */
+string Sparkline(const vector<double> &values, double lo, double hi)
+{
+  const char ramp[] = "_.-:=+*#";
+  const int levels = sizeof ramp - 1;
+  string line(TUI_HISTORY_MINUTES - values.size(), ' ');
+
+  for(size_t i = 0; i < values.size(); ++i) {
+    int level = 0;
+    if(hi > lo)
+      level = (int)(((values[i] - lo) / (hi - lo)) * (levels - 1) + 0.5);
+    if(level < 0)
+      level = 0;
+    else if(level >= levels)
+      level = levels - 1;
+    line += ramp[level];
+  }
+  return line;
+}
+
+void TuiRefreshHealth()
+{
+  vector<battery> batteries;
+  EnumBattInterfaces(EnumBattInterfacesProc, &batteries);
+
+  tui.health.clear();
+  for(DWORD i = 0; i < batteries.size(); ++i) {
+    stringstream ss;
+    ss << "Slot #" << i << ": ";
+    if(batteries[i].tag == BATTERY_TAG_INVALID)
+      ss << "(empty)";
+    else if(!batteries[i].success)
+      ss << "(inaccessible)";
+    else {
+      for(const wchar_t *p = batteries[i].unique_id; p && *p; ++p)
+        ss << (char)((*p >= 0x20 && *p < 0x7F) ? *p : '?');
+      ss << "  " << std::fixed << setprecision(2) << batteries[i].health
+         << "% health, " << CycleCountStr(batteries[i].info.CycleCount)
+         << " cycles";
+    }
+    tui.health.push_back(ss.str());
+  }
+  FreeBatteries(&batteries);
+}
+
+/* Draw the next frame of the dashboard. */
+void TuiUpdate(const SYSTEM_POWER_STATUS *status, DWORD average_lifetime)
+{
+  DWORD now = GetTickCount();
+
+  /* Refresh at least every second, renewed on each poll while it's shown,
+     except while degraded where the dashboard is redrawn only on each of the
+     degraded polls. */
+  static DWORD tui_lease;
+  tui_lease = LeaseRequest(tui_lease, "--tui", TUI_REFRESH_MS,
+                           degr.active ? 0 : TUI_REFRESH_MS * 5, now);
+  LONG rate = GetBatteryPowerRate();
+  tui_sample sample = { status->BatteryLifePercent, rate, rate, rate };
+
+  if(tui.history.empty() || (now - tui.history_tick) >= (60 * 1000)) {
+    if(tui.history.size() == TUI_HISTORY_MINUTES)
+      tui.history.pop_front();
+    tui.history.push_back(sample);
+    tui.history_tick = now;
+  }
+  else {
+    sample.rate_lo = min(rate, tui.history.back().rate_lo);
+    sample.rate_hi = max(rate, tui.history.back().rate_hi);
+    tui.history.back() = sample;
+  }
+
+  if(tui.health.empty() ||
+     (now - tui.health_tick) >= (TUI_HEALTH_REFRESH_MINUTES * 60 * 1000)) {
+    TuiRefreshHealth();
+    tui.health_tick = now;
+  }
+
+  TuiResize();
+  fill(tui.back.begin(), tui.back.end(), ' ');
+
+  int row = 0;
+  string clock = TimeToLocalTimeStr(time(NULL));
+  TuiPut(row, 0, "battstatus");
+  TuiPut(row++, max(tui.cols - (int)clock.size(), 0), clock);
+  TuiPut(row++, 0, string(tui.cols, '-'));
+
+  TuiPutField(row++, "ACLineStatus", ACLineStatusStr(status->ACLineStatus));
+  TuiPutField(row++, "BatteryFlag", BatteryFlagStr(status->BatteryFlag));
+  TuiPutField(row++, "BatteryLifePercent",
+              BatteryLifePercentStr(status->BatteryLifePercent));
+  if(os.dwMajorVersion >= 10) {
+    TuiPutField(row++, "SystemStatusFlag",
+                SystemStatusFlagStr(status->SystemStatusFlag));
+  }
+  TuiPutField(row++, "BatteryLifeTime",
+              BatteryLifeTimeStr(status->BatteryLifeTime));
+  if(lifetime_span_minutes) {
+    TuiPutField(row++, "Average lifetime",
+                BatteryLifeTimeStr(average_lifetime));
+  }
+  TuiPutField(row++, "Battery Power Rate", RateStr(rate));
+  ++row;
+
+  TuiPut(row++, 0, "Battery health:");
+  for(size_t i = 0; i < tui.health.size(); ++i)
+    TuiPut(row++, 2, tui.health[i]);
+  ++row;
+
+  vector<double> percents, rates;
+  double rate_lo = 0, rate_hi = 0;
+  for(size_t i = 0; i < tui.history.size(); ++i) {
+    percents.push_back(tui.history[i].percent <= 100 ?
+                       tui.history[i].percent : 0);
+    rates.push_back(tui.history[i].rate);
+    // the range is from the envelope so it includes the peaks between the
+    // samples shown
+    if(tui.history[i].rate_lo < rate_lo)
+      rate_lo = tui.history[i].rate_lo;
+    if(tui.history[i].rate_hi > rate_hi)
+      rate_hi = tui.history[i].rate_hi;
+  }
+  TuiPutField(row++, "Percent (last hour)",
+              "[" + Sparkline(percents, 0, 100) + "] " +
+              BatteryLifePercentStr(status->BatteryLifePercent));
+  TuiPutField(row++, "Rate (last hour)",
+              "[" + Sparkline(rates, rate_lo, rate_hi) + "] " +
+              RateStr((LONG)rate_lo) + " to " + RateStr((LONG)rate_hi));
+  ++row;
+
+  TuiPut(row++, 0, "Recent events:");
+  int room = tui.rows - row;
+  size_t first = tui.events.lines.size() > (size_t)max(room, 0) ?
+                 tui.events.lines.size() - max(room, 0) : 0;
+  for(size_t i = first; i < tui.events.lines.size(); ++i)
+    TuiPut(row++, 2, tui.events.lines[i]);
+
+  TuiFlush();
+}
+
+/* Soak test (option --soak).
+
+The resource tracking of --stats catches slow growth, but only after many
+hours of running. --soak <days> runs <days> of simulated polls through the
+monitor's per-poll pipeline as fast as it can, with the state the main loop
+keeps between polls: the sensor profile, the average lifetime (-a), the
+hysteresis compare, the revival detection, the rate leases and the line format
+(see ReplayStep). The output is discarded. A month takes a few minutes.
+
+The polls are a synthetic trace (see TraceSyntheticNext), or with --replay
+<file> that recorded trace, moved to follow on, after each SOAK_SYNTHETIC_HOURS
+of the synthetic one. The ticks start SOAK_WRAP_MINUTES before GetTickCount
+wraps, so the wrap is crossed early. Before every SOAK_CHUNK_MINUTES of polls
+the soak injects, from its own random number generator so that it's the same
+every time:
+
+- half the time, a suspend and resume of up to SOAK_MAX_SUSPEND_MINUTES
+- now and then a storm of SOAK_STORM_CHANGES charge state changes, enough for
+  a revival
+- now and then the battery removed for SOAK_REMOVED_MINUTES and added back,
+  with the battery interfaces enumerated again each time
+- rate leases granted, renewed and released, or left to expire
+
+Every simulated hour the battery interfaces are enumerated and a telemetry
+batch is read as well, since those hold handles and allocate the most.
+
+Every SOAK_SAMPLE_HOURS of simulated time it samples the live allocations (new
+less delete), the allocations and the CPU time per poll since the previous
+sample, the handle count and the private bytes. Each is fitted with a least
+squares line over the simulated time after the first SOAK_WARMUP_HOURS, in
+which the average lifetime, the sensor history and the DLLs that setupapi
+loads settle. It's an error if the growth of any line over the run is more
+than its limit. A slope rather than the last sample less the first, so that
+slow growth shows through the noise and a peak at the end doesn't count.
+*/
+#define SOAK_MIN_DAYS 7
+#define SOAK_MAX_DAYS 3650
+#define SOAK_WRAP_MINUTES 10
+#define SOAK_CHUNK_MINUTES 10
+#define SOAK_SYNTHETIC_HOURS 24
+#define SOAK_MAX_SUSPEND_MINUTES 120
+#define SOAK_STORM_CHANGES 24         // at least the 20 of a revival
+#define SOAK_STORM_SECONDS 30         // between the changes of a storm
+#define SOAK_REMOVED_MINUTES 5
+#define SOAK_LEASES 4                 // clients holding leases
+#define SOAK_LEASE_INTERVAL_MS 2000
+#define SOAK_SAMPLE_HOURS 6
+#define SOAK_WARMUP_HOURS 24
+#define SOAK_MAX_LIVE_GROWTH 64       // blocks
+#define SOAK_MAX_COST_GROWTH 50       // percent, per poll
+#define SOAK_MAX_HANDLE_GROWTH 4
+#define SOAK_MAX_BYTES_GROWTH (256 * 1024)
+
+enum soak_metric_id {
+  SOAK_LIVE,
+  SOAK_ALLOCS,
+  SOAK_CPU,
+  SOAK_HANDLES,
+  SOAK_BYTES,
+  SOAK_METRIC_COUNT
+};
+
+struct soak_metric {
+  const char *name;
+  const char *unit;
+  double limit;        // of the fitted growth over the run
+  bool relative;       // the limit is a percentage of the fitted start
+  vector<double> x;    // simulated hours
+  vector<double> y;
+};
+
+/* Fit a least squares line to the samples of 'm'. Return its growth from the
+   first sample to the last and set 'start' to its value at the first. */
+double SoakGrowth(const struct soak_metric *m, double *start)
+{
+  size_t n = m->x.size();
+  double mx = 0, my = 0, sxx = 0, sxy = 0;
+  for(size_t i = 0; i < n; ++i) {
+    mx += m->x[i];
+    my += m->y[i];
+  }
+  mx /= n;
+  my /= n;
+  for(size_t i = 0; i < n; ++i) {
+    sxx += (m->x[i] - mx) * (m->x[i] - mx);
+    sxy += (m->x[i] - mx) * (m->y[i] - my);
+  }
+  double slope = sxx > 0 ? sxy / sxx : 0;
+  *start = my + slope * (m->x[0] - mx);
+  return slope * (m->x[n - 1] - m->x[0]);
+}
+
+/* The battery enumeration and a telemetry batch of every channel, after
+   enumerating the battery interfaces again. */
+void SoakInventory()
+{
+  vector<battery> batteries;
+  EnumBattInterfaces(EnumBattInterfacesProc, &batteries);
+  FreeBatteries(&batteries);
+
+  DWORD now = GetTickCount();
+  for(int id = 0; id < TELEMETRY_COUNT; ++id)
+    telem.channel[id].due_tick = now;
+  telem.stale = true;
+  telem.enum_tick = now - TELEMETRY_ENUM_RETRY_MS;
+  TelemetryService();
+}
+
+struct soak_state {
+  struct synthetic_trace st;     // its next poll is the simulated clock
+  const vector<trace_record> *recorded;
+  bool replaying;                // the recorded trace
+  size_t recorded_next;          // its next record
+  DWORD synthetic_ms;            // since the recorded trace was replayed
+  DWORD seed;
+  DWORD lease_id[SOAK_LEASES];
+  unsigned long suspends, storms, removals, lease_requests;
+};
+
+DWORD SoakRandom(struct soak_state *ss)
+{
+  ss->seed = (ss->seed * 1103515245) + 12345;
+  return (ss->seed >> 16) & 0x7FFF;
+}
+
+/* Append the poll 'r' of the simulated clock and advance the clock by
+   'seconds'. */
+void SoakPoll(struct soak_state *ss, const struct trace_record &r,
+              DWORD seconds, vector<trace_record> *chunk)
+{
+  chunk->push_back(r);
+  ss->st.r.time += seconds;
+  ss->st.r.tick += seconds * 1000;
+}
+
+/* Append an event at the simulated clock. */
+void SoakEvent(struct soak_state *ss, DWORD event,
+               vector<trace_record> *chunk)
+{
+  struct trace_record e = ss->st.r;
+  e.type = 'E';
+  e.event = event;
+  chunk->push_back(e);
+}
+
+/* Append the next SOAK_CHUNK_MINUTES of polls, from the recorded trace if
+   it's being replayed or else the synthetic one. */
+void SoakPolls(struct soak_state *ss, vector<trace_record> *chunk)
+{
+  const DWORD chunk_ms = SOAK_CHUNK_MINUTES * 60 * 1000;
+
+  if(ss->recorded && !ss->replaying &&
+     ss->synthetic_ms >= (SOAK_SYNTHETIC_HOURS * 3600 * 1000)) {
+    ss->replaying = true;
+    ss->recorded_next = 0;
+    ss->synthetic_ms = 0;
+  }
+
+  if(!ss->replaying) {
+    TraceSyntheticNext(&ss->st, SOAK_CHUNK_MINUTES * 60, chunk);
+    ss->synthetic_ms += chunk_ms;
+    return;
+  }
+
+  // the recorded trace, moved to the simulated clock
+  const vector<trace_record> &rec = *ss->recorded;
+  size_t &i = ss->recorded_next;
+  DWORD start = rec[i].tick;
+  for(; i < rec.size() && (rec[i].tick - start) < chunk_ms; ++i) {
+    struct trace_record moved = rec[i];
+    moved.tick = ss->st.r.tick + (rec[i].tick - start);
+    moved.time = ss->st.r.time + (rec[i].tick - start) / 1000;
+    chunk->push_back(moved);
+  }
+  ss->st.r.tick += chunk_ms;
+  ss->st.r.time += chunk_ms / 1000;
+  if(i == rec.size())
+    ss->replaying = false;
+}
+
+/* Inject the events before a chunk of polls, see the section comment. */
+void SoakInject(struct soak_state *ss, vector<trace_record> *chunk)
+{
+  struct trace_record &clock = ss->st.r;
+
+  if(SoakRandom(ss) % 2) {
+    DWORD minutes = 1 + (SoakRandom(ss) % SOAK_MAX_SUSPEND_MINUTES);
+    SoakEvent(ss, PBT_APMSUSPEND, chunk);
+    clock.time += minutes * 60;
+    clock.tick += minutes * 60 * 1000;
+    SoakEvent(ss, PBT_APMRESUMEAUTOMATIC, chunk);
+    ++ss->suspends;
+  }
+
+  if(!(SoakRandom(ss) % 50)) {
+    struct trace_record r = clock;
+    for(int i = 0; i < SOAK_STORM_CHANGES; ++i) {
+      bool charging = !(i % 2);
+      r.status.ACLineStatus = (BYTE)charging;
+      r.status.BatteryFlag = (BYTE)((r.status.BatteryFlag &
+                                     ~SPSF_BATTERYCHARGING) |
+                                    (charging ? SPSF_BATTERYCHARGING : 0));
+      r.time = clock.time;
+      r.tick = clock.tick;
+      SoakEvent(ss, PBT_APMPOWERSTATUSCHANGE, chunk);
+      SoakPoll(ss, r, SOAK_STORM_SECONDS, chunk);
+    }
+    ++ss->storms;
+  }
+
+  if(!(SoakRandom(ss) % 75)) {
+    SoakInventory();
+    struct trace_record r = clock;
+    r.status.ACLineStatus = 1;
+    r.status.BatteryFlag = SPSF_BATTERYNOBATTERY;
+    r.status.BatteryLifePercent = PERCENT_UNKNOWN;
+    r.status.BatteryLifeTime = LIFETIME_UNKNOWN;
+    r.rate_mw = 0;
+    SoakEvent(ss, PBT_APMPOWERSTATUSCHANGE, chunk);
+    for(int i = 0; i < SOAK_REMOVED_MINUTES * 60; ++i) {
+      r.time = clock.time;
+      r.tick = clock.tick;
+      SoakPoll(ss, r, 1, chunk);
+    }
+    SoakEvent(ss, PBT_APMPOWERSTATUSCHANGE, chunk);
+    SoakInventory();
+    ++ss->removals;
+  }
+
+  /* A client asks for a lease for a while, renews it or releases it, or
+     leaves it to expire. */
+  DWORD &id = ss->lease_id[SoakRandom(ss) % SOAK_LEASES];
+  DWORD action = SoakRandom(ss) % 4;
+  if(action < 3) {
+    DWORD duration_ms = action == 2 ? 0 :
+                        (1 + (SoakRandom(ss) % 20)) * 60 * 1000;
+    id = LeaseRequest(action ? id : 0, "--soak", SOAK_LEASE_INTERVAL_MS,
+                      duration_ms, clock.tick);
+    ++ss->lease_requests;
+  }
+}
+
+/* Return 0 if none of the allocations, the cost per poll, the handle count
+   and the private bytes grew over the run. */
+int Soak(DWORD days)
+{
+  vector<trace_record> recorded;
+  if(replay_trace && strncmp(replay_trace, "synthetic:", 10)) {
+    if(!TraceLoad(replay_trace, &recorded)) {
+      cerr << "Error: Failed to load trace " << replay_trace << endl;
+      return 1;
+    }
+    if(recorded.empty()) {
+      cerr << "Error: The trace has no records." << endl;
+      return 1;
+    }
+  }
+
+  struct soak_state ss = soak_state();
+  TraceSyntheticInit(&ss.st,
+                     0xFFFFFFFF - (SOAK_WRAP_MINUTES * 60 * 1000) + 1);
+  ss.recorded = recorded.empty() ? NULL : &recorded;
+  ss.seed = 1;
+
+  struct replay_state rs;
+  struct replay_run run = replay_run();
+  ReplayInit(&rs);
+
+  struct soak_metric m[SOAK_METRIC_COUNT] = {
+    { "Live allocations", "", SOAK_MAX_LIVE_GROWTH, false },
+    { "Allocations", " per poll", SOAK_MAX_COST_GROWTH, true },
+    { "CPU time", " us per poll", SOAK_MAX_COST_GROWTH, true },
+    { "Handles", "", SOAK_MAX_HANDLE_GROWTH, false },
+    { "Private bytes", " KB", SOAK_MAX_BYTES_GROWTH / 1024, false },
+  };
+  size_t samples = ((days * 24) / SOAK_SAMPLE_HOURS) + 1;
+  for(int i = 0; i < SOAK_METRIC_COUNT; ++i) {
+    m[i].x.reserve(samples);
+    m[i].y.reserve(samples);
+  }
+  vector<trace_record> chunk;
+  chunk.reserve(SOAK_CHUNK_MINUTES * 60 * 4);
+  NullBuf null_buf;
+
+  struct resource_sample rsample;
+  if(!ResourceSample(&rsample)) {
+    cerr << "Error: Failed to get the handle count and private bytes."
+         << endl;
+    return 1;
+  }
+
+  const ULONGLONG sample_ms = (ULONGLONG)SOAK_SAMPLE_HOURS * 3600 * 1000;
+  ULONGLONG total_ms = (ULONGLONG)days * 24 * 3600 * 1000;
+  ULONGLONG simulated_ms = 0, next_sample_ms = 0, next_inventory_ms = 0;
+  LONG prev_allocs = alloc_count;
+  unsigned long prev_samples = 0;
+  ULONGLONG cpu_ms = 0, prev_cpu_ms = 0;
+  GetProcessCpuTime(&prev_cpu_ms);
+  DWORD start = GetTickCount();
+
+  for(;;) {
+    if(simulated_ms >= next_sample_ms) {
+      next_sample_ms += sample_ms;
+      double hours = simulated_ms / 3600000.0;
+      unsigned long polls = run.samples - prev_samples;
+      if(!GetProcessCpuTime(&cpu_ms) || !ResourceSample(&rsample)) {
+        cerr << "Error: Failed to get the CPU time or the resources."
+             << endl;
+        return 1;
+      }
+      double y[SOAK_METRIC_COUNT] = {
+        (double)(alloc_count - free_count),
+        polls ? (double)(alloc_count - prev_allocs) / polls : 0,
+        polls ? (cpu_ms - prev_cpu_ms) * 1000.0 / polls : 0,
+        (double)rsample.handles,
+        (double)(rsample.private_bytes / 1024)
+      };
+      prev_allocs = alloc_count;
+      prev_samples = run.samples;
+      prev_cpu_ms = cpu_ms;
+
+      if(hours >= SOAK_WARMUP_HOURS) {
+        for(int i = 0; i < SOAK_METRIC_COUNT; ++i) {
+          m[i].x.push_back(hours);
+          m[i].y.push_back(y[i]);
+        }
+      }
+      cout << TIMESTAMPED_PREFIX << "Soak: day " << fixed << setprecision(2)
+           << (hours / 24) << ", " << run.samples << " polls, "
+           << (LONG)y[SOAK_LIVE] << " live allocations, " << y[SOAK_ALLOCS]
+           << " allocations and " << y[SOAK_CPU] << " us CPU per poll, "
+           << rsample.handles << " handles, " << rsample.private_bytes / 1024
+           << " KB private bytes." << endl;
+    }
+
+    if(simulated_ms >= total_ms)
+      break;
+
+    // the injected events come first, so that a lease starts with the polls
+    streambuf *cout_buf = cout.rdbuf(&null_buf);
+    if(simulated_ms >= next_inventory_ms) {
+      SoakInventory();
+      next_inventory_ms += 3600 * 1000;
+    }
+    DWORD clock = ss.st.r.tick;
+    chunk.clear();
+    SoakInject(&ss, &chunk);
+    SoakPolls(&ss, &chunk);
+    simulated_ms += ss.st.r.tick - clock;
+    for(size_t i = 0; i < chunk.size(); ++i)
+      ReplayStep(&rs, &chunk[i], &run);
+    cout.rdbuf(cout_buf);
+  }
+
+  double elapsed = (GetTickCount() - start) / 1000.0;
+  TelemetryClose();
+
+  bool ok = true;
+  int failed = 0;
+
+#define SHOW_SOAK(name) \
+  cout << left << setw(BATT_FIELD_WIDTH) << name ": " << right
+
+  cout << "\nbattstatus --soak:\n\n" << std::fixed << setprecision(0);
+  SHOW_SOAK("Simulated") << (simulated_ms / 3600000 / 24) << " days in "
+                         << elapsed << " s (" << run.samples << " polls, "
+                         << ss.suspends << " suspends, " << ss.storms
+                         << " charge storms, " << ss.removals
+                         << " battery removals, " << ss.lease_requests
+                         << " lease requests)\n";
+  for(int i = 0; i < SOAK_METRIC_COUNT; ++i) {
+    double first = 0;
+    double growth = m[i].x.size() ? SoakGrowth(&m[i], &first) : 0;
+    double limit = m[i].relative ? (first * m[i].limit / 100) : m[i].limit;
+    if(growth > limit && ok) {
+      ok = false;
+      failed = i;
+    }
+    int precision = (i == SOAK_ALLOCS || i == SOAK_CPU) ? 2 : 0;
+    cout << left << setw(BATT_FIELD_WIDTH) << (string(m[i].name) + ": ")
+         << right << setprecision(precision) << m[i].y.front() << " -> "
+         << m[i].y.back() << m[i].unit << " (fitted growth " << growth
+         << ", limit " << limit << ")\n";
+  }
+  SHOW_SOAK("Result");
+  if(ok)
+    cout << "OK\n";
+  else {
+    cout << "FAILED, " << m[failed].name << " grew by more than "
+         << m[failed].limit << (m[failed].relative ? "%" : m[failed].unit)
+         << " over the run\n";
+  }
+  cout << flush;
+
+#undef SHOW_SOAK
+  return ok ? 0 : 1;
+}
+
+string PowerBroadcastStr(WPARAM wParam)
+{
+#define CASE_PBT(item) \
+  case item: return #item;
+
+  switch(wParam) {
+  CASE_PBT(PBT_APMQUERYSUSPEND);        /* 0x0000 */  /* Win2k & XP only */
+  CASE_PBT(PBT_APMQUERYSTANDBY);        /* 0x0001 */  /* Win2k & XP only */
+  CASE_PBT(PBT_APMQUERYSUSPENDFAILED);  /* 0x0002 */  /* Win2k & XP only */
+  CASE_PBT(PBT_APMQUERYSTANDBYFAILED);  /* 0x0003 */  /* Win2k & XP only */
+  CASE_PBT(PBT_APMSUSPEND);             /* 0x0004 */
+  CASE_PBT(PBT_APMSTANDBY);             /* 0x0005 */
+  CASE_PBT(PBT_APMRESUMECRITICAL);      /* 0x0006 */  /* Win2k & XP only */
+  CASE_PBT(PBT_APMRESUMESUSPEND);       /* 0x0007 */
+  CASE_PBT(PBT_APMRESUMESTANDBY);       /* 0x0008 */
+  CASE_PBT(PBT_APMBATTERYLOW);          /* 0x0009 */  /* Win2k & XP only */
+  CASE_PBT(PBT_APMPOWERSTATUSCHANGE);   /* 0x000A */
+  CASE_PBT(PBT_APMOEMEVENT);            /* 0x000B */  /* Win2k & XP only */
+  CASE_PBT(PBT_APMRESUMEAUTOMATIC);     /* 0x0012 */
+  CASE_PBT(PBT_POWERSETTINGCHANGE);     /* 0x8013 */
+  }
+  return UndocumentedValueStr(wParam);
+}
+
+LRESULT CALLBACK WindowProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
+{
+  if(verbose >= 3)
+  {
+    /* show all window messages */
+    cout << TIMESTAMPED_PREFIX
+         << hex << "WindowProc: msg 0x" << msg << ", wparam 0x" << wParam
+         << ", lparam 0x" << lParam << dec << endl;
+  }
+  switch(msg) {
+  /* WM_POWERBROADCAST:
+     "Notifies applications of a change in the power status of the computer,
+     such as a switch from battery power to A/C. The system also broadcasts
+     this event when remaining battery power slips below the threshold
+     specified by the user or if the battery power changes by a specified
+     percentage."
+     PBT_APMPOWERSTATUSCHANGE:
+     "This event can occur when battery life drops to less than 5 minutes, or
+     when the percentage of battery life drops below 10 percent, or if the
+     battery life changes by 3 percent."
+     Note this is a broadcast message and therefore not received by
+     message-only windows. */
+  case WM_POWERBROADCAST:
+    power_broadcast_seen = true;
+    power_broadcast_tick = GetTickCount();
+    TraceEvent(wParam);
+
+    /* write the held output before the computer suspends, and don't count
+       the time asleep in the drain profile */
+    if(wParam == PBT_APMSUSPEND) {
+      CoalesceUrgent();
+      drain.suspended = true;
+    }
+
+    if(wParam == PBT_APMPOWERSTATUSCHANGE) {
+      static SYSTEM_POWER_STATUS status, prev_status;
+      prev_status = status;
+
+      if(GetSystemPowerStatus(&status)) {
+#if 0
+        cout << "PBT_APMPOWERSTATUSCHANGE DEBUG: \n---\n(prev_status)\n";
+        ShowPowerStatus(&prev_status);
+        cout << "---\n(status)\n";
+        ShowPowerStatus(&status);
+        cout << "---" << endl;
+#endif
+        /* If the charge state is being suppressed but only it or members
+           affected by it have changed then don't show anything. */
+        if(suppress_charge_state &&
+           status.BatteryLifePercent == prev_status.BatteryLifePercent &&
+           ((status.BatteryFlag & ~SPSF_BATTERYCHARGING) ==
+            (prev_status.BatteryFlag & ~SPSF_BATTERYCHARGING)))
+          return TRUE;
+      }
+      else
+        status = prev_status;
+    }
+
+    cout << TIMESTAMPED_PREFIX << "WM_POWERBROADCAST: "
+         << PowerBroadcastStr(wParam);
+
+    if(eventlog) {
+      EventLogPost(EVENTLOG_INFORMATION_TYPE, EVENTLOG_ID_POWERBROADCAST, NULL,
+                   "WM_POWERBROADCAST: " + PowerBroadcastStr(wParam));
+    }
+
+    if(lParam == 0 &&
+       wParam != PBT_APMQUERYSUSPEND &&
+       wParam != PBT_APMQUERYSTANDBY) {
+      /* lParam in this case has no significance so skip showing it */
+      cout << endl;
+      return TRUE;
+    }
+
+    cout << " (lParam: ";
+    if(wParam == PBT_APMQUERYSUSPEND ||
+       wParam == PBT_APMQUERYSTANDBY) {
+      LPARAM unknown = (LPARAM)(lParam & ~1);
+      if(lParam & 1) {
+        cout << "Bit 0 is on, User prompting/interaction is allowed.";
+        if(unknown)
+          cout << " | ";
+      }
+      else {
+        cout << "Bit 0 is off, User prompting/interaction is not allowed.";
+        if(unknown)
+          cout << " | ";
+      }
+      if(unknown)
+        cout << UndocumentedValueStr(lParam);
+    }
+#if 0 // this is unreachable now since lParam 0 is skipped earlier
+    else if(lParam == 0) {
+      cout << "0";
+    }
+#endif
+    else if(wParam == PBT_APMRESUMECRITICAL ||
+            wParam == PBT_APMRESUMESUSPEND ||
+            wParam == PBT_APMRESUMESTANDBY ||
+            wParam == PBT_APMRESUMEAUTOMATIC) {
+      LPARAM unknown = (LPARAM)(lParam & ~PBTF_APMRESUMEFROMFAILURE);
+      if(lParam & PBTF_APMRESUMEFROMFAILURE) {
+        cout << "PBTF_APMRESUMEFROMFAILURE";
+        if(unknown)
+          cout << " | ";
+      }
+      if(unknown)
+        cout << UndocumentedValueStr(unknown);
+    }
+    else
+      cout << UndocumentedValueStr(lParam);
+    cout << ")" << endl;
+    return TRUE;
+
+  case WM_QUERYENDSESSION:
+  case WM_ENDSESSION:
+    CoalesceWrite();
+    break;
+
+  /* a rate lease from another process, see "Sampling rate leases" */
+  case WM_COPYDATA:
+    return LeaseReceive((const COPYDATASTRUCT *)lParam);
+
+  default:
+    break;
+  }
+
+  return DefWindowProc(hwnd, msg, wParam, lParam);
+}
+
+HWND InitMonitorWindow()
+{
+  const char * window_class_name = MONITOR_WINDOW_CLASS;
+
+  WNDCLASS wc;
+  wc.style         = CS_NOCLOSE;
+  wc.lpfnWndProc   = WindowProc;
+  wc.cbClsExtra    = 0;
+  wc.cbWndExtra    = 0;
+  wc.hInstance     = GetModuleHandle(NULL);
+  wc.hIcon         = NULL;
+  wc.hCursor       = NULL;
+  wc.hbrBackground = NULL;
+  wc.lpszMenuName  = NULL;
+  wc.lpszClassName = window_class_name;
+
+  ATOM atomWindowClass = RegisterClass(&wc);
+  if(!atomWindowClass) {
+    DWORD gle = GetLastError();
+    cerr << "Error: RegisterClass() failed to make window class "
+         << "\"" << window_class_name << "\""
+         << " with error code " << gle << "." << endl;
+    return NULL;
+  }
+
+  HWND hwnd = CreateWindowEx(0, window_class_name, window_class_name,
+                             0, 0, 0, 0, 0, NULL, NULL, NULL, NULL);
+  if(!hwnd) {
+    DWORD gle = GetLastError();
+    cerr << "Error: CreateWindowEx() failed to make window "
+         << "\"" << window_class_name << "\""
+         << " with error code " << gle << "." << endl;
+    return NULL;
+  }
+
+  /* Let a client that isn't elevated send a lease to an elevated monitor.
+     ChangeWindowMessageFilterEx is Windows 7+. */
+  BOOL (WINAPI *ChangeWindowMessageFilterEx)(HWND, UINT, DWORD, void *) =
+    (BOOL (WINAPI *)(HWND, UINT, DWORD, void *))
+    GetProcAddress(GetModuleHandleW(L"user32"), "ChangeWindowMessageFilterEx");
+  if(ChangeWindowMessageFilterEx)
+    ChangeWindowMessageFilterEx(hwnd, WM_COPYDATA, MSGFLT_ALLOW, NULL);
+
+  if(verbose >= 3) {
+    cout << TIMESTAMPED_HEADER
+         << "Monitor window created.\n"
+         << "hwnd: " << hex << hwnd << dec << "\n"
+         << "name: " << window_class_name << "\n" << endl;
+  }
+
+  return hwnd;
+}
+
+/* Measure and save the idle power baseline. Return 0 on success. */
+int Baseline()
+{
+  if(!InitMonitorWindow()) {
+    cerr << "Error: InitMonitorWindow() failed." << endl;
+    return 1;
+  }
+
+  cout << TIMESTAMPED_PREFIX << "Measuring idle power until the 95% "
+       << "confidence interval is narrower than " << baseline_ci
+       << (baseline_ci_relative ? "% of the mean" : " mW") << ". "
+       << "Leave the computer idle and running on battery power." << endl;
+
+  struct running_stats rs = { 0, };       // the samples
+  struct running_stats batch = { 0, };    // the samples of the current batch
+  struct running_stats batches = { 0, };  // the batch means
+  DWORD batch_tick = 0;
+  SYSTEM_BATTERY_STATE prev = { 0, };
+  bool have_prev = false, target_reached = false;
+  unsigned long discarded = 0;
+  DWORD start = GetTickCount(), progress_tick = start;
+
+  for(;;) {
+    if(MsgWaitForMultipleObjects(0, NULL, FALSE, BASELINE_INTERVAL_MS,
+                                 QS_ALLINPUT) == WAIT_FAILED) {
+      DWORD gle = GetLastError();
+      cerr << "Error: MsgWaitForMultipleObjects failed, error " << gle << "."
+           << endl;
+      return 1;
+    }
+    for(MSG msg; PeekMessage(&msg, NULL, 0, 0, PM_REMOVE);) {
+      if(msg.message == WM_QUIT)
+        return 1;
+      TranslateMessage(&msg);
+      DispatchMessage(&msg);
+    }
+
+    DWORD now = GetTickCount();
+    if((now - start) >= (BASELINE_MAX_HOURS * 60 * 60 * 1000))
+      break;
+
+    SYSTEM_BATTERY_STATE sbs;
+    if(!GetSystemBatteryState(&sbs))
+      continue;
+
+    // The first report was made before measuring started so skip it.
+    bool update = have_prev && (sbs.Rate != prev.Rate ||
+                                sbs.RemainingCapacity !=
+                                prev.RemainingCapacity);
+    prev = sbs;
+    have_prev = true;
+    if(!update)
+      continue;
+
+    LONG rate = ((DWORD)sbs.Rate != 0x80000000) ? (LONG)sbs.Rate : 0;
+    bool disturbed = (sbs.AcOnLine || sbs.Charging || rate >= 0);
+
+    ULONGLONG lastwake;
+    if(GetLastWakeTime(&lastwake) && RecentlyResumed(lastwake, now))
+      disturbed = true;
+
+    if(power_broadcast_seen &&
+       (now - power_broadcast_tick) < (RESUME_SPAN_MINUTES * 60 * 1000))
+      disturbed = true;
+
+    if(disturbed) {
+      ++discarded;
+      continue;
+    }
+
+    // a sample after the batch's time is up starts the next batch
+    if(batch.n && (now - batch_tick) >= (BASELINE_BATCH_SECONDS * 1000)) {
+      StatsAdd(&batches, batch.mean);
+      struct running_stats empty = { 0, };
+      batch = empty;
+    }
+    if(!batch.n)
+      batch_tick = now;
+    StatsAdd(&batch, -rate);
+    StatsAdd(&rs, -rate);
+
+    double ci = StatsConfidence95(&batches);
+    double target = baseline_ci_relative ?
+                    batches.mean * baseline_ci / 100 : baseline_ci;
+
+    if(batches.n >= BASELINE_MIN_BATCHES && (ci * 2) <= target) {
+      target_reached = true;
+      break;
+    }
+
+    if(batches.n >= 2 &&
+       (verbose || (now - progress_tick) >= (5 * 60 * 1000))) {
+      progress_tick = now;
+      cout << TIMESTAMPED_PREFIX << fixed << setprecision(0) << batches.mean
+           << " mW +/- " << ci << " mW after " << batches.n << " batches of "
+           << rs.n << " samples (" << discarded << " discarded)" << endl;
+    }
+  }
+
+  struct idle_baseline b;
+  b.mean_mw = batches.mean;
+  b.confidence_mw = StatsConfidence95(&batches);
+  b.samples = rs.n;
+  b.when = time(NULL);
+
+  cout << "\n" << fixed << setprecision(0)
+       << left << setw(BATT_FIELD_WIDTH) << "Idle power: " << right
+       << b.mean_mw << " mW +/- " << b.confidence_mw << " mW "
+       << "(95% confidence)\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Samples: " << right
+       << b.samples << " in " << batches.n << " batches of "
+       << BASELINE_BATCH_SECONDS << "s (" << discarded << " discarded)\n"
+       << left << setw(BATT_FIELD_WIDTH) << "Duration: " << right
+       << BatteryLifeTimeStr((GetTickCount() - start) / 1000) << "\n";
+
+  if(!target_reached) {
+    cout << "\nThe target confidence interval was not reached in "
+         << BASELINE_MAX_HOURS << " hours.\n";
+  }
+
+  if(batches.n < BASELINE_MIN_BATCHES)
+    cout << "\nNot enough samples, the baseline was not saved." << endl;
+  else if(!SaveBaseline(&b))
+    cout << "\nError: Failed to save the baseline." << endl;
+  else
+    cout << "\nSaved as the baseline for " << BatterySetKey() << endl;
+
+  return target_reached ? 0 : 1;
+}
+
+void ShowUsage()
 {
 cerr <<
-"\nUsage: battstatus [-a <minutes>] [-n] [-p] [-v[vv]]\n"
+"\nUsage: battstatus [-a <minutes>] [-n] [-p] [-v[vv]] [-w] "
+"[--align-polls] [--charge-profile] [--coalesce <time>] [--degrade] "
+"[--degrade-policy <list>] [--drain-profile] [--eventlog] "
+"[--hysteresis <list>] [--line-format <template>] [--log <file>] "
+"[--log-keep <n>] [--log-rotate <list>] [--low-impact] "
+"[--mqtt <host>[:<port>]] [--rate-limit <list>] [--record <file>] "
+"[--stats] [--telemetry] [--telemetry-period <list>] "
+"[--title-format <template>] [--tui]\n"
+"       battstatus [--measure-idle <time>] --measure [--] <command> [<args>]\n"
+"       battstatus [-v] [--baseline-ci <n>[%]] --baseline\n"
+"       battstatus --drain-report\n"
+"       battstatus --log-cat <file>\n"
+"       battstatus --log <file> [--log-rotate <list>] --log-benchmark <time>\n"
+"       battstatus --coalesce <time> --coalesce-check <time>\n"
+"       battstatus [-a <minutes>] [--replay-threshold <n>[%]] [--replay-save] "
+"--replay <file>|synthetic:<n>\n"
+"       battstatus --compare <A> <B>\n"
+"       battstatus --trace-benchmark <time>\n"
+"       battstatus --critical-benchmark <time>\n"
+"       battstatus [-a <minutes>] [--replay <file>] --soak <days>\n"
+"       battstatus [-v] [--plot-points <n>] [--plot-envelope] "
+"[--plot-last <time>] --plot <file>\n"
+"       battstatus [-v] --collector <host>[:<port>] --ship <file>\n"
+"       battstatus --lease <rate>[,<time>]\n"
 "\n"
 "battstatus monitors your laptop battery for changes in state. By default it "
 "monitors WM_POWERBROADCAST messages and relevant changes in power status.\n"
 "\n"
 "  -v\tMonitor and show all power status variables on any change.\n"
 "\n"
-"  -vv\t.. and show ??? (unused).\n"
+"  -vv\t.. and show telemetry readings as they change (--telemetry).\n"
 "\n"
 "  -vvv\t.. and show all window messages received by the monitor window.\n"
 "\tWindow messages other than WM_POWERBROADCAST are shown by hex.\n"
@@ -1116,6 +9068,216 @@ cerr <<
 "  -w\tWindow Title: Show current status in the window title.\n"
 "\tThe original title is restored when battstatus terminates.\n"
 "\n"
+"  --eventlog\n"
+"\tEvent Log: Report events to the Windows Application event log (source "
+"\"" EVENTLOG_SOURCE_NAME "\") as structured NAME=value fields such as "
+"BATT_EVENT=revival and BATT_PERCENT=17.\n"
+"\n"
+"  --align-polls\n"
+"\tAlign Polls: Poll just after each expected refresh of the battery "
+"information, as learned while monitoring, instead of once a second. A change "
+"in a field that rarely changes, such as battery saver, may be shown up to "
+"10s late. --stats shows the learned profile.\n"
+"\n"
+"  --baseline\n"
+"\tBaseline: Measure the idle power until the 95% confidence interval of "
+"the mean is narrow enough, and save it as the baseline for this computer and "
+"its batteries. --measure uses the saved baseline.\n"
+"\n"
+"  --baseline-ci <n>[%]\n"
+"\tBaseline CI: The target width of the confidence interval, in mW or as a "
+"percentage of the mean. The default is 5%.\n"
+"\n"
+"  --charge-profile\n"
+"\tCharge Profile: Record each charging session's power vs percent curve, "
+"show its peak power, CC/CV knee and time from 20% to 80%, and warn if it's "
+"much slower than the battery's usual curve.\n"
+"\n"
+"  --collector <host>[:<port>]\n"
+"\tCollector: The collector that --ship sends to. The default port is "
+SHIP_DEFAULT_PORT ".\n"
+"\n"
+"  --compare <A> <B>\n"
+"\tCompare: Compare the mean drain of two sets of traces recorded with "
+"--record, each a trace or a directory of traces, over their discharge "
+"sessions. Show the difference with a 95% bootstrap confidence interval.\n"
+"\n"
+"  --coalesce <time>\n"
+"\tCoalesce: While on battery power hold the output in memory and write it "
+"at most every <time>, so that the disk isn't woken for every line. Output is "
+"written immediately on AC power, for warnings and errors, when the battery "
+"is low, before suspend and on exit. At most <time> of output is lost if "
+"battstatus is killed.\n"
+"\n"
+"  --coalesce-check <time>\n"
+"\tCoalesce Check: Run the coalesced output as on battery power for <time>, "
+"with polls at random intervals of up to 10s and now and then a warning, and "
+"show how long the lines were held, then quit. It's an error if a line was "
+"held longer than --coalesce <time>, or a warning line at all.\n"
+"\n"
+"  --critical-benchmark <time>\n"
+"\tCritical Benchmark: Raise a critical alert every 250ms for <time> with the "
+"event log queue kept full of other records, as if the event log were slow, "
+"and show the worst latency of each sink. Nothing is reported to the event "
+"log. It's an error if an alert took longer than 1s.\n"
+"\n"
+"  --degrade\n"
+"\tDegrade: While battery saver is on, poll every 60s instead of at the "
+"learned refresh times, and pause telemetry, verbose full status and MQTT "
+"publishing. The one-liners, warnings and errors are shown as usual. Each "
+"change is shown, with the wakeups and CPU time used while degraded.\n"
+"\n"
+"  --degrade-policy percent=<n>,poll=<time>\n"
+"\tDegrade Policy: Also degrade while on battery power at or below <n> "
+"percent, and poll every <time> while degraded. Implies --degrade.\n"
+"\n"
+"  --drain-profile\n"
+"\tDrain Profile: Record how long the computer runs on battery, how much it "
+"drains and how often it's plugged in, by weekday and hour.\n"
+"\n"
+"  --drain-report\n"
+"\tDrain Report: Show the recorded drain profile and then quit.\n"
+"\n"
+"  --hysteresis percent=<n>,lifetime=<time>,full_lifetime=<time>\n"
+"\tHysteresis: Show a change only if the field moved at least that much "
+"since it was last shown. Time is in seconds or has suffix s, m or h. "
+"For example --hysteresis percent=2,lifetime=5m\n"
+"\n"
+"  --lease <rate>[,<time>]\n"
+"\tLease: Have each running monitor poll the power status at <rate> (eg "
+"100hz, or an interval such as 500ms) for <time> (default 60s, at most 5m), "
+"then go back to its usual polls. The fastest live lease wins. --measure and "
+"--tui hold a lease of their own.\n"
+"\n"
+"  --line-format <template>\n"
+"\tLine Format: Show each status line in the format of <template>. The "
+"placeholders are {percent}, {lifetime}, {avg_lifetime}, {rate}, {ac} and "
+"{state}, which is the default line. Use {{ and }} for braces. For example "
+"--line-format \"{percent} {ac} {rate}\"\n"
+"\n"
+"  --log <file>\n"
+"\tLog: Append the output to <file> instead of showing it. The log is rotated "
+"by --log-rotate and the rotated segments are compressed in the background.\n"
+"\n"
+"  --log-benchmark <time>\n"
+"\tLog Benchmark: Write to the log as fast as possible for <time>, then show "
+"the throughput, the slowest write and the rotations, and quit.\n"
+"\n"
+"  --log-cat <file>\n"
+"\tLog Cat: Show a log segment, decompressing it if it's compressed, and "
+"quit.\n"
+"\n"
+"  --log-keep <n>\n"
+"\tLog Keep: Keep at most <n> compressed segments. The default is 10.\n"
+"\n"
+"  --log-rotate size=<size>,time=<time>\n"
+"\tLog Rotate: Rotate the log when it reaches <size> (eg 10M) or its age "
+"reaches <time> (eg 24h), 0 for no limit. The size is at most 256M, which is "
+"also the limit with size=0. The default is size=10M.\n"
+"\n"
+"  --low-impact\n"
+"\tLow Impact: Run in the background at idle priority with power throttling, "
+"let the OS delay the poll timer by up to 1s to coalesce wakeups, and keep "
+"the working set resident. --stats shows the wakeups and CPU time.\n"
+"\n"
+"  --measure [--] <command> [<args>]\n"
+"\tMeasure: Run <command> and show the battery energy it used, and its mean "
+"and peak power. The computer must be running on battery power.\n"
+"\n"
+"  --measure-idle <time>\n"
+"\tMeasure Idle: Before running the command measure the idle power for "
+"<time> (seconds or suffix s, m or h), and show the command's power over "
+"that baseline.\n"
+"\n"
+"  --mqtt <host>[:<port>]\n"
+"\tMQTT: Publish each power status field as a retained message to the MQTT "
+"broker at <host> (default port " MQTT_DEFAULT_PORT "). A field is published "
+"only when it changes. The topic of each field is <prefix>/<field>.\n"
+"\n"
+"  --mqtt-topic <prefix>\n"
+"\tMQTT topic prefix. The default prefix is battstatus/<computer name>.\n"
+"\n"
+"  --plot <file>\n"
+"\tPlot: Show the percent and rate of a trace recorded with --record, "
+"downsampled so that they look the same when plotted, as tab separated time "
+"and value.\n"
+"\n"
+"  --plot-envelope\n"
+"\tPlot Envelope: Downsample to the lowest and highest point of each time "
+"bucket, which keeps every peak, instead of Largest-Triangle-Three-Buckets.\n"
+"\n"
+"  --plot-last <time>\n"
+"\tPlot Last: Plot only the last <time> of the trace, for example 24h.\n"
+"\n"
+"  --plot-points <n>\n"
+"\tPlot Points: The most points to show of each series. The default is "
+"1000.\n"
+"\n"
+"  --rate-limit <class>=<count>/<period>,...\n"
+"\tRate Limit: Show at most <count> outputs of a class per <period>. The "
+"classes are status, verbose, warning and error. Outputs over the limit are "
+"dropped and counted. For example --rate-limit status=10/h,verbose=30/h\n"
+"\n"
+"  --record <file>\n"
+"\tRecord: Append each change in power status or rate, and each power "
+"broadcast, to the trace <file> for --replay.\n"
+"\n"
+"  --replay <file>|synthetic:<n>\n"
+"\tReplay: Run a recorded trace, or a generated one of <n> polls, through "
+"the monitor's per-poll processing as fast as possible, 5 times, and show "
+"the samples per second, the time per sample of each phase and the "
+"allocations of the fastest run, and the wakeups and CPU time per hour of the "
+"trace, then quit. It's an error if the samples per "
+"second are lower than the saved baseline by more than the threshold. The "
+"first replay of a trace with the same -a, --hysteresis and --line-format "
+"saves the baseline.\n"
+"\n"
+"  --replay-save\n"
+"\tReplay Save: Save the replay's samples per second as the new baseline.\n"
+"\n"
+"  --replay-threshold <n>[%]\n"
+"\tReplay Threshold: The regression allowed, in percent. The default is "
+"10%.\n"
+"\n"
+"  --ship <file>\n"
+"\tShip: Forward the records of a trace, as they're recorded by --record, to "
+"the collector in batches. Resume where the collector's acknowledgements "
+"left off after a restart or when the collector is back.\n"
+"\n"
+"  --soak <days>\n"
+"\tSoak: Run <days> (at least 7) of simulated polls, with suspends, charge "
+"storms, battery removals and rate leases, through the monitor as fast as "
+"possible, with the trace of --replay <file> in turn if given, and show the "
+"allocations, CPU time per poll, handle count and private bytes, then quit. "
+"It's an error if any of them grew, which is a leak.\n"
+"\n"
+"  --stats\tStatistics: On exit show the sensor profile, which is how often "
+"each power status field is refreshed and in what steps it changes, and how "
+"many polls were needed, and the wakeups, CPU time, handles and memory used. "
+"While monitoring warn if the handles or memory grow hour after hour. Also "
+"show the worst latency of the critical alerts, if any.\n"
+"\n"
+"  --telemetry\n"
+"\tTelemetry: Sample the voltage, current, temperature, cycle count and "
+"health of each battery, each channel at its own period.\n"
+"\n"
+"  --telemetry-period <channel>=<period>,...\n"
+"\tTelemetry Period: The sampling period of a channel (implies "
+"--telemetry), 0 to disable it. The defaults are voltage=1s,current=1s,"
+"temperature=30s,cycle_count=1h,health=1h. For example current=500ms\n"
+"\n"
+"  --title-format <template>\n"
+"\tTitle Format: Show current status in the window title in the format of "
+"<template> (implies -w). By default the title is the same as the line.\n"
+"\n"
+"  --trace-benchmark <time>\n"
+"\tTrace Benchmark: Append to a temporary trace as fast as possible for "
+"<time>, with readers loading it for the second half, and show the write "
+"rates. It's an error if a reader sees a torn sample.\n"
+"\n"
+"  --tui\tDashboard: Show a live dashboard of the power status, battery "
+"health, the percent and rate over the last hour, and recent events.\n"
+"\n"
 "Options combined into a single argument are the same as separate options, "
 "for example -pvv is the same as -p -v -v.\n"
 "\n"
@@ -1150,7 +9312,7 @@ int main(int argc, char *argv[])
     (NTSTATUS (NTAPI *)(ULONG *, ULONG *, ULONG *))
     GetProcAddress(GetModuleHandleW(L"ntdll"), "NtQueryTimerResolution");
 
-  ULONG MaximumTimerInterval, unused, unused2;
+  ULONG unused, unused2;
   ntstatus = NtQueryTimerResolution(&MaximumTimerInterval, &unused, &unused2);
   if(ntstatus != STATUS_SUCCESS) {
     cerr << "Error: NtQueryTimerResolution failed, error 0x" << hex << ntstatus
@@ -1158,6 +9320,8 @@ int main(int argc, char *argv[])
     exit(1);
   }
 
+  CompileLineFormat("{state}", &line_format);
+
   for(int i = 1; i < argc; ++i) {
     char *p = argv[i];
     const char *errprefix = "Error: Option parsing failed: ";
@@ -1166,6 +9330,244 @@ int main(int argc, char *argv[])
       ShowUsage();
       exit(1);
     }
+    if(!strncmp(p, "--", 2)) {
+      const char *name = p + 2;
+      const char *value = NULL;
+      // long options that need a value, each surrounded by spaces
+      const char *value_required = " baseline-ci coalesce coalesce-check "
+                                   "collector critical-benchmark "
+                                   "degrade-policy hysteresis lease "
+                                   "line-format log log-benchmark log-cat "
+                                   "log-keep log-rotate measure-idle mqtt "
+                                   "mqtt-topic plot plot-last plot-points "
+                                   "rate-limit record replay replay-threshold "
+                                   "ship soak telemetry-period title-format "
+                                   "trace-benchmark ";
+      const char *found = strstr(value_required, name);
+      if(*name && found && found[-1] == ' ' && found[strlen(name)] == ' ') {
+        if((i + 1) >= argc) {
+          cerr << errprefix << "Option '" << p << "' needs a value." << endl;
+          exit(1);
+        }
+        value = argv[++i];
+      }
+      if(!strcmp(name, "eventlog"))
+        eventlog = true;
+      else if(!strcmp(name, "align-polls"))
+        align_polls = true;
+      else if(!strcmp(name, "baseline"))
+        baseline = true;
+      else if(!strcmp(name, "charge-profile"))
+        charge_profile = true;
+      else if(!strcmp(name, "collector"))
+        collector = value;
+      else if(!strcmp(name, "compare")) {
+        if((i + 2) >= argc) {
+          cerr << errprefix << "Option '" << p << "' needs two traces or "
+               << "directories of traces." << endl;
+          exit(1);
+        }
+        compare_path[0] = argv[++i];
+        compare_path[1] = argv[++i];
+      }
+      else if(!strcmp(name, "coalesce")) {
+        if(!ParseDuration(value, &coalesce_seconds) || !coalesce_seconds ||
+           coalesce_seconds > (0xFFFFFFFF / 1000)) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "coalesce-check")) {
+        if(!ParseDuration(value, &coalesce_check) || !coalesce_check ||
+           coalesce_check > (0xFFFFFFFF / 1000)) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "critical-benchmark")) {
+        if(!ParseDuration(value, &critical_benchmark) || !critical_benchmark ||
+           critical_benchmark > (0xFFFFFFFF / 1000)) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "degrade"))
+        degrade = true;
+      else if(!strcmp(name, "degrade-policy")) {
+        if(!ParseDegradePolicy(value)) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+        degrade = true;
+      }
+      else if(!strcmp(name, "drain-profile"))
+        drain_profile = true;
+      else if(!strcmp(name, "drain-report"))
+        drain_report = true;
+      else if(!strcmp(name, "baseline-ci")) {
+        if(!ParseBaselineCI(value)) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "hysteresis")) {
+        if(!ParseHysteresis(value)) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "log"))
+        logw.path = value;
+      else if(!strcmp(name, "log-benchmark")) {
+        if(!ParseDuration(value, &log_benchmark) || !log_benchmark) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "log-cat"))
+        log_cat = value;
+      else if(!strcmp(name, "log-keep")) {
+        if(!ParseUnsigned(value, &logw.keep)) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "log-rotate")) {
+        if(!ParseLogRotate(value)) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "lease")) {
+        if(!ParseLease(value, &lease_interval_ms, &lease_duration_ms)) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "line-format") ||
+              !strcmp(name, "title-format")) {
+        if(!CompileLineFormat(value, (name[0] == 'l' ? &line_format :
+                                                       &title_format))) {
+          cerr << errprefix << "Option '" << p << "' invalid template: "
+               << value << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "low-impact"))
+        low_impact = true;
+      else if(!strcmp(name, "measure")) {
+        // the rest of the arguments are the command
+        if((i + 1) < argc && !strcmp(argv[i + 1], "--"))
+          ++i;
+        if((i + 1) >= argc) {
+          cerr << errprefix << "Option '" << p << "' needs a command." << endl;
+          exit(1);
+        }
+        measure_argv = &argv[i + 1];
+        measure_argc = argc - (i + 1);
+        i = argc;
+      }
+      else if(!strcmp(name, "measure-idle")) {
+        if(!ParseDuration(value, &measure_idle)) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "mqtt"))
+        mqtt_broker = value;
+      else if(!strcmp(name, "mqtt-topic"))
+        mqtt_topic = value;
+      else if(!strcmp(name, "plot"))
+        plot_trace = value;
+      else if(!strcmp(name, "plot-envelope"))
+        plot_envelope = true;
+      else if(!strcmp(name, "plot-last")) {
+        if(!ParseDuration(value, &plot_last) || !plot_last) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "plot-points")) {
+        if(!ParseUnsigned(value, &plot_points) ||
+           plot_points < PLOT_MIN_POINTS) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "rate-limit")) {
+        if(!ParseRateLimit(value)) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "record"))
+        trace_path = value;
+      else if(!strcmp(name, "replay"))
+        replay_trace = value;
+      else if(!strcmp(name, "replay-save"))
+        replay_save = true;
+      else if(!strcmp(name, "replay-threshold")) {
+        string n = value;
+        if(n.size() && n[n.size() - 1] == '%')
+          n.erase(n.size() - 1);
+        if(!ParseUnsigned(n.c_str(), &replay_threshold) ||
+           replay_threshold > 100) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "ship"))
+        ship_trace = value;
+      else if(!strcmp(name, "soak")) {
+        if(!ParseUnsigned(value, &soak) || soak < SOAK_MIN_DAYS ||
+           soak > SOAK_MAX_DAYS) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "stats"))
+        show_stats = true;
+      else if(!strcmp(name, "telemetry"))
+        telemetry = true;
+      else if(!strcmp(name, "telemetry-period")) {
+        if(!ParseTelemetryPeriod(value)) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+        telemetry = true;
+      }
+      else if(!strcmp(name, "trace-benchmark")) {
+        if(!ParseDuration(value, &trace_benchmark) || !trace_benchmark) {
+          cerr << errprefix << "Option '" << p << "' invalid value: " << value
+               << endl;
+          exit(1);
+        }
+      }
+      else if(!strcmp(name, "tui"))
+        dashboard = true;
+      else {
+        cerr << errprefix << "Unknown option: " << p << endl;
+        exit(1);
+      }
+      continue;
+    }
     if(*p != '-') {
       cerr << errprefix << "Expected '-' : " << p << endl;
       exit(1);
@@ -1229,6 +9631,116 @@ int main(int argc, char *argv[])
     }
   }
 
+  // the title is the same as the line unless it has its own template
+  if(title_format.insns.empty())
+    title_format = line_format;
+  else
+    console_title = true;
+
+  if(measure_argc)
+    exit(Measure(measure_argc, measure_argv));
+
+  if(baseline)
+    exit(Baseline());
+
+  if(drain_report)
+    exit(DrainReport());
+
+  if(log_cat)
+    exit(LogCat(log_cat));
+
+  if(soak)
+    exit(Soak(soak));
+
+  if(replay_trace)
+    exit(Replay());
+
+  if(compare_path[0])
+    exit(Compare());
+
+  if(trace_benchmark)
+    exit(TraceBenchmark(trace_benchmark));
+
+  if(critical_benchmark)
+    exit(CriticalBenchmark(critical_benchmark));
+
+  if(plot_trace)
+    exit(Plot());
+
+  if(!ship_trace != !collector) {
+    cerr << "Error: Options --ship and --collector are used together." << endl;
+    exit(1);
+  }
+
+  if(ship_trace)
+    exit(Ship());
+
+  if(lease_interval_ms)
+    exit(Lease(lease_interval_ms, lease_duration_ms));
+
+  if(!monitor &&
+     (mqtt_broker || eventlog || dashboard || telemetry || charge_profile ||
+      drain_profile || trace_path)) {
+    cerr << "Error: Options --charge-profile, --drain-profile, --eventlog, "
+            "--mqtt, --record, --telemetry and --tui can't be used with "
+            "option -n." << endl;
+    exit(1);
+  }
+
+  if(coalesce_seconds && dashboard) {
+    cerr << "Error: Option --coalesce can't be used with option --tui." << endl;
+    exit(1);
+  }
+
+  if(logw.path.size() && dashboard) {
+    cerr << "Error: Option --log can't be used with option --tui." << endl;
+    exit(1);
+  }
+
+  if(log_benchmark && logw.path.empty()) {
+    cerr << "Error: Option --log-benchmark needs option --log." << endl;
+    exit(1);
+  }
+
+  if(coalesce_check) {
+    if(!coalesce_seconds) {
+      cerr << "Error: Option --coalesce-check needs option --coalesce."
+           << endl;
+      exit(1);
+    }
+    exit(CoalesceCheck(coalesce_check));
+  }
+
+  if(low_impact)
+    LowImpactInit();
+
+  if(trace_path && !TraceOpen(trace_path))
+    exit(1);
+
+  if(logw.path.size() && !LogInit())
+    exit(1);
+
+  if(log_benchmark)
+    exit(LogBenchmark(log_benchmark));
+
+  if(mqtt_broker && !MqttInit(mqtt_broker))
+    exit(1);
+
+  if(eventlog && !EventLogInit())
+    exit(1);
+
+  if(telemetry && !TelemetryInit())
+    exit(1);
+
+  /* Registered before the dashboard so that it restores the screen first. */
+  if(show_stats) {
+    atexit(ShowStats);
+    SetConsoleCtrlHandler(StatsCtrlHandler, TRUE);
+  }
+
+  if(dashboard && !TuiInit())
+    exit(1);
+
   if(prevent_sleep) {
     /* "The SetThreadExecutionState function cannot be used to prevent the user
        from putting the computer to sleep." However these flags below get us
@@ -1309,6 +9821,9 @@ int main(int argc, char *argv[])
     DispatchMessage(&msg); \
   }
 
+  if(coalesce_seconds)
+    CoalesceInit();
+
   SYSTEM_POWER_STATUS prev_status = { 0, };
   SYSTEM_POWER_STATUS status = { 0, };
 
@@ -1322,6 +9837,10 @@ int main(int argc, char *argv[])
       if(!monitor)
         break;
 
+      // the output of the last poll is done, so urgent output ends
+      if(coalesce_seconds)
+        CoalescePollEnd();
+
       /* Wait up to 1000ms for a new message to be received in the queue.
          I added this to save power without losing any responsiveness in the
          monitor window's message processing. This way saves ~7x the CPU cycles
@@ -1331,13 +9850,39 @@ int main(int argc, char *argv[])
          https://blogs.msdn.microsoft.com/oldnewthing/20050217-00/?p=36423
          https://blogs.msdn.microsoft.com/larryosterman/2004/06/02/things
          */
-      Sleep(100); // to avoid eating cpu in what may be a tight busy loop
-      if(MsgWaitForMultipleObjects(0, NULL, FALSE, 900, QS_ALLINPUT) ==
-         WAIT_FAILED) {
-        DWORD gle = GetLastError();
-        cerr << "Error: MsgWaitForMultipleObjects failed, error " << gle << "."
-             << endl;
-        exit(1);
+      DWORD tick = GetTickCount();
+      DWORD delay = LeasePollDelay(degr.active ? degr.poll_ms :
+                                   SensorPollDelay(tick), tick);
+      DWORD poll_tick = tick + delay;
+      // to avoid eating cpu in what may be a tight busy loop
+      Sleep(delay < 100 ? delay : 100);
+
+      /* Telemetry channels due before the next poll are read while waiting
+         for it, without polling the power status, and the reactor calls back
+         the sources that are ready. */
+      for(;;) {
+        DWORD now = GetTickCount();
+        DWORD wait = ((LONG)(poll_tick - now) > 0) ? poll_tick - now : 0;
+        if(telemetry && !degr.active && TelemetryDelay() < wait)
+          wait = TelemetryDelay();
+        if(coalesce_seconds && CoalesceDelay() < wait)
+          wait = CoalesceDelay();
+
+        DWORD rc = ReactorWait(wait);
+        if(rc == WAIT_FAILED) {
+          DWORD gle = GetLastError();
+          cerr << "Error: MsgWaitForMultipleObjects failed, error " << gle
+               << "." << endl;
+          exit(1);
+        }
+
+        if(telemetry && !degr.active)
+          TelemetryService();
+        if(coalesce_seconds)
+          CoalesceService();
+
+        if(rc == WAIT_OBJECT_0 || (LONG)(GetTickCount() - poll_tick) >= 0)
+          break;
       }
     }
 
@@ -1351,17 +9896,27 @@ int main(int argc, char *argv[])
       if(!GetSystemPowerStatus(&status)) {
         DWORD gle = GetLastError();
 
-        if(!suppress_sps_errmsgs) {
+        if(!suppress_sps_errmsgs && RateLimitAllow(OUTCLASS_ERROR)) {
+          CoalesceUrgent();
           cout << TIMESTAMPED_PREFIX
                << "GetSystemPowerStatus() failed, error " << gle << "."
                << endl
                << TIMESTAMPED_PREFIX
                << "Temporarily suppressing similar error messages." << endl;
-          suppress_sps_errmsgs = true;
+
+          if(eventlog) {
+            stringstream ss;
+            ss << "GetSystemPowerStatus() failed, error " << gle << ".";
+            EventLogPost(EVENTLOG_ERROR_TYPE, EVENTLOG_ID_ERROR, NULL,
+                         ss.str());
+          }
         }
+        suppress_sps_errmsgs = true;
 
         sps_errtick = GetTickCount();
         status = prev_status;
+        if(mqtt_broker)
+          MqttService();
         continue;
       }
 
@@ -1376,99 +9931,156 @@ int main(int argc, char *argv[])
       }
     }
 
-    PROCESS_WINDOW_MESSAGES();
-
-    bool full_status_shown = false;
+    if(degrade)
+      DegradeUpdate(&status);
 
-    /* in verbose mode if SYSTEM_POWER_STATUS has changed show it in full and
-       show the battery power rate */
-    if(verbose &&
-       ComparePowerStatus(&prev_status, &status) == CPS_NOTEQUAL) {
-      cout << TIMESTAMPED_HEADER;
-      ShowPowerStatus(&status);
-      cout << left << setw(BATT_FIELD_WIDTH) << "Battery Power Rate: "
-           << right << RateStr(GetBatteryPowerRate()) << "\n";
-      cout << endl;
-      full_status_shown = true;
+    if(!degr.active) {
+      SYSTEM_BATTERY_STATE sbs;
+      SensorSample(&status, GetTickCount(),
+                   GetSystemBatteryState(&sbs) ? &sbs : NULL);
     }
 
-    /* Detect a battery revival.
-       If a battery is in a really bad state then it's possible that the
-       battery, the device or the charger will cycle the charger on and off in
-       an attempt to slowly revive the battery. A full revival may take a day.
-       That can create a lot of noise in the log, so suppress revival
-       charges when not verbose.
+    if(trace_path)
+      TraceSample(&status, GetBatteryPowerRate());
 
-       In order to detect a revival charge, record the current tick count
-       each time the charge state changes and then assume revival if
-       'max_changes' number of changes occurred within 'span_minutes'. */
+    if(coalesce_seconds)
+      CoalescePolicy(&status);
+
+    /* Raise a critical alert when the battery becomes critical on battery
+       power or when a battery that was detected no longer is. Unlike the
+       other output it's never rate limited or degraded. */
     if(monitor) {
-      const unsigned max_changes = 20;
-      const unsigned span_minutes = 30;
-      DWORD now = GetTickCount();
+      static bool was_critical, battery_seen, battery_lost;
+      bool critical = !PLUGGED_IN(status) &&
+                      status.BatteryFlag != BATTERY_FLAG_UNKNOWN &&
+                      (status.BatteryFlag & BATTERY_FLAG_CRITICAL);
+
+      if(critical && !was_critical) {
+        stringstream ss;
+        ss << "Battery is critical";
+        if(status.BatteryLifePercent <= 100)
+          ss << ", " << (unsigned)status.BatteryLifePercent << "% remaining";
+        ss << ".";
+        CriticalAlert(&status, ss.str());
+      }
+      was_critical = critical;
+
+      // a system that never had a battery isn't alerted
+      if(status.BatteryFlag != BATTERY_FLAG_UNKNOWN) {
+        if(!NO_BATTERY(status)) {
+          battery_seen = true;
+          battery_lost = false;
+        }
+        else if(battery_seen && !battery_lost) {
+          battery_lost = true;
+          CriticalAlert(&status, "No battery is detected.");
+        }
+      }
+
+      if(!critical && !battery_lost && mqtt_broker)
+        MqttUpdateField("critical", "false");
+    }
 
-      // Used like a FIFO for each change's tick count, up to max_changes
-      static deque<DWORD> ticks;
+    PROCESS_WINDOW_MESSAGES();
+
+    /* Queue any changed power status fields and publish them. */
+    if(mqtt_broker) {
+      if(!degr.active)
+        MqttUpdatePowerStatus(&status);
+      MqttService();
+    }
+
+    if(charge_profile)
+      ChargeUpdate(&status);
 
-      /* Clear all the stored ticks if more than span_minutes has passed since
-         the last charge state change. */
-      if(ticks.size() && (now - ticks.back()) >= (span_minutes * 60 * 1000))
-        ticks.clear();
+    if(drain_profile)
+      DrainUpdate(&status);
 
-      if(CHARGING(status) != CHARGING(prev_status)) {
-        if(ticks.size() == max_changes)
-          ticks.pop_front();
+    if(show_stats)
+      ResourceUpdate();
 
-        ticks.push_back(now);
+    bool full_status_shown = false;
+
+    /* in verbose mode if SYSTEM_POWER_STATUS has changed show it in full and
+       show the battery power rate. The change is compared with the status
+       that was last shown, so that hysteresis applies to slow drifts too. */
+    static SYSTEM_POWER_STATUS shown_status;
+
+    if(verbose && !degr.active &&
+       ComparePowerStatus(&shown_status, &status) == CPS_NOTEQUAL) {
+      shown_status = status;
+      if(RateLimitAllow(OUTCLASS_VERBOSE)) {
+        cout << TIMESTAMPED_HEADER;
+        ShowPowerStatus(&status);
+        cout << left << setw(BATT_FIELD_WIDTH) << "Battery Power Rate: "
+             << right << RateStr(GetBatteryPowerRate()) << "\n";
+        cout << endl;
+        full_status_shown = true;
       }
+    }
+
+    /* Detect a battery revival, see RevivalUpdate. That can create a lot of
+       noise in the log, so suppress revival charges when not verbose. */
+    if(monitor) {
+      static struct revival_state revival;
+
+      // a revival that just started is reported to the event log once
+      bool started = !revival.active;
 
       /* If there's a battery revival taking place then warn. If not verbose
          then also temporarily suppress future charge state changes while the
          revival is taking place so that it won't fill the log with noise. */
-      if(ticks.size() == max_changes) {
-        DWORD elapsed_minutes = (ticks.back() - ticks.front()) / 1000 / 60;
-
-        if(elapsed_minutes < span_minutes) {
-          if(!suppress_charge_state) {
-            suppress_charge_state = !verbose;
+      if(RevivalUpdate(&revival, CHARGING(status) != CHARGING(prev_status),
+                       GetTickCount())) {
+        if(!suppress_charge_state) {
+          suppress_charge_state = !verbose;
+
+          /* In verbose mode this is reached on each poll of the revival,
+             so a warning token is spent only when something is shown or
+             reported. */
+          bool show = (!verbose || full_status_shown);
+          bool post = (eventlog && started);
+          bool allowed = ((show || post) &&
+                          RateLimitAllow(OUTCLASS_WARNING));
+          if(allowed)
+            CoalesceUrgent();
+
+          if(post && allowed) {
+            EventLogPost(EVENTLOG_WARNING_TYPE, EVENTLOG_ID_REVIVAL,
+                         &status, "Frequent on/off charges are occurring. "
+                         "Possible battery revival or bad battery.");
+          }
 
-            if(!verbose || full_status_shown) {
-              stringstream ss;
-              ss << TIMESTAMPED_PREFIX << "WARNING: ";
-              const string &warn = ss.str();
+          if(show && allowed) {
+            stringstream ss;
+            ss << TIMESTAMPED_PREFIX << "WARNING: ";
+            const string &warn = ss.str();
 
-              cout << warn << "Frequent on/off charges are occurring." << endl
-                   << warn << "Possible battery revival or bad battery."
-                   << endl;
+            cout << warn << "Frequent on/off charges are occurring." << endl
+                 << warn << "Possible battery revival or bad battery."
+                 << endl;
 
-              if(suppress_charge_state)
-                cout << warn << "Temporarily ignoring charge state." << endl;
-            }
+            if(suppress_charge_state)
+              cout << warn << "Temporarily ignoring charge state." << endl;
           }
         }
-        else
-          suppress_charge_state = false;
       }
       else
         suppress_charge_state = false;
     }
 
-    /* Suppress the battery lifetime if less than 'span_minutes' has passed
-       since the computer woke up. The battery systray behaves similar but its
-       logic for this appears to be more complex. For example, sometimes it can
-       wait just a minute to show the lifetime and sometimes it can wait five
-       minutes. And those variations do not appear be dependent on percentage,
-       which may not have changed in the interim. */
+    /* Suppress the battery lifetime if less than RESUME_SPAN_MINUTES has
+       passed since the computer woke up. The battery systray behaves similar
+       but its logic for this appears to be more complex. For example,
+       sometimes it can wait just a minute to show the lifetime and sometimes
+       it can wait five minutes. And those variations do not appear be
+       dependent on percentage, which may not have changed in the interim. */
 
     bool recently_resumed = false;
 
     if(monitor) {
-      const unsigned span_minutes = 3;
-
       ULONGLONG lastwake;
-      ntstatus = CallNtPowerInformation(LastWakeTime, NULL, 0,
-                                        &lastwake, sizeof lastwake);
-      if(ntstatus == STATUS_SUCCESS) {
+      if(GetLastWakeTime(&lastwake)) {
         static ULONGLONG ignore_this_waketime = (ULONGLONG)-1;
 
         /* Ignore the first retrieved waketime since it most likely occurred
@@ -1477,26 +10089,19 @@ int main(int argc, char *argv[])
           ignore_this_waketime = lastwake;
 
         if(ignore_this_waketime != lastwake) {
-          /* Convert lastwake to milliseconds.  mt is a generous number of
-             100ns units of interrupt to remove from lastwake before the
-             conversion, without which GetTickCount could come before it:
-             GetTickCount: 76815265   <--- less granularity, it hasn't updated
-             Unadjusted lastwake in milliseconds: 76815269
-             For now put aside the issue of GetTickCount wraparound at
-             49d17h2m47s which has to be handled some other way. */
-          ULONGLONG mt = (MaximumTimerInterval * 2) + 10000;
-          DWORD waketick =
-            (DWORD)((lastwake > mt ? lastwake - mt : 0) / 10000);
-          DWORD elapsed_minutes = (GetTickCount() - waketick) / 1000 / 60;
-
-          if(elapsed_minutes < span_minutes) {
+          if(RecentlyResumed(lastwake, GetTickCount())) {
             static ULONGLONG prev_lastwake = (ULONGLONG)-1;
 
             recently_resumed = true;
             suppress_lifetime = !verbose;
 
-            if(full_status_shown || prev_lastwake != lastwake) {
-              prev_lastwake = lastwake;
+            if((full_status_shown || prev_lastwake != lastwake) &&
+               RateLimitAllow(OUTCLASS_WARNING)) {
+              if(eventlog && prev_lastwake != lastwake) {
+                EventLogPost(EVENTLOG_INFORMATION_TYPE, EVENTLOG_ID_RESUME,
+                             &status, "Recently resumed, "
+                             "battery lifetime is inaccurate.");
+              }
 
               cout << TIMESTAMPED_PREFIX
                    << "Recently resumed, battery lifetime is inaccurate."
@@ -1507,6 +10112,7 @@ int main(int argc, char *argv[])
                      << "Temporarily ignoring lifetime." << endl;
               }
             }
+            prev_lastwake = lastwake;
           }
           else {
             ignore_this_waketime = lastwake;
@@ -1520,85 +10126,13 @@ int main(int argc, char *argv[])
         suppress_lifetime = false;
     }
 
-    /* Calculate the average lifetime.
-       Store continuous lifetime values averaged approximately every minute for
-       the last 'lifetime_span_minutes', then compute the average of those
-       values. */
-
+    /* Calculate the average lifetime, see AverageLifetime. */
     DWORD average_lifetime = LIFETIME_UNKNOWN;
 
     if(monitor && lifetime_span_minutes) {
-      struct data { DWORD lifetime /* in seconds */, tick /* in ms */; };
-      struct data now = { status.BatteryLifeTime, GetTickCount() };
-      static deque<data> deck;
-
-      /* If the current lifetime is invalid then assume some major event has
-         occurred and invalidate the previously stored lifetimes. Else store
-         the lifetime and calculate the average lifetime.
-
-         Note it is documented behavior in Windows that lifetimes are reported
-         unknown (ie LIFETIME_UNKNOWN) when AC power is present, therefore it's
-         safe to assume a discharge in the else block. */
-      if(recently_resumed || !now.lifetime || now.lifetime == LIFETIME_UNKNOWN)
-        deck.clear();
-      else {
-        // Remove all entries older than lifetime_span_minutes
-        for(deque<data>::reverse_iterator r = deck.rbegin();
-            r != deck.rend(); ++r) {
-          if((now.tick - r->tick) > (lifetime_span_minutes * 60 * 1000)) {
-            deck.erase(deck.begin(), ((r + 1).base() + 1));
-            break;
-          }
-        }
-
-        /* If a lifetime was already reported in the last minute then fold the
-           current lifetime into that one. This is somewhat imperfect however
-           the alternative is keeping all the lifetimes that occurred within
-           lifetime_span_minutes, which could be a very large amount.
-
-           Note the tick remains unchanged, because if it was updated to the
-           current tick then subsequent iterations would always hit this block
-           instead of the else block. The idea is to create an object about
-           once a minute. */
-        if(deck.size() && (now.tick - deck.back().tick) < (60 * 1000)) {
-          deck.back().lifetime = (DWORD)(((double)deck.back().lifetime / 2) +
-                                         ((double)now.lifetime / 2));
-          if(!deck.back().lifetime)
-            deck.back().lifetime = 1;
-          if(deck.back().lifetime == LIFETIME_UNKNOWN) // can't happen, for now
-            --deck.back().lifetime;
-        }
-        else {
-          /* Make sure there's at least an entry about every minute before
-             adding the current entry. Fill in a gap of 2+ minutes by creating
-             pseudo entries based on the last reported lifetime. The main loop
-             iterates so frequently that this should be highly unlikely. */
-          if(deck.size()) {
-            DWORD elapsed_minutes = (now.tick - deck.back().tick) / 1000 / 60;
-            for(DWORD i = 1; i < elapsed_minutes; ++i) {
-              struct data d = deck.back();
-              d.tick += (60 * 1000);
-              d.lifetime = d.lifetime > 60 ? d.lifetime - 60 : 1;
-              deck.push_back(d);
-            }
-          }
-
-          deck.push_back(now);
-        }
-
-        /* Calculate an unweighted average.
-           Adjust each lifetime based on when it was reported. For example a
-           lifetime of 4400 seconds that was reported 100 seconds ago is
-           actually a lifetime of 4300 seconds. */
-        double avg = 0;
-        for(deque<data>::iterator it = deck.begin(); it != deck.end(); ++it) {
-          DWORD excess_seconds = (now.tick - it->tick) / 1000;
-          DWORD lifetime = it->lifetime > excess_seconds ?
-                           it->lifetime - excess_seconds : 1;
-          avg += (double)lifetime / deck.size();
-        }
-        average_lifetime = (DWORD)avg;
-      }
+      static deque<lifetime_data> deck;
+      average_lifetime = AverageLifetime(&deck, status.BatteryLifeTime,
+                                         GetTickCount(), recently_resumed);
     }
 
     /* Default monitor mode.
@@ -1610,64 +10144,57 @@ int main(int argc, char *argv[])
     /* Check if the battery saver status has changed. (Windows 10+) */
     if(!suppress_charge_state &&
        os.dwMajorVersion >= 10 &&
-       BATTSAVER(status) != BATTSAVER(prev_status)) {
+       BATTSAVER(status) != BATTSAVER(prev_status) &&
+       RateLimitAllow(OUTCLASS_STATUS)) {
       cout << TIMESTAMPED_PREFIX
            << SystemStatusFlagStr(status.SystemStatusFlag) << endl;
+      if(eventlog) {
+        EventLogPost(EVENTLOG_INFORMATION_TYPE, EVENTLOG_ID_BATTSAVER, &status,
+                     SystemStatusFlagStr(status.SystemStatusFlag));
+      }
     }
 
+    if(dashboard)
+      TuiUpdate(&status, average_lifetime);
+
+    static SYSTEM_POWER_STATUS reported_status;
+
     if(!full_status_shown &&
-       status.BatteryLifePercent == prev_status.BatteryLifePercent &&
-       (suppress_charge_state ||
-        (CHARGING(status) == CHARGING(prev_status))) &&
-       NO_BATTERY(status) == NO_BATTERY(prev_status) &&
-       PLUGGED_IN(status) == PLUGGED_IN(prev_status))
+       !StatusLineChanged(&status, &reported_status, &prev_status,
+                          suppress_charge_state))
       continue;
 
     /* The status has changed enough to show the one-liner output. */
 
-    stringstream line;
-    cout << TIMESTAMPED_PREFIX;
-    // Show the status in the same formats that the battery systray uses
-    if(NO_BATTERY(status)) {
-      // eg: No battery is detected
-      line << "No battery is detected";
-    }
-    else if(suppress_charge_state) {
-      // eg: 100% remaining
-      line << BatteryLifePercentStr(status.BatteryLifePercent) << " remaining";
-    }
-    else if(status.BatteryLifePercent == 100 &&
-            (suppress_lifetime ||
-             status.BatteryLifeTime == LIFETIME_UNKNOWN) &&
-            PLUGGED_IN(status) &&
-            !CHARGING(status) &&
-            !GetBatteryPowerRate()) {
-      // eg: Fully charged (100%)
-      line << "Fully charged (" << BatteryLifePercentStr(100) << ")";
-    }
-    else if(CHARGING(status) || PLUGGED_IN(status)) {
-      // eg: 100% available (plugged in, charging)
-      // eg: 99% available (plugged in, not charging)
-      line << BatteryLifePercentStr(status.BatteryLifePercent)
-           << (GetBatteryPowerRate() < 0 ? " remaining" : " available") << " ("
-           << (PLUGGED_IN(status) ? "" : "not ") << "plugged in, "
-           << (CHARGING(status) ? "" : "not ") << "charging)";
-    }
-    else if(!suppress_lifetime &&
-            status.BatteryLifeTime != LIFETIME_UNKNOWN) {
-      // eg: 27 min (15%) remaining
-      DWORD lifetime = average_lifetime != LIFETIME_UNKNOWN ?
-                       average_lifetime : status.BatteryLifeTime;
-      line << BatteryLifeTimeStr(lifetime) << " ("
-           << BatteryLifePercentStr(status.BatteryLifePercent)
-           << ") remaining";
+    reported_status = status;
+    bool show_line = RateLimitAllow(OUTCLASS_STATUS);
+
+    struct line_values lv;
+    lv.status = &status;
+    lv.average_lifetime = average_lifetime;
+    lv.rate = GetBatteryPowerRate();
+    lv.state = LineState(&status, lv.rate);
+
+    char line[LINE_FORMAT_MAX];
+    RenderLineFormat(&line_format, &lv, line, sizeof line);
+
+    if(show_line)
+      cout << TIMESTAMPED_PREFIX << line << endl;
+    if(console_title) {
+      char title[LINE_FORMAT_MAX];
+      SetConsoleTitle(RenderLineFormat(&title_format, &lv,
+                                       title, sizeof title));
     }
-    else {
-      // eg: 100% remaining
-      line << BatteryLifePercentStr(status.BatteryLifePercent) << " remaining";
+    if(mqtt_broker && !degr.active) {
+      char state[LINE_FORMAT_MAX];
+      struct fixed_buf fb = { state, 0, sizeof state };
+      FbAppendState(&fb, &lv);
+      MqttUpdateField("state", state);
+      MqttService();
+    }
+    if(eventlog && show_line) {
+      EventLogPost(EVENTLOG_INFORMATION_TYPE, EVENTLOG_ID_STATUS, &status,
+                   line);
     }
-    cout << line.str() << endl;
-    if(console_title)
-      SetConsoleTitle(line.str().c_str());
   }
 }